@@ -1,101 +1,317 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
-#include <unordered_set>
+#include <thread>
+#include <unordered_map>
 
 #include "async_internal.h"
 #include "async.h"
+#include "timer_wheel.h"
 
 using namespace std;
 
 namespace otus_hw9{
 
-    using IOStreamPtr_t = std::shared_ptr<std::iostream>;
+    static atomic<size_t> s_default_thread_count{3};
 
-    /// @brief Вспомогательный класс для хранения процессора и потока с данными 
-    class LibAsyncCtx_t
+    size_t default_thread_count()
     {
-        constexpr static const size_t thread_cnt = 3;
-    public:
-        LibAsyncCtx_t(size_t bulk_size) : 
-            iostream_(make_shared<stringstream>()), 
-            processor_(create_processor(Options(bulk_size, iostream_.get(), thread_cnt)))
-        {
-        } 
+        return s_default_thread_count.load(memory_order_relaxed);
+    }
 
-        ~LibAsyncCtx_t() 
-        {
-        } 
+    BulkSession::BulkSession(size_t bulk_size) : ctx_(make_unique<LibAsyncCtx_t>(bulk_size, default_thread_count())), linger_ns_{}
+    {
+    }
 
-        static mutex&     guard_mx()  { return guard_mx_; }
-        IOStreamPtr_t&    iostream()  { return iostream_; } 
-        IProcessorPtr_t&  processor() { return processor_; }
+    BulkSession::BulkSession(Options const& options) 
+        : ctx_(make_unique<LibAsyncCtx_t>(options)), linger_ns_(options.linger_ms * 1000000ull)
+    {
+    }
 
-        void receive(const string_view& data, bool save_status_at_stop)
+    BulkSession::~BulkSession()
+    {
+        close();
+    }
+
+    int BulkSession::feed(const char* buf, size_t buf_sz)
+    {
+        if( !ctx_ )
+            return -1;
+        ctx_->receive(std::string_view(buf, buf_sz), true);
+        return 0;
+    }
+
+    int BulkSession::close()
+    {
+        if( !ctx_ )
+            return -1;
+        ctx_->receive(std::string_view(""), false);
+        ctx_.reset();
+        return 0;
+    }
+
+    int BulkSession::reset()
+    {
+        if( !ctx_ )
+            return -1;
+        ctx_->receive(std::string_view(""), false);
+        return 0;
+    }
+
+    uint64_t BulkSession::flush_deadline() const
+    {
+        if( !ctx_ || !linger_ns_ )
+            return 0;
+        uint64_t since = ctx_->pending_since();
+        return since ? since + linger_ns_ : 0;
+    }
+
+    bool BulkSession::flush()
+    {
+        return ctx_ && ctx_->flush();
+    }
+
+    /// @brief Запись реестра C ABI: сессия и мьютекс, упорядочивающий вызовы по одному и тому же libasync_ctx_t.
+    ///        Узел таймера - место записи в колесе службы linger
+    struct LibAsyncCtxEntry_t : public TimerNode, public enable_shared_from_this<LibAsyncCtxEntry_t>
+    {
+        template <typename... Args>
+        LibAsyncCtxEntry_t(Args&&... args) : session_(std::forward<Args>(args)...), lingering_(false), pool_key_{} {}
+        mutex       guard_mx_;
+        BulkSession session_;
+        bool        lingering_;     ///< таймер хоть раз заводился, под guard_mx_
+        size_t      pool_key_;      ///< размер блока, под которым контекст возвращается в пул, 0 - не переиспользуется
+    };
+
+    using LibAsyncCtxPtr_t = shared_ptr<LibAsyncCtxEntry_t>;
+
+    namespace{
+        /// @brief Служба досрочного вывода неполных блоков для сессий C ABI: одно колесо таймеров и один поток на процесс,
+        ///        а не таймер на блок. Поток спит до ближайшего срока, а пока колесо пусто - до первого взвода. Порядок захвата: мьютекс записи, затем мьютекс службы.
+        class LingerService
         {
-            //append line to stream and run process
-            if( !*iostream() )
-                iostream()->clear();
-                
-            if( !data.empty() )
-                *iostream() << data;// << std::endl; 
-            processor()->process(save_status_at_stop);    
-        }
+        public:
+            static LingerService& instance()
+            {
+                static LingerService service;
+                return service;
+            }
+
+            /// @brief Завести таймер записи, если он еще не заведен; при срабатывании срок перепроверяется. Под мьютексом записи
+            void arm(LibAsyncCtxEntry_t& entry, uint64_t deadline_ns)
+            {
+                entry.lingering_ = true;
+                unique_lock lk(mx_);
+                if( entry.armed() )
+                    return;
+                wheel_.schedule(entry, deadline_ns);
+                if( !thread_.joinable() )
+                    thread_ = thread([this]{ run(); });
+                cv_.notify_one();
+            }
 
-    private:
-        static mutex guard_mx_;
-        IOStreamPtr_t iostream_;
-        IProcessorPtr_t processor_;
-    }; 
+            void disarm(LibAsyncCtxEntry_t& entry)
+            {
+                unique_lock lk(mx_);
+                wheel_.cancel(entry);
+            }
 
-    using LibAsyncCtxPtr_t = shared_ptr<LibAsyncCtx_t>;
+        private:
+            LingerService() : wheel_(chrono::milliseconds(1), otus_hw7::metrics_now_ns()), stop_(false) {}
+            ~LingerService()
+            {
+                {
+                    unique_lock lk(mx_);
+                    stop_ = true;
+                }
+                cv_.notify_one();
+                if( thread_.joinable() )
+                    thread_.join();
+            }
+
+            void run()
+            {
+                vector<LibAsyncCtxPtr_t> expired;
+                for(unique_lock lk(mx_); !stop_; )
+                {
+                    if( wheel_.empty() )
+                    {
+                        cv_.wait(lk, [this]{ return stop_ || !wheel_.empty(); });
+                        continue;
+                    }
+                    const uint64_t now = otus_hw7::metrics_now_ns(), next = wheel_.next_expiry_ns();
+                    if( next > now )
+                        cv_.wait_for(lk, chrono::nanoseconds(next - now));
+                    wheel_.advance(otus_hw7::metrics_now_ns(), [&expired](TimerNode& node)
+                                   { 
+                                        expired.push_back(static_cast<LibAsyncCtxEntry_t&>(node).shared_from_this()); 
+                                   });
+                    if( expired.empty() )
+                        continue;
+
+                    lk.unlock();
+                    for(auto& sp_entry : expired)
+                        flush_or_rearm(*sp_entry);
+                    expired.clear();
+                    lk.lock();
+                }
+            }
+
+            void flush_or_rearm(LibAsyncCtxEntry_t& entry)
+            {
+                unique_lock lk(entry.guard_mx_);
+                uint64_t deadline = entry.session_.flush_deadline();
+                if( !deadline )
+                    return;
+                if( deadline <= otus_hw7::metrics_now_ns() )
+                    entry.session_.flush();
+                else
+                    arm(entry, deadline);
+            }
+
+            mutex               mx_;
+            condition_variable  cv_;
+            TimerWheel          wheel_;
+            thread              thread_;
+            bool                stop_;
+        };
+    }
     using LibAsyncCtxPool_t = unordered_map<libasync_ctx_t, LibAsyncCtxPtr_t>;
+    using LibAsyncCtxFree_t = unordered_map<size_t, vector<LibAsyncCtxPtr_t>>;
 
     static LibAsyncCtxPool_t s_context_pool;
+    /// @brief Последний выданный ид сессии. Ид не повторяются, поэтому ид отключенной сессии не попадает 
+    ///        в контекст из пула, выданный следующему connect
+    static uintptr_t s_last_handle = 0;
     mutex LibAsyncCtx_t::guard_mx_;
 
+    /// @brief Отключенные контексты с готовым конвейером по размеру блока - connect берет их вместо создания нового.
+    ///        Под тем же глобальным мьютексом, что и реестр
+    static LibAsyncCtxFree_t s_free_contexts;
+    static size_t s_free_count = 0;
+    /// @brief По умолчанию пул выключен: отключенный контекст держит потоки исполнителей своего конвейера, 
+    ///        и без явного включения процесс не должен сохранять их после отключения клиента
+    static size_t s_free_capacity = 0;
+
+    namespace{
+        LibAsyncCtxPtr_t take_free_ctx(size_t bulk_size)
+        {
+            unique_lock lk(LibAsyncCtx_t::guard_mx());
+            auto p_free = s_free_contexts.find(bulk_size);
+            if( p_free == s_free_contexts.end() || p_free->second.empty() )
+                return nullptr;
+            LibAsyncCtxPtr_t sp_ctx = std::move(p_free->second.back());
+            p_free->second.pop_back();
+            --s_free_count;
+            return sp_ctx;
+        }
+
+        /// @return false - пул полон, контекст надо закрыть
+        bool put_free_ctx(LibAsyncCtxPtr_t const& sp_ctx)
+        {
+            unique_lock lk(LibAsyncCtx_t::guard_mx());
+            if( s_free_count >= s_free_capacity )
+                return false;
+            s_free_contexts[sp_ctx->pool_key_].push_back(sp_ctx);
+            ++s_free_count;
+            return true;
+        }
+
+        libasync_ctx_t register_ctx(LibAsyncCtxPtr_t sp_async_ctx)
+        {
+            unique_lock lk(LibAsyncCtx_t::guard_mx());        
+            libasync_ctx_t ctx = reinterpret_cast<libasync_ctx_t>(++s_last_handle);
+            s_context_pool[ctx] = std::move(sp_async_ctx);
+            return ctx;
+        }
+
+        /// @brief Поиск сессии под глобальным мьютексом, сама обработка идет уже без него 
+        LibAsyncCtxPtr_t find_ctx(libasync_ctx_t ctx, bool erase)
+        {
+            unique_lock lk(LibAsyncCtx_t::guard_mx());        
+            auto p_ctx = s_context_pool.find(ctx);
+            if( p_ctx == s_context_pool.end() )
+                return nullptr;
+            LibAsyncCtxPtr_t sp_ctx = p_ctx->second;
+            if( erase )
+                s_context_pool.erase(p_ctx);
+            return sp_ctx;
+        }
+    }
 
     libasync_ctx_t  connect(size_t bulk_size)
     {
-        using namespace otus_hw9;
-        std::ignore = bulk_size;
+        LibAsyncCtxPtr_t sp_ctx = take_free_ctx(bulk_size);
+        if( !sp_ctx )
+        {
+            sp_ctx = make_shared<LibAsyncCtxEntry_t>(bulk_size);
+            sp_ctx->pool_key_ = bulk_size;
+        }
+        return register_ctx(std::move(sp_ctx));
+    }
 
-        unique_lock lk(LibAsyncCtx_t::guard_mx());        
-        LibAsyncCtxPtr_t sp_async_ctx = make_shared<LibAsyncCtx_t>(bulk_size);
-        s_context_pool[sp_async_ctx.get()] = sp_async_ctx;
-        return sp_async_ctx.get();
+    libasync_ctx_t  connect(Options const& options)
+    {
+        return register_ctx(make_shared<LibAsyncCtxEntry_t>(options));
     }
 
     int receive(libasync_ctx_t ctx, const char buf[], size_t buf_sz)
     {
-        using namespace otus_hw9;
-        std::ignore = ctx;
-        std::ignore = buf;
-        std::ignore = buf_sz;
-        
-        unique_lock lk(LibAsyncCtx_t::guard_mx());        
-
-        auto p_ctx = s_context_pool.find(ctx);
-        if( p_ctx == s_context_pool.end() )
+        LibAsyncCtxPtr_t sp_ctx = find_ctx(ctx, false);
+        if( !sp_ctx )
             return -1;
 
-        p_ctx->second->receive(std::string_view(buf, buf_sz), true);    
-        return 0;
+        unique_lock lk(sp_ctx->guard_mx_);        
+        int rc = sp_ctx->session_.feed(buf, buf_sz);
+        if( uint64_t deadline = sp_ctx->session_.flush_deadline() )
+            LingerService::instance().arm(*sp_ctx, deadline);
+        return rc;
     }
 
     int disconnect(libasync_ctx_t ctx)
     {
-        using namespace otus_hw9;
-        std::ignore = ctx;
-
-        unique_lock lk(LibAsyncCtx_t::guard_mx());        
-
-        auto p_ctx = s_context_pool.find(ctx);
-        if( p_ctx == s_context_pool.end() )
+        LibAsyncCtxPtr_t sp_ctx = find_ctx(ctx, true);
+        if( !sp_ctx )
             return -1;
         
-        p_ctx->second->receive(std::string_view(""), false);    
-        //p_ctx->second->processor()->process(false);
-        s_context_pool.erase(p_ctx);
-        return 0;
+        unique_lock lk(sp_ctx->guard_mx_);        
+        if( sp_ctx->lingering_ )
+            LingerService::instance().disarm(*sp_ctx);
+        // блок завершается в любом случае, а конвейер по возможности остается следующему connect
+        if( sp_ctx->pool_key_ && !sp_ctx->session_.reset() && put_free_ctx(sp_ctx) )
+            return 0;
+        return sp_ctx->session_.close();
+    }
+
+    void set_context_pool_capacity(size_t capacity)
+    {
+        vector<LibAsyncCtxPtr_t> trimmed;
+        {
+            unique_lock lk(LibAsyncCtx_t::guard_mx());
+            s_free_capacity = capacity;
+            for(auto& [bulk_size, free] : s_free_contexts)
+                while( s_free_count > s_free_capacity && !free.empty() )
+                    trimmed.push_back(std::move(free.back())), free.pop_back(), --s_free_count;
+        }
+        // остановка потоков исполнителей - уже без глобального мьютекса
+        trimmed.clear();
+    }
+
+    void set_default_thread_count(size_t thread_count)
+    {
+        vector<LibAsyncCtxPtr_t> trimmed;
+        {
+            // пул ключуется только размером блока - контексты прежнего режима ему больше не подходят
+            unique_lock lk(LibAsyncCtx_t::guard_mx());
+            s_default_thread_count.store(std::max<size_t>(thread_count, 1), memory_order_relaxed);
+            for(auto& [bulk_size, free] : s_free_contexts)
+                for(auto& sp_ctx : free)
+                    trimmed.push_back(std::move(sp_ctx));
+            s_free_contexts.clear();
+            s_free_count = 0;
+        }
+        trimmed.clear();
     }
 }
 
@@ -107,12 +323,22 @@ extern "C"
         return otus_hw9::connect(bulk_size);
     }
 
+    void libasync_set_thread_count(size_t thread_count)
+    {
+        otus_hw9::set_default_thread_count(thread_count);
+    }
+
+    void libasync_set_context_pool_capacity(size_t capacity)
+    {
+        otus_hw9::set_context_pool_capacity(capacity);
+    }
+
     int libasync_receive(libasync_ctx_t ctx, const char buf[], size_t buf_sz)
     {
         return otus_hw9::receive(ctx, buf, buf_sz);
     }
 
-    /// @brief Закрывает сессию и разрушает контекст. С точки зрения логики обработки команд этот вызов считается завершением текущего блока команд.
+    /// @brief Закрывает сессию, контекст с конвейером возвращается в пул, если он включен. С точки зрения логики обработки команд этот вызов считается завершением текущего блока команд.
     /// @param ctx 
     /// @return 0 - успешно, иначе код ошибки
     int libasync_disconnect(libasync_ctx_t ctx)
@@ -120,5 +346,4 @@ extern "C"
         return otus_hw9::disconnect(ctx);
     }
 
-};
-
+};
\ No newline at end of file
@@ -1,5 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
 extern "C"
 {
     typedef void* libasync_ctx_t;
@@ -9,6 +17,15 @@ extern "C"
     /// @return контекст (ид) сессии.
     libasync_ctx_t  libasync_connect(size_t bulk_size);
 
+    /// @brief Число потоков обработки для следующих libasync_connect (по умолчанию 3). 
+    ///        1 - синхронный режим: блоки выводятся внутри libasync_receive, без потоков исполнителей и блокировок.
+    /// @param thread_count - 0 трактуется как 1
+    void libasync_set_thread_count(size_t thread_count);
+
+    /// @brief Сколько отключенных сессий держать готовыми к следующему libasync_connect с тем же размером блока.
+    ///        Отключенная сессия из пула держит потоки своего конвейера. 0 (по умолчанию) - сессия разрушается при отключении
+    void libasync_set_context_pool_capacity(size_t capacity);
+
     /// @brief принимает команду (список команд, если встречается перевод строки). 
     /// @param ctx контекст 
     /// @param buf  указателя на начало буфера с текстом команд
@@ -16,7 +33,9 @@ extern "C"
     /// @return 0 - успешно, иначе код ошибки
     int libasync_receive(libasync_ctx_t ctx, const char buf[], size_t buf_sz);
 
-    /// @brief Закрывает сессию и разрушает контекст. С точки зрения логики обработки команд этот вызов считается завершением текущего блока команд.
+    /// @brief Закрывает сессию. С точки зрения логики обработки команд этот вызов считается завершением текущего блока команд.
+    ///        Если пул включен (libasync_set_context_pool_capacity), конвейер достается следующему libasync_connect, 
+    ///        ctx после вызова недействителен.
     /// @param ctx 
     /// @return 0 - успешно, иначе код ошибки
     int libasync_disconnect(libasync_ctx_t ctx);
@@ -24,8 +43,76 @@ extern "C"
 
 namespace otus_hw9
 {
+    struct Options;
+    class LibAsyncCtx_t;
+
+    /// @brief Сессия обработки команд для внутрипроцессных пользователей. 
+    ///        Владеет конвейером напрямую: ни реестра контекстов, ни глобального мьютекса на пути данных.
+    ///        Не потокобезопасна - одну сессию одновременно использует один поток.
+    class BulkSession
+    {
+    public:
+        explicit BulkSession(size_t bulk_size);
+
+        /// @brief Сессия с заданными настройками конвейера. Поле is_ игнорируется - у сессии свой поток для принятых данных.
+        explicit BulkSession(Options const& options);
+
+        /// @brief Закрывает сессию, если не закрыта явно
+        ~BulkSession();
+
+        BulkSession(BulkSession const&) = delete;
+        BulkSession& operator=(BulkSession const&) = delete;
+
+        /// @brief Принимает порцию данных (команды через перевод строки) и отдает готовые блоки исполнителям
+        /// @return 0 - успешно, иначе код ошибки
+        int  feed(const char* buf, size_t buf_sz);
+        int  feed(std::string_view data) { return feed(data.data(), data.size()); }
+#if __cplusplus >= 202002L
+        int  feed(std::span<const char> data) { return feed(data.data(), data.size()); }
+#endif
+
+        /// @brief Завершает текущий блок команд, дальнейшие feed() возвращают ошибку
+        /// @return 0 - успешно, иначе код ошибки
+        int  close();
+        bool closed() const { return !ctx_; }
+
+        /// @brief Завершает текущий блок команд, как close(), но сохраняет конвейер (парсер, очереди, потоки исполнителей) - 
+        ///        сессию можно отдать следующему соединению
+        /// @return 0 - успешно, иначе код ошибки (сессия уже закрыта)
+        int  reset();
+
+        /// @brief Срок в нс часов metrics_now_ns(), когда неполный статический блок надо вывести по linger_ms.
+        ///        0 - ждать нечего или задержка выключена. Таймер заводит владелец сессии, по сроку зовет flush()
+        uint64_t flush_deadline() const;
+
+        /// @brief Выводит неполный статический блок, не дожидаясь полного размера
+        /// @return false - выводить нечего
+        bool flush();
+
+    private:
+        std::unique_ptr<LibAsyncCtx_t> ctx_;
+        uint64_t linger_ns_;
+    };
+
+    using BulkSessionPtr_t = std::unique_ptr<BulkSession>;
 
     libasync_ctx_t  connect(size_t bulk_size);
+
+    /// @brief Открывает сессию с заданными настройками конвейера (число потоков, раздача файловым воркерам и т.п.).
+    ///        Поле is_ игнорируется - у сессии свой поток для принятых данных.
+    libasync_ctx_t  connect(Options const& options);
     int receive(libasync_ctx_t ctx, const char buf[], size_t buf_sz);
+
+    /// @brief Завершает текущий блок. Контекст connect(bulk_size) вместе с конвейером возвращается в пул 
+    ///        и достается следующему connect с тем же размером блока под новым ид - ctx после вызова недействителен
     int disconnect(libasync_ctx_t ctx);
+
+    /// @brief Сколько отключенных контекстов держать в пуле, 0 (по умолчанию) - контекст разрушается при disconnect
+    void set_context_pool_capacity(size_t capacity);
+
+    /// @brief  Число потоков обработки сессий connect(bulk_size) и BulkSession(bulk_size), по умолчанию 3.
+    ///         1 - синхронный режим: разбор, форматирование и запись блока идут в вызывающем потоке внутри receive/feed.
+    ///         Действует на новые сессии, отключенные контексты прежнего режима из пула удаляются
+    void   set_default_thread_count(size_t thread_count);
+    size_t default_thread_count();
 }
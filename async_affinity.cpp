@@ -0,0 +1,136 @@
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <tuple>
+#include <iterator>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef USE_NUMA
+#include <numa.h>
+#endif
+
+#include "async_affinity.h"
+
+namespace otus_hw9{
+
+    CpuSet_t parse_cpu_list(std::string const& cpu_list)
+    {
+        CpuSet_t cpus;
+        std::istringstream iss(cpu_list);
+        for(std::string item; std::getline(iss, item, ','); )
+        {
+            if( item.empty() )
+                continue;
+            size_t pos = 0;
+            int first = 0, last = 0;
+            try
+            {
+                first = last = std::stoi(item, &pos);
+                if( pos < item.size() && item[pos] == '-' )
+                {
+                    std::string tail = item.substr(pos + 1);
+                    last = std::stoi(tail, &pos);
+                    pos += item.size() - tail.size();
+                }
+            }
+            catch(std::exception const&)
+            {
+                throw std::invalid_argument("Invalid cpu list: " + cpu_list);
+            }
+            if( pos != item.size() || first < 0 || last < first )
+                throw std::invalid_argument("Invalid cpu list: " + cpu_list);
+            for(int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return cpus;
+    }
+
+    bool pin_current_thread(CpuSet_t const& cpus)
+    {
+        if( cpus.empty() )
+            return false;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int cpu : cpus)
+            if( cpu < CPU_SETSIZE )
+                CPU_SET(cpu, &set);
+        if( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) )
+            return false;
+        prefer_numa_node(numa_node_of(cpus));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int numa_node_of(int cpu)
+    {
+#ifdef USE_NUMA
+        if( numa_available() >= 0 )
+        {
+            int node = numa_node_of_cpu(cpu);
+            return node < 0 ? 0 : node;
+        }
+#endif
+        std::ignore = cpu;
+        return 0;
+    }
+
+    int numa_node_of(CpuSet_t const& cpus)
+    {
+        return cpus.empty() ? -1 : numa_node_of(cpus.front());
+    }
+
+    CpuSet_t cpus_on_node(CpuSet_t const& cpus, int node)
+    {
+        CpuSet_t on_node;
+        std::copy_if(cpus.begin(), cpus.end(), std::back_inserter(on_node), [node](int cpu){ return numa_node_of(cpu) == node; });
+        return on_node;
+    }
+
+    void prefer_numa_node(int node)
+    {
+#ifdef USE_NUMA
+        if( node >= 0 && numa_available() >= 0 )
+            numa_set_preferred(node);
+#else
+        std::ignore = node;
+#endif
+    }
+
+    void* numa_alloc(size_t sz, int node)
+    {
+#ifdef USE_NUMA
+        if( numa_available() >= 0 )
+        {
+            void* p = node >= 0 ? numa_alloc_onnode(sz, node) : numa_alloc_local(sz);
+            if( !p )
+                throw std::bad_alloc();
+            return p;
+        }
+#else
+        std::ignore = node;
+#endif
+        return ::operator new(sz);
+    }
+
+    void numa_free(void* p, size_t sz)
+    {
+#ifdef USE_NUMA
+        if( numa_available() >= 0 )
+        {
+            ::numa_free(p, sz);
+            return;
+        }
+#endif
+        std::ignore = sz;
+        ::operator delete(p);
+    }
+}
\ No newline at end of file
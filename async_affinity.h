@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <new>
+
+namespace otus_hw9{
+
+    /// @brief Набор номеров процессоров (логических ядер)
+    using CpuSet_t = std::vector<int>;
+
+    /// @brief Разбор списка процессоров в формате taskset/cpuset: "0-3,8,10-11". 
+    /// @throw std::invalid_argument при ошибке формата
+    CpuSet_t  parse_cpu_list(std::string const& cpu_list);
+
+    /// @brief Привязывает текущий поток к набору процессоров. Пустой набор - без привязки.
+    /// @return true - привязка выполнена
+    bool      pin_current_thread(CpuSet_t const& cpus);
+
+    /// @brief Узел NUMA процессора. Без libnuma (или на не-NUMA машине) всегда 0.
+    int       numa_node_of(int cpu);
+
+    /// @brief Узел NUMA набора процессоров - узел первого процессора, -1 для пустого набора
+    int       numa_node_of(CpuSet_t const& cpus);
+
+    /// @brief Процессоры набора, принадлежащие заданному узлу NUMA
+    CpuSet_t  cpus_on_node(CpuSet_t const& cpus, int node);
+
+    /// @brief Выделяет память для текущего потока предпочтительно на заданном узле (при наличии libnuma)
+    void      prefer_numa_node(int node);
+
+    /// @brief Выделение/освобождение памяти на узле NUMA. Без libnuma - обычный operator new/delete.
+    void*     numa_alloc(size_t sz, int node);
+    void      numa_free(void* p, size_t sz);
+
+    /// @brief Удалитель для объектов, размещенных на узле NUMA через make_on_numa_node
+    template <typename T>
+    struct NumaDeleter
+    {
+        void operator()(T* p) const 
+        {
+            if( !p ) return;
+            p->~T();
+            numa_free(p, sizeof(T));
+        }
+    };
+
+    template <typename T>
+    using NumaPtr_t = std::unique_ptr<T, NumaDeleter<T>>;
+
+    /// @brief Создает объект в памяти узла NUMA (node < 0 - без привязки к узлу)
+    template <typename T, typename... Args>
+    NumaPtr_t<T> make_on_numa_node(int node, Args&&... args)
+    {
+        void* p = numa_alloc(sizeof(T), node);
+        try
+        {
+            return NumaPtr_t<T>{ new (p) T(std::forward<Args>(args)...) };
+        }
+        catch(...)
+        {
+            numa_free(p, sizeof(T));
+            throw;
+        }
+    }
+}
\ No newline at end of file
@@ -3,26 +3,55 @@
 #include <sstream>
 #include <map>
 #include <algorithm>
+#include <functional>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "async_internal.h"
+#include "async_pipeline.h"
 
 namespace otus_hw9{
     using namespace std;
+    CommandQueueMT::CommandQueueMT(Type type) 
+        : type_(type), depth_(otus_hw7::metrics().queue_depth_[static_cast<size_t>(type)]), commands_{}
+    {
+        otus_hw7::metrics().queue_count_[static_cast<size_t>(type_)].add();
+    }
+
+    CommandQueueMT::~CommandQueueMT()
+    {
+        depth_.sub(commands_);
+        otus_hw7::metrics().queue_count_[static_cast<size_t>(type_)].sub();
+    }
+
     bool CommandQueueMT::pop(ICommandPtr_t& cmd) 
     {
         lk_t lk(guard_mx_);
-        return BaseCls_t::pop(cmd);
+        bool popped = BaseCls_t::pop(cmd);
+        if( popped )
+        {
+            const int64_t n = cmd ? static_cast<int64_t>(cmd->command_count()) : 1;
+            commands_ -= n;
+            depth_.sub(n);
+        }
+        return popped;
     }
 
     ICommandQueue&     CommandQueueMT::push(ICommandPtr_t cmd)
     {
+        const int64_t n = cmd ? static_cast<int64_t>(cmd->command_count()) : 1;
         lk_t lk(guard_mx_);
+        commands_ += n;
+        depth_.add(n);
         return BaseCls_t::push( std::move(cmd) );
     }
     
     ICommandQueue&     CommandQueueMT::reset()
     {
         lk_t lk(guard_mx_);
+        depth_.sub(commands_);
+        commands_ = 0;
         return BaseCls_t::reset();
     }
 
@@ -76,7 +105,7 @@ namespace otus_hw9{
 
             if( q.bulk_id_ != ctx.bulk_id_ )
             {
-                q.bulk_id_ = ctx.bulk_id_.load();
+                q.bulk_id_ = ctx.bulk_id_;
                 ICommandContextPtr_t  sp_cmd_ctx = make_shared<ICommandContext>(ctx);
                 // трансформация элементов массива в очередь с запаковкой в декоратор с контекстом и исполнителем
                 std::transform(begin(commands) + pos, begin(commands) + pos + cnt, 
@@ -90,6 +119,20 @@ namespace otus_hw9{
             }
             execute(q, ctx, cnt);
         }
+
+        /// @brief Пакет - одна команда в очереди и одно пробуждение потока. Файловые воркеры после поставщика 
+        ///        находят пакет уже в общей очереди по ее ИД блока и только пробуждаются
+        virtual void execute_batch(ICommandQueue& q, BulkBatchPtr_t const& batch) override
+        {
+            if( batch->bulks_.empty() )
+                return;
+            if( q.bulk_id_ != batch->id() )
+            {
+                q.bulk_id_ = batch->id();
+                q.push(make_shared<otus_hw7::BulkBatchCommand>(batch));
+            }
+            execute(q, batch->bulks_.front().ctx_, 1);
+        }
     };
     
     ProcessorMT::ProcessorMT(IInputParserPtr_t parser, ICommandQueuePtr_t cmd_queue, IQueueExecutorPtr_t executor) :
@@ -97,7 +140,37 @@ namespace otus_hw9{
     {
     }
 
-    QueueExecutorMT::QueueExecutorMT(size_t thread_count) : 
+    void ProcessorMT::process(bool save_status_at_stop)
+    {
+        BaseCls_t::process(save_status_at_stop);
+        dispatch_batch();
+    }
+
+    /// @brief Готовый блок копится в пакете. Пакет уходит исполнителям в конце process(), по достижении max_batch_bulks
+    ///        или когда следующее чтение будет ждать ввода - интерактивный ввод не задерживается
+    void ProcessorMT::exec_queue()
+    {
+        otus_hw7::TraceScope trace_scope(otus_hw7::TraceEventId::kDispatchBulk, cmd_queue_->bulk_id_, cmd_queue_->bulk_size_);
+        setup_context();
+        if( !batch_ )
+            batch_ = make_shared<BulkBatch>();
+        const size_t pos = batch_->commands_.size();
+        cmd_queue_->move_commands_to_array(batch_->commands_, ctx_->bulk_size_);
+        batch_->bulks_.push_back(BulkBatch::Bulk{pos, batch_->commands_.size() - pos, *ctx_});
+
+        if( batch_->bulks_.size() >= max_batch_bulks || !parser_->input_buffered() )
+            dispatch_batch();
+    }
+
+    void ProcessorMT::dispatch_batch()
+    {
+        if( !batch_ )
+            return;
+        BulkBatchPtr_t batch = std::move(batch_);
+        executor_->execute_batch(*cmd_queue_, batch);
+    }
+
+    QueueExecutorMT::QueueExecutorMT(size_t thread_count, FileSinkMode file_sink, size_t file_workers_max, CpuSet_t worker_cpus) : 
         QueueExecutorMulti((thread_count < 2 ? thread_count = 2 : thread_count) + 1,
             otus_hw9::create_command_queue(ICommandQueue::Type::qLog),
             otus_hw9::create_command_queue(ICommandQueue::Type::qFile)
@@ -108,15 +181,22 @@ namespace otus_hw9{
         // 0th - log thread
         // 1 - file queue provider threads
         // 2..N - file consumer threads
-        IQueueExecutorPtr_t sp_exec = make_shared<QueueExecutorWithPackingDecorator>(make_shared<QueueExecutorWithThread>());
+        IQueueExecutorPtr_t sp_exec = make_shared<QueueExecutorWithPackingDecorator>(make_shared<QueueExecutorWithThread>(worker_cpus));
         // DBG_TRACE( "QueueExecutorMT", "this: " << this << ", log_executor: " << sp_exec.get() )
 
         add_worker(sp_exec);
         --thread_count;
+
+        // автомасштабирование работает только поверх локальных деков планировщика
+        if( FileSinkMode::kWorkStealing == file_sink || file_workers_max > 0 )
+        {
+            // 1 - планировщик с локальными деками на thread_count - 1 файловых воркеров (до file_workers_max при автомасштабировании)
+            add_worker( make_shared<QueueExecutorWorkStealing>(thread_count - 1, file_workers_max, worker_cpus) );
+            return;
+        }
         
         sp_exec = make_shared<QueueExecutorToFileInitializer>(
                         make_shared<QueueExecutorWithPackingDecorator>(nullptr), 
-                            otus_hw9::create_command_queue(ICommandQueue::Type::qFile), 
                             make_shared<QueueExecutor>()      
                     );
         // DBG_TRACE( "QueueExecutorMT", "this: " << this << ", file_pusher_executor: " << sp_exec.get() )
@@ -125,16 +205,13 @@ namespace otus_hw9{
         std::ignore = i;
         while(thread_count-- > 0)
         {
-            sp_exec = make_shared<QueueExecutorWithPackingDecorator>(make_shared<QueueExecutorWithThread>());
+            sp_exec = make_shared<QueueExecutorWithPackingDecorator>(make_shared<QueueExecutorWithThread>(worker_cpus));
             // DBG_TRACE( "QueueExecutorMT", "this: " << this << ", file_in_thread_executor[" << i++ << "]: " << sp_exec.get() )
             add_worker(sp_exec); 
         }
     }
 
-    std::mutex QueueExecutorWithThread::cmd_wait_mx;
-    std::condition_variable QueueExecutorWithThread::cmd_wait_cv;
-
-    QueueExecutorWithThread::QueueExecutorWithThread() : stop_flag_(false), q_(nullptr)
+    QueueExecutorWithThread::QueueExecutorWithThread(CpuSet_t cpus) : cpus_(std::move(cpus)), stop_flag_(false), q_(nullptr)
     {
         // DBG_TRACE( "QueueExecutorWithThread", "this: " << this )
     }
@@ -144,7 +221,10 @@ namespace otus_hw9{
         // DBG_TRACE( "~QueueExecutorWithThread", "this: " << this << ", work_thread_.joinable: " << work_thread_.joinable() )
         if( work_thread_.joinable() )
         {
-            stop_flag_ = true;
+            {
+                std::lock_guard lk(cmd_wait_mx);
+                stop_flag_ = true;
+            }
             cmd_wait_cv.notify_all();
             work_thread_.join();
         }
@@ -156,17 +236,21 @@ namespace otus_hw9{
         // DBG_TRACE( "execute", "this: " << this << ", q: " << &q << ", q:[" << q << "]" << ", ctx: " << &ctx << ", cnt: " << cnt )
         if( !work_thread_.joinable() )
         {
-            ctx_.reset( new ICommandContext(ctx) );
-            ctx_->bulk_size_ = std::max(cnt, ctx_->bulk_size_.load());
+            ctx_ = make_shared<PaddedCommandContext>(ctx);
+            ctx_->bulk_size_ = std::max(cnt, ctx_->bulk_size_);
             q_ = &q; 
             work_thread_ = std::thread{&QueueExecutorWithThread::execute_q, this};
             // DBG_TRACE( "execute", "this: " << this << " | work_thread_: " << hex << work_thread_.get_id() << ", ctx_: " << ctx_.get() )
         }
+        // команда уже в очереди; пустой захват мьютекса не дает сигналу проскочить между проверкой 
+        // условия ожидания и засыпанием потока
+        { std::lock_guard lk(cmd_wait_mx); }
         cmd_wait_cv.notify_one();
     }
     
     void QueueExecutorWithThread::execute_q()
     {
+        pin_current_thread(cpus_);
         bool q_empty_at_stop = false;
         while( !stop_flag_ || !q_empty_at_stop )
         {
@@ -190,18 +274,275 @@ namespace otus_hw9{
         }
     }           
 
+    namespace{
+        /// @brief Воркер планировщика, к которому принадлежит текущий поток
+        struct WorkStealingSlot
+        {
+            WorkStealingScheduler const* scheduler_;
+            size_t                       idx_;
+        };
+        thread_local WorkStealingSlot tls_work_stealing_slot{nullptr, 0};
+    }
+
+    WorkStealingScheduler::WorkStealingScheduler(size_t worker_count, size_t max_worker_count, AutoscalePolicy policy, CpuSet_t cpus) : 
+        min_workers_(worker_count ? worker_count : 1), policy_(policy), cpus_(std::move(cpus)), 
+        active_{min_workers_}, pending_{}, stop_flag_{false}
+    {
+        // деки создаются сразу на максимум воркеров - вектор не перестраивается и воровать можно у любого слота.
+        // Состояние воркера размещается на узле NUMA его процессоров
+        const size_t capacity = std::max(min_workers_, max_worker_count);
+        const int node = numa_node_of(cpus_);
+        workers_.reserve(capacity);
+        for(size_t i = 0; i < capacity; ++i)
+            workers_.emplace_back(make_on_numa_node<Worker>(node));
+        for(size_t i = 0; i < min_workers_; ++i)
+            workers_[i]->thread_ = std::thread{&WorkStealingScheduler::run, this, i};
+        if( capacity > min_workers_ )
+            supervisor_ = std::thread{&WorkStealingScheduler::supervise, this};
+    }
+
+    WorkStealingScheduler::~WorkStealingScheduler()
+    {
+        {
+            lk_t lk(idle_mx_);
+            stop_flag_ = true;
+        }
+        idle_cv_.notify_all();
+        supervisor_cv_.notify_all();
+        if( supervisor_.joinable() )
+            supervisor_.join();
+        for(auto& w : workers_)
+            if( w->thread_.joinable() )
+                w->thread_.join();
+    }
+
+    /// @brief Дек для новой задачи: свой, если отправляет воркер этого же планировщика, иначе - по номеру текущего ядра
+    size_t WorkStealingScheduler::submit_slot() const
+    {
+        const size_t active = active_.load();
+        if( tls_work_stealing_slot.scheduler_ == this && tls_work_stealing_slot.idx_ < active )
+            return tls_work_stealing_slot.idx_;
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if( cpu >= 0 )
+            return static_cast<size_t>(cpu) % active;
+#endif
+        return std::hash<std::thread::id>{}(std::this_thread::get_id()) % active;
+    }
+
+    void WorkStealingScheduler::submit(Task task)
+    {
+        Worker& w = *workers_[submit_slot()];
+        {
+            lk_t lk(w.guard_mx_);
+            w.tasks_.push_back(std::move(task));
+        }
+        {
+            lk_t lk(idle_mx_);
+            ++pending_;
+        }
+        idle_cv_.notify_one();
+    }
+
+    bool WorkStealingScheduler::pop_local(size_t idx, Task& task)
+    {
+        Worker& w = *workers_[idx];
+        lk_t lk(w.guard_mx_);
+        if( w.tasks_.empty() )
+            return false;
+        task = std::move(w.tasks_.front());
+        w.tasks_.pop_front();
+        return true;
+    }
+
+    /// @brief Перехват задачи у соседей. Просматриваются все слоты, включая выведенные из работы, 
+    ///        чтобы не потерять задачи, попавшие в дек воркера в момент его остановки
+    bool WorkStealingScheduler::steal(size_t idx, Task& task)
+    {
+        for(size_t i = 1; i < workers_.size(); ++i)
+        {
+            Worker& victim = *workers_[(idx + i) % workers_.size()];
+            lk_t lk(victim.guard_mx_, std::try_to_lock);
+            if( !lk.owns_lock() || victim.tasks_.empty() )
+                continue;
+            task = std::move(victim.tasks_.back());
+            victim.tasks_.pop_back();
+            otus_hw7::trace(otus_hw7::TraceEventId::kSteal, otus_hw7::TracePhase::kInstant, idx, (idx + i) % workers_.size());
+            return true;
+        }
+        return false;
+    }
+
+    void WorkStealingScheduler::run(size_t idx)
+    {
+        using clock_t = std::chrono::steady_clock;
+        tls_work_stealing_slot = WorkStealingSlot{this, idx};
+        pin_current_thread(cpus_);
+        Worker& self = *workers_[idx];
+        for(;;)
+        {
+            Task task;
+            const bool retired = idx >= active_.load();
+            if( pop_local(idx, task) || (!retired && steal(idx, task)) )
+            {
+                --pending_;
+                auto start = clock_t::now();
+                (*task.cmd_)(*task.ctx_);
+                self.busy_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - start).count();
+                continue;
+            }
+            // свой дек пуст - выведенный из работы воркер завершается, задачи в пути уже выполнены.
+            // Решение - под idle_mx_: grow() либо вернет воркер в работу, либо увидит его завершенным
+            if( retired )
+            {
+                lk_t lk(idle_mx_);
+                if( idx >= active_.load() )
+                {
+                    self.exited_ = true;
+                    break;
+                }
+                continue;
+            }
+
+            lk_t lk(idle_mx_);
+            if( stop_flag_ && !pending_ )
+                break;
+            idle_cv_.wait(lk, [&](){ return pending_ > 0 || stop_flag_ || idx >= active_.load(); } );
+            if( stop_flag_ && !pending_ )
+                break;
+        }
+    }
+
+    void WorkStealingScheduler::grow()
+    {
+        std::thread finished;
+        size_t idx;
+        {
+            lk_t lk(idle_mx_);
+            idx = active_.load();
+            if( idx >= workers_.size() )
+                return;
+            Worker& w = *workers_[idx];
+            ++active_;
+            // выведенный воркер еще дорабатывает свой дек - он просто остается в работе, ждать его нельзя
+            if( !w.thread_.joinable() || w.exited_ )
+            {
+                finished = std::move(w.thread_);
+                w.exited_ = false;
+                w.thread_ = std::thread{&WorkStealingScheduler::run, this, idx};
+            }
+        }
+        // прежний поток уже вышел из run() - join не ждет выполнения задач
+        if( finished.joinable() )
+            finished.join();
+        otus_hw7::trace(otus_hw7::TraceEventId::kGrow, otus_hw7::TracePhase::kInstant, idx + 1);
+    }
+
+    void WorkStealingScheduler::shrink()
+    {
+        if( active_.load() <= min_workers_ )
+            return;
+        {
+            lk_t lk(idle_mx_);
+            --active_;
+        }
+        otus_hw7::trace(otus_hw7::TraceEventId::kShrink, otus_hw7::TracePhase::kInstant, active_.load());
+        // последний воркер доработает свой дек и завершится, поток соберем при следующем росте или в деструкторе
+        idle_cv_.notify_all();
+    }
+
+    /// @brief Поток-наблюдатель: раз в tick_ снимает глубину очередей и загрузку воркеров. 
+    ///        Рост - сразу при перегрузке, сокращение - только после shrink_ticks_ подряд низкой загрузки.
+    void WorkStealingScheduler::supervise()
+    {
+        using namespace std::chrono;
+        std::vector<nanoseconds::rep> last_busy(workers_.size());
+        size_t idle_ticks = 0;
+        auto last_tick = steady_clock::now();
+        for(;;)
+        {
+            {
+                lk_t lk(idle_mx_);
+                if( supervisor_cv_.wait_for(lk, policy_.tick_, [&](){ return stop_flag_.load(); }) )
+                    break;
+            }
+            const auto now = steady_clock::now();
+            const auto elapsed = duration_cast<nanoseconds>(now - last_tick).count();
+            last_tick = now;
+
+            const size_t active = active_.load();
+            nanoseconds::rep busy{};
+            for(size_t i = 0; i < workers_.size(); ++i)
+            {
+                const auto total = workers_[i]->busy_ns_.load();
+                busy += total - last_busy[i];
+                last_busy[i] = total;
+            }
+            const double load = elapsed > 0 ? double(busy) / (double(elapsed) * double(active)) : 0.0;
+            const size_t depth = pending_.load();
+
+            if( depth > active * policy_.grow_depth_ || load > policy_.grow_load_ )
+            {
+                idle_ticks = 0;
+                grow();
+            }
+            else if( load < policy_.shrink_load_ && depth == 0 )
+            {
+                if( ++idle_ticks >= policy_.shrink_ticks_ )
+                    idle_ticks = 0, shrink();
+            }
+            else
+                idle_ticks = 0;
+        }
+    }
+
+    void QueueExecutorWorkStealing::execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt)
+    {
+        ICommandPtrArray_t commands{};
+        q.move_commands_to_array(commands, cnt);
+        execute_from_array(q, ctx, commands, 0, commands.size());
+    }
+
+    void QueueExecutorWorkStealing::execute_from_array(ICommandQueue& q, ICommandContext& ctx,
+                                                       const ICommandPtrArray_t& commands, size_t pos, size_t cnt)
+    {
+        if( pos >= commands.size() || !cnt )
+            return;
+        // у каждого блока своя очередь команд, поэтому воркеры не делят между собой ни очередь, ни файл
+        ICommandPtr_t sp_bulk = make_shared<CommandToFileInitDecorator>(make_shared<BulkCommand>(commands, pos, cnt), q);
+        scheduler_.submit( WorkStealingScheduler::Task{std::move(sp_bulk), make_shared<ICommandContext>(ctx)} );
+    }
+
+    /// @brief Пакет - одна задача планировщика, блоки пакета пишутся в свои файлы одним воркером
+    void QueueExecutorWorkStealing::execute_batch(ICommandQueue&, BulkBatchPtr_t const& batch)
+    {
+        if( batch->bulks_.empty() )
+            return;
+        scheduler_.submit( WorkStealingScheduler::Task{make_shared<otus_hw7::BulkBatchToFileCommand>(batch), batch_ctx_} );
+    }
+
     /// @brief Фабрика очереди команд
     /// @return Указатель на абстрактный интерфейс очереди команд 
-    ICommandQueuePtr_t create_command_queue(ICommandQueue::Type)
+    ICommandQueuePtr_t create_command_queue(ICommandQueue::Type type)
     {
-        return ICommandQueuePtr_t{ new CommandQueueMT };
+        return ICommandQueuePtr_t{ new CommandQueueMT(type) };
     }
 
     /// @brief Фабрика исполнителя очереди команд
     /// @return Указатель на созданный интерфейс
     IQueueExecutorPtr_t create_queue_executor(Options const& options)
     {
-        return  IQueueExecutorPtr_t{  new QueueExecutorMT(options.thread_count) };
+        if( FileSinkMode::kStatic == options.file_sink || FileSinkMode::kRing == options.file_sink )
+        {
+            // консоль - один поток, файлы - как у QueueExecutorMT: thread_count - 1 потоков, но не меньше одного
+            CpuSet_t cpus = options.worker_cpus.empty() ? CpuSet_t{} : parse_cpu_list(options.worker_cpus);
+            StageThreads console{1, cpus}, files{std::max<size_t>(options.thread_count, 2) - 1, cpus};
+            if( FileSinkMode::kRing == options.file_sink )
+                return std::make_shared<StaticPipelineRing>(std::move(console), std::move(files));
+            return std::make_shared<StaticPipelineMT>(std::move(console), std::move(files));
+        }
+        return  IQueueExecutorPtr_t{  new QueueExecutorMT(options.thread_count, options.file_sink, options.file_workers_max, 
+                                                                options.worker_cpus.empty() ? CpuSet_t{} : parse_cpu_list(options.worker_cpus)) };
     }
 
     /// @brief  Фабрика для процессора, сама по настройкам выбирает какой тип процессора создать
@@ -209,8 +550,12 @@ namespace otus_hw9{
     /// @return Интерфейс созданного объекта  
     IProcessorPtr_t create_processor(Options const& options)
     {
+        // thread_count 1 - синхронный режим: разбор, форматирование и запись идут в потоке вызывающего, 
+        // очередь без блокировок, пакет конвейера переиспользуется от блока к блоку
         if( options.thread_count < 2 )
-            return otus_hw7::create_processor(options);
+            return IProcessorPtr_t(new otus_hw7::Processor(create_parser(options), 
+                                                           std::make_shared<otus_hw7::CommandQueue>(),
+                                                           std::make_shared<StaticPipelineST>()));
         return IProcessorPtr_t(new ProcessorMT(create_parser(options), 
                                                otus_hw9::create_command_queue(ICommandQueue::Type::qInput),
                                                create_queue_executor(options)));
@@ -1,9 +1,17 @@
+#pragma once
+
 #include <mutex>
 #include <thread>
 #include <condition_variable>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <string_view>
 
 #include "bulk_internal.h"
 #include "async_utils.h"
+#include "async_affinity.h"
 
 namespace otus_hw9{
     using std::istream;
@@ -11,6 +19,7 @@ namespace otus_hw9{
 
     using otus_hw7::IQueueExecutor;
     using otus_hw7::ICommandContext;
+    using otus_hw7::PaddedCommandContext;
     using otus_hw7::IInputParser;
     using otus_hw7::ICommand;
     using otus_hw7::ICommandQueue;
@@ -35,12 +44,21 @@ namespace otus_hw9{
     using otus_hw7::QueueExecutorMulti;
     using otus_hw7::QueueExecutorToFileInitializer;
     using otus_hw7::QueueExecutorToBulkInitializer;
+    using otus_hw7::CommandToFileInitDecorator;
+    using otus_hw7::BulkCommand;
+    using otus_hw7::BulkBatch;
+    using otus_hw7::BulkBatchPtr_t;
 
-    /// @brief Реализация многопоточной очереди команд
-    class CommandQueueMT : public CommandQueue
+    /// @brief Реализация многопоточной очереди команд. Глубина очереди учитывается в metrics() по ее типу - в командах ввода,
+    ///        блочная команда или пакет считаются по числу своих команд.
+    ///        Очередь общая и живет все время работы: блокировка и счетчик, которые воркеры пишут на каждом pop(), 
+    ///        вынесены на свою строку кэша - запись процессором ИД блока в заголовок их не выбивает
+    class alignas(64) CommandQueueMT : public CommandQueue
     {
     public:
         using BaseCls_t = CommandQueue;
+        explicit CommandQueueMT(Type type = Type::qInput);
+        ~CommandQueueMT();
         ICommandQueue&  push(ICommandPtr_t cmd) override;
         bool            pop(ICommandPtr_t& cmd) override;
         ICommandQueue&  reset() override;
@@ -49,7 +67,10 @@ namespace otus_hw9{
 
     private:
         using lk_t = std::unique_lock<std::mutex>;
-        mutable std::mutex guard_mx_;
+        alignas(64) mutable std::mutex guard_mx_;
+        Type                     type_;
+        otus_hw7::MetricCounter& depth_;
+        int64_t                  commands_;     ///< команд ввода в очереди, под guard_mx_
     };
    
     /// @brief Реализация исполнителя очереди для диспетчеризации по воркерам 
@@ -57,24 +78,116 @@ namespace otus_hw9{
     {
     public:
         using BaseCls_t = QueueExecutorMulti;    
-        QueueExecutorMT(size_t thread_count = 3);
+        QueueExecutorMT(size_t thread_count = 3, FileSinkMode file_sink = FileSinkMode::kSharedQueue, size_t file_workers_max = 0,
+                        CpuSet_t worker_cpus = CpuSet_t{});
+    };
+
+    /// @brief Пороги автомасштабирования воркеров планировщика с перехватом работы
+    struct WorkStealingAutoscalePolicy
+    {
+        std::chrono::milliseconds   tick_{20};          ///< период замеров
+        size_t                      grow_depth_{2};     ///< задач в очереди на одного воркера, после которых добавляем воркер 
+        double                      grow_load_{0.8};    ///< загрузка, после которой добавляем воркер
+        double                      shrink_load_{0.3};  ///< загрузка, ниже которой воркер лишний
+        size_t                      shrink_ticks_{10};  ///< сколько замеров подряд загрузка должна быть низкой (гистерезис)
+    };
+
+    /// @brief Планировщик с перехватом работы (work stealing). 
+    ///        У каждого воркера свой локальный дек задач, блок кладется в дек ядра, с которого его отправили,
+    ///        простаивающий воркер забирает задачи с хвоста деков загруженных соседей.
+    ///        Если max_worker_count больше worker_count, то число воркеров меняется в пределах [worker_count, max_worker_count]
+    ///        по глубине очередей и загрузке воркеров.
+    class WorkStealingScheduler
+    {
+    public:
+        /// @brief Задача - команда (обычно блочная) и контекст, в котором ее выполнить
+        struct Task
+        {
+            ICommandPtr_t        cmd_;
+            ICommandContextPtr_t ctx_;
+        };
+
+        using AutoscalePolicy = WorkStealingAutoscalePolicy;
+
+        explicit WorkStealingScheduler(size_t worker_count, size_t max_worker_count = 0, AutoscalePolicy policy = AutoscalePolicy{},
+                                       CpuSet_t cpus = CpuSet_t{});
+        ~WorkStealingScheduler();
+
+        void    submit(Task task);
+        size_t  worker_count() const { return active_.load(); }
+        size_t  min_worker_count() const { return min_workers_; }
+        size_t  max_worker_count() const { return workers_.size(); }
+        size_t  pending() const { return pending_.load(); }
+
+    private:
+        struct Worker
+        {
+            std::mutex          guard_mx_;
+            std::deque<Task>    tasks_;
+            std::thread         thread_;
+            std::atomic<std::chrono::nanoseconds::rep> busy_ns_{};
+            bool                exited_{false};     ///< выведенный из работы поток вышел из run(), под idle_mx_
+        };
+        using WorkerPtr_t = NumaPtr_t<Worker>;
+        using lk_t = std::unique_lock<std::mutex>;
+
+        void    run(size_t idx);
+        void    supervise();
+        void    grow();
+        void    shrink();
+        bool    pop_local(size_t idx, Task& task);
+        bool    steal(size_t idx, Task& task);
+        size_t  submit_slot() const;
+
+        const size_t             min_workers_;
+        const AutoscalePolicy    policy_;
+        const CpuSet_t           cpus_;
+        std::vector<WorkerPtr_t> workers_;
+        std::atomic<size_t>      active_;
+        std::atomic<size_t>      pending_;
+        std::atomic<bool>        stop_flag_;
+        std::mutex               idle_mx_;
+        std::condition_variable  idle_cv_;
+        std::condition_variable  supervisor_cv_;    ///< только наблюдатель, чтобы он не забирал пробуждения воркеров
+        std::thread              supervisor_;
+    };
+
+    /// @brief Исполнитель, который упаковывает массив команд в блок для вывода в файл и 
+    ///        отдает его планировщику с перехватом работы вместо общей очереди файловых воркеров
+    class QueueExecutorWorkStealing : public IQueueExecutor
+    {
+    public:
+        explicit QueueExecutorWorkStealing(size_t worker_count, size_t max_worker_count = 0, CpuSet_t cpus = CpuSet_t{}) 
+            : scheduler_(worker_count, max_worker_count, WorkStealingScheduler::AutoscalePolicy{}, std::move(cpus)),
+              batch_ctx_(std::make_shared<PaddedCommandContext>()) {}
+        virtual void execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt) override;
+        virtual void execute_from_array(ICommandQueue& q, ICommandContext& ctx,
+                                        const ICommandPtrArray_t& commands, size_t pos, size_t cnt) override;
+        virtual void execute_batch(ICommandQueue& q, BulkBatchPtr_t const& batch) override;
+        size_t  worker_count() const { return scheduler_.worker_count(); }
+    protected:
+        WorkStealingScheduler scheduler_;
+        ICommandContextPtr_t  batch_ctx_;   ///< контекст задач-пакетов: блоки пакета выполняются в своих контекстах
     };
 
     /// @brief Реализация исполнителя очереди в отдельном потоке
     class QueueExecutorWithThread : public IQueueExecutor
     {
     public:    
-        QueueExecutorWithThread();
+        QueueExecutorWithThread(CpuSet_t cpus = CpuSet_t{});
         virtual ~QueueExecutorWithThread() override;
         virtual void execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt) override;
     protected:
         void  execute_q();    
-        bool  stop_flag_;
+        const CpuSet_t cpus_;
+        std::atomic<bool>  stop_flag_;
         ICommandQueue* q_;
         ICommandContextPtr_t ctx_;
         std::thread work_thread_;
-        static std::mutex cmd_wait_mx;
-        static std::condition_variable cmd_wait_cv;
+        // у каждого исполнителя свое ожидание: общее на все потоки notify_one будило случайный поток, 
+        // и команда оставалась в очереди до следующего сигнала
+        std::mutex cmd_wait_mx;
+        std::condition_variable cmd_wait_cv;
     };
 
     /// @brief Реализация процессора команд
@@ -83,6 +196,15 @@ namespace otus_hw9{
     public:
         using BaseCls_t = Processor;
         ProcessorMT(IInputParserPtr_t parser, ICommandQueuePtr_t cmd_queue, IQueueExecutorPtr_t executor);
+        void process(bool save_status_at_stop) override;
+
+        /// @brief Предел блоков в пакете: крупный пакет пишется в файлы одним воркером
+        constexpr static const size_t max_batch_bulks = 64;
+    protected:
+        void exec_queue() override;
+        void dispatch_batch();
+
+        BulkBatchPtr_t batch_;  ///< блоки, готовые за текущий process()
     };
 
     /// @brief Фабрика очереди команд
@@ -98,4 +220,72 @@ namespace otus_hw9{
     /// @param options 
     /// @return Интерфейс созданного объекта  
     IProcessorPtr_t create_processor(Options const& options);
+
+    using IOStreamPtr_t = std::shared_ptr<std::stringstream>;
+
+    /// @brief Вспомогательный класс для хранения процессора и потока с данными.
+    ///        Через C ABI доступен по libasync_ctx_t, внутрипроцессные пользователи могут владеть им напрямую.
+    class LibAsyncCtx_t
+    {
+    public:
+        LibAsyncCtx_t(size_t bulk_size, size_t thread_count) : 
+            iostream_(std::make_shared<std::stringstream>()), 
+            processor_(create_processor(Options(bulk_size, iostream_.get(), thread_count)))
+        {
+        } 
+
+        LibAsyncCtx_t(Options const& options) : 
+            iostream_(std::make_shared<std::stringstream>()), 
+            processor_(create_processor(with_stream(options, iostream_.get())))
+        {
+        } 
+
+        ~LibAsyncCtx_t() 
+        {
+        } 
+
+        static std::mutex& guard_mx()  { return guard_mx_; }
+        IOStreamPtr_t&     iostream()  { return iostream_; } 
+        IProcessorPtr_t&   processor() { return processor_; }
+
+        void receive(const std::string_view& data, bool save_status_at_stop)
+        {
+            //append line to stream and run process
+            if( !*iostream() )
+                iostream()->clear();
+                
+            if( !data.empty() )
+            {
+                processor()->input_received(otus_hw7::metrics_now_ns());
+                *iostream() << data;// << std::endl; 
+            }
+            processor()->process(save_status_at_stop);    
+
+            // все прочитано парсером - буфер больше не нужен, иначе он растет на весь объем принятых за сессию данных
+            if( iostream()->rdbuf()->in_avail() <= 0 )
+                iostream()->str(std::string{}), iostream()->clear();
+        }
+
+        /// @brief Время получения первой команды неполного статического блока, 0 - такого блока нет
+        uint64_t pending_since() const { return processor_->pending_since(); }
+
+        /// @brief Досрочно вывести неполный статический блок (по истечении задержки linger)
+        bool flush()
+        {
+            if( !*iostream() )
+                iostream()->clear();
+            return processor()->flush();
+        }
+
+    private:
+        static Options with_stream(Options options, istream* is)
+        {
+            options.is_ = is;
+            return options;
+        }
+
+        static std::mutex guard_mx_;
+        IOStreamPtr_t iostream_;
+        IProcessorPtr_t processor_;
+    }; 
 }
\ No newline at end of file
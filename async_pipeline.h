@@ -0,0 +1,311 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <tuple>
+#include <type_traits>
+
+#include "bulk_internal.h"
+#include "async_affinity.h"
+#include "async_spsc_ring.h"
+
+namespace otus_hw9{
+    using otus_hw7::IQueueExecutor;
+    using otus_hw7::ICommandContext;
+    using otus_hw7::ICommandQueue;
+    using otus_hw7::BulkBatch;
+    using otus_hw7::BulkBatchPtr_t;
+
+    /// @brief Потоки этапа статического конвейера
+    struct StageThreads
+    {
+        size_t   workers_{1};   ///< потоков этапа, у каждого свой экземпляр этапа
+        CpuSet_t cpus_{};       ///< привязка потоков к процессорам, пусто - без привязки
+    };
+
+    /// @brief  Этап Stage в собственных потоках: пакеты копятся в очереди этапа, потоки разбирают их по одному.
+    ///         Глубина очереди в командах ввода учитывается в metrics() по Stage::queue_type
+    template <typename Stage>
+    class ThreadedStage
+    {
+    public:
+        explicit ThreadedStage(StageThreads threads = StageThreads{})
+            : cpus_(std::move(threads.cpus_)), stages_(threads.workers_ ? threads.workers_ : 1),
+              depth_(otus_hw7::metrics().queue_depth_[static_cast<size_t>(Stage::queue_type)])
+        {
+            otus_hw7::metrics().queue_count_[static_cast<size_t>(Stage::queue_type)].add();
+            threads_.reserve(stages_.size());
+            for(size_t i = 0; i < stages_.size(); ++i)
+                threads_.emplace_back(&ThreadedStage::run, this, i);
+        }
+
+        /// @brief Потоки дорабатывают очередь и завершаются
+        ~ThreadedStage()
+        {
+            {
+                lk_t lk(guard_mx_);
+                stop_flag_ = true;
+            }
+            wait_cv_.notify_all();
+            for(auto& t : threads_)
+                t.join();
+            otus_hw7::metrics().queue_count_[static_cast<size_t>(Stage::queue_type)].sub();
+        }
+
+        ThreadedStage(ThreadedStage const&) = delete;
+        ThreadedStage& operator=(ThreadedStage const&) = delete;
+
+        void operator()(BulkBatchPtr_t const& batch)
+        {
+            depth_.add(static_cast<int64_t>(batch->commands_.size()));
+            {
+                lk_t lk(guard_mx_);
+                batches_.push_back(batch);
+            }
+            wait_cv_.notify_one();
+        }
+
+        size_t worker_count() const { return stages_.size(); }
+
+    private:
+        using lk_t = std::unique_lock<std::mutex>;
+
+        void run(size_t idx)
+        {
+            pin_current_thread(cpus_);
+            Stage& stage = stages_[idx].stage_;
+            for(;;)
+            {
+                BulkBatchPtr_t batch;
+                {
+                    lk_t lk(guard_mx_);
+                    wait_cv_.wait(lk, [&](){ return !batches_.empty() || stop_flag_; });
+                    if( batches_.empty() )
+                        return;
+                    batch = std::move(batches_.front());
+                    batches_.pop_front();
+                }
+                depth_.sub(static_cast<int64_t>(batch->commands_.size()));
+                stage(*batch);
+            }
+        }
+
+        /// @brief Этап каждого потока на своих строках кэша: соседние этапы пишут свое состояние на каждом блоке
+        struct alignas(64) StageSlot
+        {
+            Stage stage_;
+        };
+
+        const CpuSet_t              cpus_;
+        std::vector<StageSlot>      stages_;
+        otus_hw7::MetricCounter&    depth_;
+        std::mutex                  guard_mx_;
+        std::condition_variable     wait_cv_;
+        std::deque<BulkBatchPtr_t>  batches_;
+        bool                        stop_flag_ = false;
+        std::vector<std::thread>    threads_;
+    };
+
+    /// @brief  Этап Stage в выделенных потоках-писателях, у каждого свое кольцо SpscRing от процессора. Производитель у 
+    ///         исполнителя один - процессор сессии, вызовы которого упорядочивает ее владелец, поэтому между ним и писателями 
+    ///         нет общей очереди и мьютекса: пакеты раздаются по кольцам писателей по кругу, занятое кольцо пропускается.
+    ///         Писатель опрашивает свое кольцо, а опустев - засыпает, и будит его только производитель, заставший его спящим
+    template <typename Stage>
+    class RingStage
+    {
+    public:
+        static constexpr size_t ring_capacity = 1024;
+        static constexpr size_t spin_polls = 64;   ///< пустых опросов кольца до засыпания писателя
+
+        explicit RingStage(StageThreads threads = StageThreads{})
+            : cpus_(std::move(threads.cpus_)),
+              depth_(otus_hw7::metrics().queue_depth_[static_cast<size_t>(Stage::queue_type)])
+        {
+            otus_hw7::metrics().queue_count_[static_cast<size_t>(Stage::queue_type)].add();
+            const size_t workers = threads.workers_ ? threads.workers_ : 1;
+            writers_.reserve(workers);
+            for(size_t i = 0; i < workers; ++i)
+                writers_.emplace_back(std::make_unique<Writer>());
+            for(auto& w : writers_)
+                w->thread_ = std::thread(&RingStage::run, this, std::ref(*w));
+        }
+
+        /// @brief Писатели дорабатывают свои кольца и завершаются
+        ~RingStage()
+        {
+            stop_flag_.store(true);
+            for(auto& w : writers_)
+            {
+                { lk_t lk(w->wait_mx_); }
+                w->wait_cv_.notify_one();
+            }
+            for(auto& w : writers_)
+                w->thread_.join();
+            otus_hw7::metrics().queue_count_[static_cast<size_t>(Stage::queue_type)].sub();
+        }
+
+        RingStage(RingStage const&) = delete;
+        RingStage& operator=(RingStage const&) = delete;
+
+        void operator()(BulkBatchPtr_t const& batch)
+        {
+            depth_.add(static_cast<int64_t>(batch->commands_.size()));
+            BulkBatchPtr_t item = batch;
+            for(size_t tries = 0; ; ++tries)
+            {
+                Writer& w = *writers_[next_];
+                next_ = next_ + 1 < writers_.size() ? next_ + 1 : 0;
+                if( w.ring_.try_push(std::move(item)) )
+                {
+                    wake(w);
+                    return;
+                }
+                // все кольца полны - писатели не успевают, производитель ждет
+                if( tries + 1 >= writers_.size() )
+                    std::this_thread::yield();
+            }
+        }
+
+        size_t worker_count() const { return writers_.size(); }
+
+    private:
+        using lk_t = std::unique_lock<std::mutex>;
+
+        struct Writer
+        {
+            Writer() : ring_(ring_capacity) {}
+            SpscRing<BulkBatchPtr_t>    ring_;
+            Stage                       stage_;
+            alignas(64) std::atomic<bool> sleeping_{false};
+            std::mutex                  wait_mx_;
+            std::condition_variable     wait_cv_;
+            std::thread                 thread_;
+        };
+
+        /// @brief  Производитель выложил пакет и проверяет, не спит ли писатель. Пара барьеров с run() исключает 
+        ///         потерю пробуждения: либо писатель увидит пакет при повторной проверке, либо производитель - его сон
+        void wake(Writer& w)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if( w.sleeping_.load(std::memory_order_relaxed) )
+            {
+                { lk_t lk(w.wait_mx_); }
+                w.wait_cv_.notify_one();
+            }
+        }
+
+        void run(Writer& w)
+        {
+            pin_current_thread(cpus_);
+            BulkBatchPtr_t batch;
+            for(size_t idle = 0; ; )
+            {
+                if( w.ring_.try_pop(batch) )
+                {
+                    idle = 0;
+                    depth_.sub(static_cast<int64_t>(batch->commands_.size()));
+                    w.stage_(*batch);
+                    batch.reset();
+                    continue;
+                }
+                if( stop_flag_.load() && w.ring_.empty() )
+                    return;
+                if( ++idle < spin_polls )
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                idle = 0;
+                lk_t lk(w.wait_mx_);
+                w.sleeping_.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                w.wait_cv_.wait(lk, [&](){ return !w.ring_.empty() || stop_flag_.load(); });
+                w.sleeping_.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        const CpuSet_t                          cpus_;
+        otus_hw7::MetricCounter&                depth_;
+        std::vector<std::unique_ptr<Writer>>    writers_;
+        std::atomic<bool>                       stop_flag_{false};
+        alignas(64) size_t                      next_ = 0;     ///< кольцо следующего пакета, только у производителя
+    };
+
+    /// @brief  Конвейер, собранный на этапе компиляции: пакет передается этапам Stages... по порядку прямыми вызовами,
+    ///         которые компилятор встраивает. Виртуален только вход IQueueExecutor - конвейер подключается к процессору
+    ///         наравне с собранным из декораторов, для нестандартных этапов остается runtime-сборка.
+    ///         Этап - вызываемый объект от BulkBatch const& (синхронный) или от BulkBatchPtr_t const& (забирает пакет себе)
+    template <typename... Stages>
+    class StaticPipeline : public IQueueExecutor
+    {
+    public:
+        template <typename... Args>
+        explicit StaticPipeline(Args&&... args) : stages_(std::forward<Args>(args)...) {}
+
+        /// @brief Поблочный вход процессора: блок - пакет из одного блока
+        virtual void execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt) override
+        {
+            BulkBatchPtr_t batch = scratch_batch();
+            q.move_commands_to_array(batch->commands_, std::min(ctx.bulk_size_, cnt));
+            batch->bulks_.push_back(BulkBatch::Bulk{0, batch->commands_.size(), ctx});
+            run(batch);
+        }
+
+        virtual void execute_batch(ICommandQueue&, BulkBatchPtr_t const& batch) override
+        {
+            run(batch);
+        }
+
+        void run(BulkBatchPtr_t const& batch)
+        {
+            std::apply([&](auto&... stage){ (pass(stage, batch), ...); }, stages_);
+        }
+
+        template <size_t I>
+        auto& stage() { return std::get<I>(stages_); }
+
+    private:
+        template <typename Stage>
+        static void pass(Stage& stage, BulkBatchPtr_t const& batch)
+        {
+            if constexpr ( std::is_invocable_v<Stage&, BulkBatchPtr_t const&> )
+                stage(batch);
+            else
+                stage(static_cast<BulkBatch const&>(*batch));
+        }
+
+        /// @brief Все этапы синхронные: ни один не забирает пакет себе, к возврату из run() он свободен
+        static constexpr bool synchronous = (!std::is_invocable_v<Stages&, BulkBatchPtr_t const&> && ...);
+
+        /// @brief  Пакет поблочного входа переиспользуется только синхронным конвейером. Асинхронный этап отпускает 
+        ///         пакет в своем потоке, и use_count() не упорядочивает его последние чтения с очисткой здесь
+        BulkBatchPtr_t scratch_batch()
+        {
+            if constexpr ( !synchronous )
+                return std::make_shared<BulkBatch>();
+            if( scratch_ )
+            {
+                scratch_->commands_.clear();
+                scratch_->bulks_.clear();
+            }
+            else
+                scratch_ = std::make_shared<BulkBatch>();
+            return scratch_;
+        }
+
+        std::tuple<Stages...> stages_;
+        BulkBatchPtr_t        scratch_;
+    };
+
+    /// @brief Консоль и файлы в потоке процессора
+    using StaticPipelineST = StaticPipeline<otus_hw7::ConsoleStage, otus_hw7::FileStage>;
+
+    /// @brief Консоль в своем потоке, файлы - в пуле потоков с общей очередью пакетов
+    using StaticPipelineMT = StaticPipeline<ThreadedStage<otus_hw7::ConsoleStage>, ThreadedStage<otus_hw7::FileStage>>;
+
+    /// @brief Консоль и файлы в выделенных писателях с кольцами SPSC от процессора
+    using StaticPipelineRing = StaticPipeline<RingStage<otus_hw7::ConsoleStage>, RingStage<otus_hw7::FileStage>>;
+}
\ No newline at end of file
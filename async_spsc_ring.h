@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace otus_hw9{
+
+    /// @brief  Кольцевой буфер с одним производителем и одним потребителем, без ожидания: push и pop - по одной
+    ///         атомарной записи своего индекса. Индексы производителя и потребителя лежат на разных строках кэша,
+    ///         рядом с каждым - закэшированная копия чужого индекса, которая перечитывается, только когда кольцо
+    ///         кажется полным (пустым). Емкость округляется вверх до степени двойки
+    template <typename T>
+    class SpscRing
+    {
+    public:
+        explicit SpscRing(size_t capacity) : mask_(round_up_pow2(capacity) - 1), slots_(mask_ + 1) {}
+
+        SpscRing(SpscRing const&) = delete;
+        SpscRing& operator=(SpscRing const&) = delete;
+
+        /// @brief Только поток производителя
+        /// @return false - кольцо полно, v не тронут
+        bool try_push(T&& v)
+        {
+            const size_t tail = producer_.tail_.load(std::memory_order_relaxed);
+            if( tail - producer_.head_cache_ > mask_ )
+            {
+                producer_.head_cache_ = consumer_.head_.load(std::memory_order_acquire);
+                if( tail - producer_.head_cache_ > mask_ )
+                    return false;
+            }
+            slots_[tail & mask_] = std::move(v);
+            producer_.tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// @brief Только поток потребителя
+        /// @return false - кольцо пусто
+        bool try_pop(T& v)
+        {
+            const size_t head = consumer_.head_.load(std::memory_order_relaxed);
+            if( head == consumer_.tail_cache_ )
+            {
+                consumer_.tail_cache_ = producer_.tail_.load(std::memory_order_acquire);
+                if( head == consumer_.tail_cache_ )
+                    return false;
+            }
+            v = std::move(slots_[head & mask_]);
+            consumer_.head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// @brief Из любого потока, результат - на момент чтения индексов
+        bool   empty() const { return consumer_.head_.load(std::memory_order_acquire) == producer_.tail_.load(std::memory_order_acquire); }
+        size_t capacity() const { return mask_ + 1; }
+
+    private:
+        static size_t round_up_pow2(size_t n)
+        {
+            size_t p = 1;
+            while( p < n )
+                p <<= 1;
+            return p;
+        }
+
+        struct alignas(64) Producer
+        {
+            std::atomic<size_t> tail_{};
+            size_t              head_cache_{};
+        };
+        struct alignas(64) Consumer
+        {
+            std::atomic<size_t> head_{};
+            size_t              tail_cache_{};
+        };
+
+        Producer        producer_;
+        Consumer        consumer_;
+        const size_t    mask_;
+        std::vector<T>  slots_;
+    };
+}
\ No newline at end of file
@@ -1,11 +1,50 @@
 #include <iostream>
 
 #include "async_utils.h"
+#include "async_affinity.h"
 
 namespace otus_hw9{
 
     namespace{
         constexpr const char* const OPTION_NAME_THREAD_COUNT = "thread_count"; 
+        constexpr const char* const OPTION_NAME_FILE_SINK = "file_sink"; 
+        constexpr const char* const OPTION_NAME_FILE_WORKERS_MAX = "file_workers_max"; 
+        constexpr const char* const OPTION_NAME_WORKER_CPUS = "worker_cpus"; 
+        constexpr const char* const OPTION_NAME_LINGER_MS = "linger_ms"; 
+        constexpr const char* const FILE_SINK_QUEUE = "queue"; 
+        constexpr const char* const FILE_SINK_STEALING = "stealing"; 
+        constexpr const char* const FILE_SINK_STATIC = "static"; 
+        constexpr const char* const FILE_SINK_RING = "ring"; 
+    }
+
+    istream& operator>>(istream& is, FileSinkMode& mode)
+    {
+        std::string s;
+        if( !(is >> s) )
+            return is;
+        if( s == FILE_SINK_QUEUE )
+            mode = FileSinkMode::kSharedQueue;
+        else if( s == FILE_SINK_STEALING )
+            mode = FileSinkMode::kWorkStealing;
+        else if( s == FILE_SINK_STATIC )
+            mode = FileSinkMode::kStatic;
+        else if( s == FILE_SINK_RING )
+            mode = FileSinkMode::kRing;
+        else
+            is.setstate(std::ios_base::failbit);
+        return is;
+    }
+
+    ostream& operator<<(ostream& os, FileSinkMode mode)
+    {
+        switch(mode)
+        {
+            default:
+            case FileSinkMode::kSharedQueue:  return os << FILE_SINK_QUEUE;
+            case FileSinkMode::kWorkStealing: return os << FILE_SINK_STEALING;
+            case FileSinkMode::kStatic:       return os << FILE_SINK_STATIC;
+            case FileSinkMode::kRing:         return os << FILE_SINK_RING;
+        }
     }
 
     Options::BaseCls_t& Options::add_options(otus_hw7::po::options_description& desc)
@@ -15,8 +54,22 @@ namespace otus_hw9{
                           { 
                             if( sz < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_THREAD_COUNT); 
                           };
+        auto check_cpus = [](const std::string& cpus) 
+                          { 
+                            try{ parse_cpu_list(cpus); }
+                            catch(std::invalid_argument const&){ throw otus_hw7::po::invalid_option_value(OPTION_NAME_WORKER_CPUS); }
+                          };
         desc.add_options()
-            (OPTION_NAME_THREAD_COUNT, otus_hw7::po::value<size_t>(&thread_count)->notifier(check_size), "Число потоков для обработки");
+            (OPTION_NAME_THREAD_COUNT, otus_hw7::po::value<size_t>(&thread_count)->notifier(check_size), "Число потоков для обработки, 1 - синхронный режим: вывод блоков в потоке ввода, без очередей и блокировок")
+            (OPTION_NAME_FILE_SINK, otus_hw7::po::value<FileSinkMode>(&file_sink), 
+                "Раздача блоков файловым воркерам: queue - общая очередь, stealing - локальные деки с перехватом работы, "
+                "static - конвейер, собранный на этапе компиляции, ring - он же с кольцами SPSC к выделенным писателям")
+            (OPTION_NAME_FILE_WORKERS_MAX, otus_hw7::po::value<size_t>(&file_workers_max), 
+                "Автомасштабирование файловых воркеров от thread_count - 1 до заданного числа по глубине очереди и загрузке (включает stealing)")
+            (OPTION_NAME_WORKER_CPUS, otus_hw7::po::value<std::string>(&worker_cpus)->notifier(check_cpus), 
+                "Привязка потоков исполнителей к процессорам, например 0-3,8")
+            (OPTION_NAME_LINGER_MS, otus_hw7::po::value<size_t>(&linger_ms), 
+                "Через сколько мс после первой команды выводить неполный статический блок, 0 - только по размеру блока");
         return *this;
     }        
 };
\ No newline at end of file
@@ -5,12 +5,31 @@
 
 namespace otus_hw9{
     using  std::istream;
+    using  std::ostream;
+
+    /// @brief Способ раздачи блоков файловым воркерам
+    enum class FileSinkMode : uint8_t
+    {
+        kSharedQueue,   ///< общая очередь file_queue_ для всех воркеров
+        kWorkStealing,  ///< локальный дек у каждого воркера + перехват работы у соседей
+        kStatic,        ///< конвейер, собранный на этапе компиляции (StaticPipelineMT): консоль и пул файловых потоков
+        kRing           ///< тот же конвейер с выделенными писателями, у каждого свое кольцо SPSC от процессора (StaticPipelineRing)
+    };
+
+    istream& operator>>(istream& is, FileSinkMode& mode);
+    ostream& operator<<(ostream& os, FileSinkMode mode);
+
     struct Options : public otus_hw7::Options
     {
         using BaseCls_t = otus_hw7::Options;
         size_t thread_count;
-        Options() : thread_count(2) {}
-        Options(size_t cmd_bulk_sz, istream* istrm, size_t thread_cnt) : BaseCls_t(cmd_bulk_sz, istrm), thread_count(thread_cnt) {}
+        FileSinkMode file_sink;
+        size_t file_workers_max;    ///< верхняя граница числа файловых воркеров при автомасштабировании, 0 - число фиксировано
+        std::string worker_cpus;    ///< процессоры для потоков исполнителей в формате "0-3,8", пусто - без привязки
+        size_t linger_ms;           ///< через сколько мс выводить неполный статический блок, 0 - только по размеру
+        Options() : thread_count(2), file_sink(FileSinkMode::kSharedQueue), file_workers_max(0), linger_ms(0) {}
+        Options(size_t cmd_bulk_sz, istream* istrm, size_t thread_cnt, FileSinkMode sink_mode = FileSinkMode::kSharedQueue) 
+            : BaseCls_t(cmd_bulk_sz, istrm), thread_count(thread_cnt), file_sink(sink_mode), file_workers_max(0), linger_ms(0) {}
         virtual BaseCls_t& add_options(otus_hw7::po::options_description& desc) override;        
     };
 };
\ No newline at end of file
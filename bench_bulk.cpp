@@ -0,0 +1,461 @@
+#include <benchmark/benchmark.h>
+#include <sstream>
+#include <filesystem>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef __PRETTY_FUNCTION__
+#include "pretty.h"
+#endif
+#include "async_internal.h"
+#include "async_pipeline.h"
+#include "async.h"
+#include "bulk_journal.h"
+
+using namespace otus_hw7;
+
+namespace {
+
+    /// @brief Поток, который ничего не пишет - чтобы мерить конвейер, а не консоль
+    class NullBuf : public std::streambuf
+    {
+    protected:
+        int_type        overflow(int_type c) override { return traits_type::not_eof(c); }
+        std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    NullBuf      s_null_buf;
+    std::ostream s_null_os(&s_null_buf);
+
+    /// @brief Ввод из cmd_count команд статическими блоками
+    std::string make_input(size_t cmd_count)
+    {
+        std::string s;
+        for(size_t i = 0; i < cmd_count; ++i)
+            s += "cmd" + std::to_string(i) + '\n';
+        return s;
+    }
+
+    /// @brief Массив готовых команд блока, как его формирует парсер
+    ICommandPtrArray_t make_bulk(size_t bulk_size)
+    {
+        CommandCreator creator;
+        ICommandPtrArray_t commands;
+        for(size_t i = 0; i < bulk_size; ++i)
+            commands.push_back(creator.create_command_decorator(creator.create_command("cmd" + std::to_string(i), 1, ICommand::CommandType::cmdSimple), 
+                                            i ? ICommand::CommandType::cmdSimple : ICommand::CommandType::cmdFirst));
+        commands.push_back(creator.create_command_decorator(creator.create_command(command_data_t{}, 1, ICommand::CommandType::cmdSimple), ICommand::CommandType::cmdLast));
+        return commands;
+    }
+
+    /// @brief Рабочий каталог для файлов блоков, очищается по завершении
+    class ScopedWorkDir
+    {
+    public:
+        ScopedWorkDir() : prev_(std::filesystem::current_path()), dir_(std::filesystem::temp_directory_path() / "bench_bulk")
+        {
+            std::filesystem::create_directories(dir_);
+            std::filesystem::current_path(dir_);
+        }
+        ~ScopedWorkDir()
+        {
+            std::filesystem::current_path(prev_);
+            std::error_code ec;
+            std::filesystem::remove_all(dir_, ec);
+        }
+    private:
+        std::filesystem::path prev_, dir_;
+    };
+
+    /// @brief Доступ к защищенной настройке файла блока
+    struct BenchFileSetuper : CmdLogFileSetuper
+    {
+        using CmdLogFileSetuper::setup_context;
+    };
+
+    void bulk_sizes(benchmark::internal::Benchmark* b)
+    {
+        for(int64_t sz : {1, 3, 64, 1024})
+            b->Arg(sz);
+    }
+
+    void bulk_sizes_and_threads(benchmark::internal::Benchmark* b)
+    {
+        for(int64_t sz : {1, 3, 64, 1024})
+            for(int64_t threads : {1, 2, 4, 8, 16})
+                b->Args({sz, threads});
+    }
+}
+
+/// @brief Разбор ввода на статические блоки: InputParser::read_next_bulk
+static void BM_parser_read_next_bulk(benchmark::State& state)
+{
+    const size_t bulk_size = static_cast<size_t>(state.range(0));
+    const size_t cmd_count = std::max<size_t>(bulk_size * 16, 1024);
+    const std::string input = make_input(cmd_count);
+    for(auto _ : state)
+    {
+        std::istringstream is(input);
+        InputParser parser(bulk_size, is, std::make_unique<CommandCreator>());
+        CommandQueue q;
+        for(IInputParser::Status st{}; st != IInputParser::Status::kStop; )
+        {
+            st = parser.read_next_bulk(q);
+            if( IInputParser::Status::kReady == st )
+                q.reset();
+        }
+        benchmark::DoNotOptimize(q.size());
+    }
+    state.SetItemsProcessed(state.iterations() * cmd_count);
+}
+BENCHMARK(BM_parser_read_next_bulk)->Apply(bulk_sizes);
+
+/// @brief push/pop блока через однопоточную очередь
+static void BM_command_queue_push_pop(benchmark::State& state)
+{
+    const size_t bulk_size = static_cast<size_t>(state.range(0));
+    ICommandPtrArray_t commands = make_bulk(bulk_size);
+    CommandQueue q;
+    for(auto _ : state)
+    {
+        for(auto const& cmd : commands)
+            q.push(cmd);
+        ICommandPtr_t cmd;
+        while( q.pop(cmd) )
+            benchmark::DoNotOptimize(cmd);
+    }
+    state.SetItemsProcessed(state.iterations() * commands.size());
+}
+BENCHMARK(BM_command_queue_push_pop)->Apply(bulk_sizes);
+
+/// @brief push/pop блока через общую многопоточную очередь из 1..16 потоков
+static void BM_command_queue_mt_push_pop(benchmark::State& state)
+{
+    static ICommandQueuePtr_t s_q;
+    if( 0 == state.thread_index() )
+        s_q = otus_hw9::create_command_queue(ICommandQueue::Type::qFile);
+
+    const size_t bulk_size = static_cast<size_t>(state.range(0));
+    ICommandPtrArray_t commands = make_bulk(bulk_size);
+    for(auto _ : state)
+    {
+        for(auto const& cmd : commands)
+            s_q->push(cmd);
+        ICommandPtr_t cmd;
+        for(size_t i = 0; i < commands.size() && s_q->pop(cmd); ++i)
+            benchmark::DoNotOptimize(cmd);
+    }
+    state.SetItemsProcessed(state.iterations() * commands.size());
+    if( 0 == state.thread_index() )
+        s_q.reset();
+}
+BENCHMARK(BM_command_queue_mt_push_pop)->Apply(bulk_sizes)->ThreadRange(1, 16)->UseRealTime();
+
+/// @brief Раздача блока воркерам: QueueExecutorMulti::execute на 1..16 исполнителей
+static void BM_queue_executor_multi_execute(benchmark::State& state)
+{
+    const size_t bulk_size = static_cast<size_t>(state.range(0));
+    const size_t worker_count = static_cast<size_t>(state.range(1));
+    ICommandPtrArray_t commands = make_bulk(bulk_size);
+
+    QueueExecutorMulti executor(worker_count, std::make_shared<CommandQueue>(), std::make_shared<CommandQueue>());
+    for(size_t i = 0; i < worker_count; ++i)
+        executor.add_worker(std::make_shared<QueueExecutor>());
+
+    CommandQueue q;
+    ICommandContext ctx(commands.size(), 0, s_null_os, 0);
+    for(auto _ : state)
+    {
+        q.copy_commands_from_array(commands, 0, commands.size());
+        ctx.bulk_size_ = commands.size();
+        executor.execute(q, ctx, commands.size());
+    }
+    state.SetItemsProcessed(state.iterations() * commands.size() * worker_count);
+}
+BENCHMARK(BM_queue_executor_multi_execute)->Apply(bulk_sizes_and_threads);
+
+/// @brief Создание файла блока: CmdLogFileSetuper
+static void BM_cmd_log_file_setuper(benchmark::State& state)
+{
+    ScopedWorkDir work_dir;
+    CommandQueue q;
+    ICommandContext ctx(1, 0, s_null_os, 0);
+    ICommandQueue::id_t bulk_id{};
+    for(auto _ : state)
+    {
+        BenchFileSetuper setuper;
+        ctx.bulk_id_ = ++bulk_id;
+        setuper.setup_context(ctx, q);
+        benchmark::DoNotOptimize(setuper.context());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_cmd_log_file_setuper);
+
+/// @brief Цикл клиента C ABI: connect - одна команда - disconnect. Аргумент - емкость пула контекстов:
+///        0 - конвейер с потоками исполнителей строится и разрушается на каждое подключение
+static void BM_libasync_connect(benchmark::State& state)
+{
+    ScopedWorkDir work_dir;
+    std::streambuf* prev_cout = std::cout.rdbuf(&s_null_buf);
+    otus_hw9::set_context_pool_capacity(static_cast<size_t>(state.range(0)));
+    for(auto _ : state)
+    {
+        libasync_ctx_t ctx = otus_hw9::connect(3);
+        otus_hw9::receive(ctx, "cmd\n", 4);
+        otus_hw9::disconnect(ctx);
+    }
+    otus_hw9::set_context_pool_capacity(0);
+    std::cout.rdbuf(prev_cout);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_libasync_connect)->Arg(0)->Arg(16)->UseRealTime();
+
+/// @brief  Разбор одного принятого чанка из 64 команд (4 блока) с фиксацией журнала, как в Processor::process.
+///         Аргумент: 0 - без журнала, 1 - write(), 2 - write() + fdatasync
+static void BM_journal_parse(benchmark::State& state)
+{
+    constexpr size_t chunk_commands = 64;
+    ScopedWorkDir work_dir;
+    const int64_t mode = state.range(0);
+    if( mode )
+        journal_open("bench.journal", mode == 2);
+    const std::string chunk = make_input(chunk_commands);
+    const int64_t bytes0 = metrics().journal_bytes_.value();
+    std::stringstream ss;
+    InputParser parser(16, ss, std::make_unique<CommandCreator>());
+    parser.save_status_at_stop(true);
+    CommandQueue q;
+    for(auto _ : state)
+    {
+        ss.clear();
+        ss.str(chunk);
+        for(IInputParser::Status st{}; st != IInputParser::Status::kStop; )
+        {
+            st = parser.read_next_bulk(q);
+            if( IInputParser::Status::kReady == st )
+                q.reset();
+        }
+        journal_commit();
+    }
+    journal_close();
+    state.SetItemsProcessed(state.iterations() * chunk_commands);
+    state.counters["journal_bytes_per_chunk"] = double(metrics().journal_bytes_.value() - bytes0) / double(state.iterations());
+}
+BENCHMARK(BM_journal_parse)->Arg(0)->Arg(1)->Arg(2)->UseRealTime();
+
+/// @brief  Голая последовательная дозапись того же объема, что журнал пишет за чанк BM_journal_parse (~1.6 КБ): 
+///         оценка снизу для накладных расходов журнала. Аргумент: 0 - write(), 1 - write() + fdatasync
+static void BM_journal_append(benchmark::State& state)
+{
+    ScopedWorkDir work_dir;
+    const int fd = ::open("bench.append", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    const std::string chunk(1600, 'x');
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(::write(fd, chunk.data(), chunk.size()));
+        if( state.range(0) )
+            ::fdatasync(fd);
+    }
+    ::close(fd);
+    state.SetBytesProcessed(state.iterations() * chunk.size());
+}
+BENCHMARK(BM_journal_append)->Arg(0)->Arg(1)->UseRealTime();
+
+/// @brief  Прием чанка из 64 команд через C ABI: готовые блоки чанка уходят исполнителям одним пакетом.
+///         Аргументы: размер блока; 0 - конвейер из декораторов (QueueExecutorMT), 1 - StaticPipelineMT, 
+///         2 - StaticPipelineRing. 
+///         Время - до передачи исполнителям, вывод завершается при disconnect
+static void BM_libasync_receive_batch(benchmark::State& state)
+{
+    constexpr size_t chunk_commands = 64;
+    ScopedWorkDir work_dir;
+    std::streambuf* prev_cout = std::cout.rdbuf(&s_null_buf);
+    const std::string chunk = make_input(chunk_commands);
+    // без пула disconnect дожидается вывода всех блоков, пока рабочий каталог еще временный
+    otus_hw9::set_context_pool_capacity(0);
+    constexpr otus_hw9::FileSinkMode sinks[] = {otus_hw9::FileSinkMode::kSharedQueue, otus_hw9::FileSinkMode::kStatic, 
+                                                otus_hw9::FileSinkMode::kRing};
+    libasync_ctx_t ctx = otus_hw9::connect(otus_hw9::Options(static_cast<size_t>(state.range(0)), nullptr, 3, 
+                                                             sinks[state.range(1)]));
+    for(auto _ : state)
+        otus_hw9::receive(ctx, chunk.data(), chunk.size());
+    otus_hw9::disconnect(ctx);
+    std::cout.rdbuf(prev_cout);
+    state.SetItemsProcessed(state.iterations() * chunk_commands);
+}
+BENCHMARK(BM_libasync_receive_batch)->ArgsProduct({{1, 4, 16}, {0, 1, 2}})->Iterations(200)->UseRealTime();
+
+/// @brief Этап без работы - в BM_stage_handoff измеряется только передача пакета писателям
+struct NullStage
+{
+    static constexpr ICommandQueue::Type queue_type = ICommandQueue::Type::qFile;
+    void operator()(BulkBatch const& batch) const { benchmark::DoNotOptimize(batch.bulks_.data()); }
+};
+
+/// @brief  Передача пакета от процессора писателям этапа и их пробуждение. Аргументы: 0 - общая очередь под мьютексом 
+///         (ThreadedStage), 1 - кольца SPSC (RingStage); число писателей. Время включает дожидание всех пакетов
+template <typename Stage>
+static void stage_handoff(benchmark::State& state)
+{
+    auto batch = std::make_shared<BulkBatch>();
+    batch->commands_ = make_bulk(4);
+    batch->bulks_.push_back(BulkBatch::Bulk{0, batch->commands_.size(), ICommandContext(4, 0, s_null_os, 0)});
+    for(auto _ : state)
+    {
+        Stage stage(otus_hw9::StageThreads{static_cast<size_t>(state.range(1)), {}});
+        for(int i = 0; i < 10000; ++i)
+            stage(batch);
+    }
+    state.SetItemsProcessed(state.iterations() * 10000);
+}
+
+static void BM_stage_handoff(benchmark::State& state)
+{
+    if( state.range(0) )
+        stage_handoff<otus_hw9::RingStage<NullStage>>(state);
+    else
+        stage_handoff<otus_hw9::ThreadedStage<NullStage>>(state);
+}
+BENCHMARK(BM_stage_handoff)->ArgsProduct({{0, 1}, {1, 4}})->UseRealTime();
+
+/// @brief  Сессия целиком: connect, 16 чанков по 64 команды, disconnect с дожиданием вывода всех блоков в консоль и файлы.
+///         Аргументы: число потоков обработки (1 - синхронный режим, вывод внутри receive), размер блока
+static void BM_libasync_session_sync(benchmark::State& state)
+{
+    constexpr size_t chunk_commands = 64, chunk_count = 16;
+    ScopedWorkDir work_dir;
+    std::streambuf* prev_cout = std::cout.rdbuf(&s_null_buf);
+    const std::string chunk = make_input(chunk_commands);
+    otus_hw9::set_context_pool_capacity(0);
+    const otus_hw9::Options options(static_cast<size_t>(state.range(1)), nullptr, static_cast<size_t>(state.range(0)));
+    for(auto _ : state)
+    {
+        libasync_ctx_t ctx = otus_hw9::connect(options);
+        for(size_t i = 0; i < chunk_count; ++i)
+            otus_hw9::receive(ctx, chunk.data(), chunk.size());
+        otus_hw9::disconnect(ctx);
+    }
+    std::cout.rdbuf(prev_cout);
+    state.SetItemsProcessed(state.iterations() * chunk_commands * chunk_count);
+}
+BENCHMARK(BM_libasync_session_sync)->ArgsProduct({{1, 3}, {1, 16}})->Iterations(10)->UseRealTime();
+
+/// @brief  Копия контекста выполнения - на каждый блок в Processor::exec_queue, CmdLogFileSetuper::setup_context и 
+///         у исполнителей. Источник общий для всех потоков, как консольный контекст процессора
+static void BM_command_context_copy(benchmark::State& state)
+{
+    static ICommandContext ctx(3, 0, s_null_os, 0);
+    for(auto _ : state)
+    {
+        ICommandContext copy(ctx);
+        benchmark::DoNotOptimize(copy);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_command_context_copy)->ThreadRange(1, 8)->UseRealTime();
+
+
+/// @brief  Контексты исполнителей в духе perf c2c: каждый из 8/16 потоков на каждом блоке пишет свой контекст, как воркер.
+///         Плотный массив ICommandContext делит строки кэша между соседями, и строка переходит между ядрами на каждую 
+///         запись (HITM в отчете perf c2c), PaddedCommandContext занимает свои строки. Аргумент: 0 - плотно, 1 - с выравниванием
+template <typename Context>
+static void context_sharing(benchmark::State& state)
+{
+    static std::vector<Context> s_contexts;
+    if( 0 == state.thread_index() )
+        s_contexts.assign(static_cast<size_t>(state.threads()), Context{});
+    for(auto _ : state)
+    {
+        ICommandContext& ctx = s_contexts[static_cast<size_t>(state.thread_index())];
+        ++ctx.cmd_idx_;
+        ++ctx.bulk_id_;
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_context_sharing(benchmark::State& state)
+{
+    if( state.range(0) )
+        context_sharing<otus_hw7::PaddedCommandContext>(state);
+    else
+        context_sharing<ICommandContext>(state);
+}
+BENCHMARK(BM_context_sharing)->Arg(0)->Arg(1)->Threads(8)->Threads(16)->UseRealTime();
+
+/// @brief  Заголовок блока очереди и воркеры: поток 0 пишет ИД блока, как процессор при раздаче, остальные читают очередь 
+///         через виртуальный size(), как воркеры в pop(). Аргумент: 0 - поток 0 только читает, 1 - пишет заголовок.
+///         Общая очередь (CommandQueueMT) держит блокировку на своей строке кэша - чтение у воркеров не замедляется от записи
+static void BM_queue_header_sharing(benchmark::State& state)
+{
+    static ICommandQueuePtr_t s_q;
+    if( 0 == state.thread_index() )
+        s_q = otus_hw9::create_command_queue(ICommandQueue::Type::qFile);
+    const bool writer = state.range(0) && 0 == state.thread_index();
+    ICommandQueue::id_t id = 0;
+    for(auto _ : state)
+    {
+        if( writer )
+            s_q->bulk_id_.store(++id, std::memory_order_relaxed);
+        else
+            benchmark::DoNotOptimize(s_q->size());
+    }
+    state.SetItemsProcessed(state.iterations());
+    if( 0 == state.thread_index() )
+        s_q.reset();
+}
+BENCHMARK(BM_queue_header_sharing)->Arg(0)->Arg(1)->Threads(8)->Threads(16)->UseRealTime();
+
+/// @brief  ИД блока из 1..16 потоков, как у парсеров разных соединений. Аргумент: 0 - общий атомарный счетчик 
+///         (прежний static в read_next_bulk), 1 - next_bulk_id() с арендой пачек ИД потоком
+static void BM_bulk_id(benchmark::State& state)
+{
+    static std::atomic<ICommandQueue::id_t> s_bulk_id{};
+    if( state.range(0) )
+        for(auto _ : state)
+            benchmark::DoNotOptimize(otus_hw7::next_bulk_id());
+    else
+        for(auto _ : state)
+            benchmark::DoNotOptimize(++s_bulk_id);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_bulk_id)->Arg(0)->Arg(1)->ThreadRange(1, 16)->UseRealTime();
+
+/// @brief  Поблочный проход однопоточного конвейера, как из Processor::exec_queue. Аргументы: 0 - из декораторов 
+///         (otus_hw7::create_queue_executor), 1 - StaticPipeline; размер блока; 0 - только консоль, 1 - консоль и файлы
+static void BM_pipeline_execute(benchmark::State& state)
+{
+    ScopedWorkDir work_dir;
+    const size_t bulk_size = static_cast<size_t>(state.range(1));
+    const bool   to_file = state.range(2) != 0;
+    ICommandPtrArray_t commands = make_bulk(bulk_size);
+
+    IQueueExecutorPtr_t executor;
+    if( state.range(0) )
+        executor = to_file ? IQueueExecutorPtr_t{std::make_shared<otus_hw9::StaticPipelineST>()} 
+                           : IQueueExecutorPtr_t{std::make_shared<otus_hw9::StaticPipeline<ConsoleStage>>()};
+    else if( to_file )
+        executor = create_queue_executor();
+    else
+    {
+        auto multi = std::make_shared<QueueExecutorMulti>(1);
+        multi->add_worker(std::make_shared<QueueExecutor>());
+        executor = multi;
+    }
+
+    CommandQueue q;
+    ICommandContext ctx(commands.size(), 0, s_null_os, 0);
+    for(auto _ : state)
+    {
+        q.copy_commands_from_array(commands, 0, commands.size());
+        ++ctx.bulk_id_;
+        executor->execute(q, ctx, commands.size());
+    }
+    state.SetItemsProcessed(state.iterations() * commands.size());
+}
+BENCHMARK(BM_pipeline_execute)->ArgsProduct({{0, 1}, {1, 16}, {0, 1}});
+
+BENCHMARK_MAIN();
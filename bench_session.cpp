@@ -0,0 +1,185 @@
+#include <benchmark/benchmark.h>
+#include <utility>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <iostream>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "bulkserver_internal.h"
+
+using namespace otus_hw10;
+
+namespace {
+
+    /// @brief Сервер bulk_server в фоновом потоке на свободном порту
+    class BenchServer
+    {
+    public:
+        explicit BenchServer(bool co_sessions, size_t session_pool = 0, size_t accept_backlog = 1) : pool_(1, otus_hw9::CpuSet_t{})
+        {
+            Options options;
+            options.port = 0;
+            options.cmd_chunk_sz = 3;
+            options.co_sessions = co_sessions;
+            options.session_pool = session_pool;
+            options.accept_backlog = accept_backlog;
+            server_ = std::make_unique<async_server>(pool_, options);
+            thread_ = std::thread([this](){ pool_.run(); });
+        }
+
+        ~BenchServer()
+        {
+            pool_.stop();
+            thread_.join();
+        }
+
+        tcp::endpoint endpoint() const { return tcp::endpoint(ba::ip::address_v4::loopback(), server_->port()); }
+
+    private:
+        io_context_pool                 pool_;
+        std::unique_ptr<async_server>   server_;
+        std::thread                     thread_;
+    };
+
+    /// @brief Рабочий каталог для файлов блоков и заглушенный std::cout на время замера
+    class ScopedBulkOutput
+    {
+    public:
+        ScopedBulkOutput() 
+            : prev_dir_(std::filesystem::current_path()), 
+              dir_(std::filesystem::temp_directory_path() / ("bench_session." + std::to_string(::getpid()))),
+              prev_cout_(std::cout.rdbuf(&null_buf_))
+        {
+            std::filesystem::create_directories(dir_);
+            std::filesystem::current_path(dir_);
+        }
+
+        ~ScopedBulkOutput()
+        {
+            std::cout.rdbuf(prev_cout_);
+            std::filesystem::current_path(prev_dir_);
+            std::error_code ec;
+            std::filesystem::remove_all(dir_, ec);
+        }
+
+    private:
+        struct NullBuf : std::streambuf
+        {
+            int overflow(int c) override { return c; }
+        };
+        NullBuf                 null_buf_;
+        std::filesystem::path   prev_dir_, dir_;
+        std::streambuf*         prev_cout_;
+    };
+
+    void wait_live_sessions(size_t cnt)
+    {
+        while( s_live_sessions.load() != cnt )
+            std::this_thread::yield();
+    }
+
+    size_t heap_in_use()
+    {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        return mallinfo2().uordblks;
+#else
+        return 0;
+#endif
+    }
+
+    size_t thread_count()
+    {
+        std::error_code ec;
+        size_t cnt = 0;
+        for(auto it = std::filesystem::directory_iterator("/proc/self/task", ec); !ec && it != std::filesystem::directory_iterator(); ++it)
+            ++cnt;
+        return cnt;
+    }
+}
+
+/// @brief Соединений в секунду: полный цикл connect - принятие - создание сессии - закрытие - разрушение сессии
+static void BM_session_connect(benchmark::State& state, bool co_sessions)
+{
+    BenchServer server(co_sessions);
+    ba::io_context client_ctx;
+    for(auto _ : state)
+    {
+        tcp::socket socket(client_ctx);
+        socket.connect(server.endpoint());
+        wait_live_sessions(1);
+        socket.close();
+        wait_live_sessions(0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_session_connect, callback, false)->UseRealTime();
+#ifdef USE_ASIO_COROUTINES
+BENCHMARK_CAPTURE(BM_session_connect, coroutine, true)->UseRealTime();
+#endif
+
+/// @brief Соединений в секунду для коротких клиентов (как nc): connect - одна команда - закрытие.
+///        Без пула каждое соединение строит конвейер и запускает потоки исполнителей, с пулом сессия с готовым
+///        конвейером переиспользуется. Аргументы: размер пула сессий, число ожидающих приемов
+static void BM_session_churn(benchmark::State& state, bool co_sessions)
+{
+    ScopedBulkOutput output;
+    BenchServer server(co_sessions, static_cast<size_t>(state.range(0)), static_cast<size_t>(state.range(1)));
+    ba::io_context client_ctx;
+    const char cmd[] = "cmd\n";
+    for(auto _ : state)
+    {
+        tcp::socket socket(client_ctx);
+        socket.connect(server.endpoint());
+        ba::write(socket, ba::buffer(cmd, sizeof(cmd) - 1));
+        wait_live_sessions(1);
+        socket.close();
+        wait_live_sessions(0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_session_churn, callback, false)->Args({0, 1})->Args({4, 4})->UseRealTime();
+#ifdef USE_ASIO_COROUTINES
+BENCHMARK_CAPTURE(BM_session_churn, coroutine, true)->Args({0, 1})->Args({4, 4})->UseRealTime();
+#endif
+
+/// @brief Память кучи и потоки на одно простаивающее соединение
+static void BM_session_idle_footprint(benchmark::State& state, bool co_sessions)
+{
+    const size_t conn_count = static_cast<size_t>(state.range(0));
+    BenchServer server(co_sessions);
+    ba::io_context client_ctx;
+    double bytes_per_conn = 0, threads_per_conn = 0;
+    for(auto _ : state)
+    {
+        const size_t heap0 = heap_in_use(), threads0 = thread_count();
+        std::vector<tcp::socket> sockets;
+        sockets.reserve(conn_count);
+        for(size_t i = 0; i < conn_count; ++i)
+        {
+            sockets.emplace_back(client_ctx);
+            sockets.back().connect(server.endpoint());
+        }
+        wait_live_sessions(conn_count);
+
+        state.PauseTiming();
+        // клиентские сокеты тоже в куче этого процесса - их вклад мал, но учитываем его одинаково для обоих вариантов
+        bytes_per_conn = double(heap_in_use() - heap0) / double(conn_count);
+        threads_per_conn = double(thread_count() - threads0) / double(conn_count);
+        state.ResumeTiming();
+
+        sockets.clear();
+        wait_live_sessions(0);
+    }
+    state.counters["bytes_per_conn"] = bytes_per_conn;
+    state.counters["threads_per_conn"] = threads_per_conn;
+}
+BENCHMARK_CAPTURE(BM_session_idle_footprint, callback, false)->Arg(256)->UseRealTime()->Unit(benchmark::kMillisecond);
+#ifdef USE_ASIO_COROUTINES
+BENCHMARK_CAPTURE(BM_session_idle_footprint, coroutine, true)->Arg(256)->UseRealTime()->Unit(benchmark::kMillisecond);
+#endif
+
+BENCHMARK_MAIN();
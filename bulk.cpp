@@ -6,11 +6,41 @@
 
 #include "bulk_internal.h"
 #include "bulk_utils.h"
+#include "bulk_metrics.h"
+#include "bulk_trace.h"
 
 
 namespace otus_hw7{
     using namespace std;
 
+    namespace{
+        /// @brief Общий счетчик аренд ИД блоков на своей строке кэша
+        struct alignas(64) BulkIdCounter
+        {
+            std::atomic<ICommandQueue::id_t> next_{1};
+        };
+        BulkIdCounter s_bulk_ids;
+
+        /// @brief Аренда потока: [next_, end_) - еще не выданные ИД
+        struct BulkIdLease
+        {
+            ICommandQueue::id_t next_;
+            ICommandQueue::id_t end_;
+        };
+        thread_local BulkIdLease tls_bulk_id_lease{0, 0};
+    }
+
+    ICommandQueue::id_t next_bulk_id()
+    {
+        BulkIdLease& lease = tls_bulk_id_lease;
+        if( lease.next_ == lease.end_ )
+        {
+            lease.next_ = s_bulk_ids.next_.fetch_add(bulk_id_lease, std::memory_order_relaxed);
+            lease.end_ = lease.next_ + bulk_id_lease;
+        }
+        return lease.next_++;
+    }
+
     IInputParser::Status   InputParser::read_next_command(ICommandPtr_t& cmd)
     {
         read_command();
@@ -22,12 +52,16 @@ namespace otus_hw7{
 
     IInputParser::Status   InputParser::read_next_bulk(ICommandQueue& cmd_queue)
     {
-		static std::atomic<ICommandQueue::id_t> bulk_id{};
         size_t bulk_size = (save_status_at_stop_ && last_stat_ != Status::kReady) || !cmd_queue.empty() ? cmd_queue.bulk_size_.load() : 0;
         Status st{};
         if( cmd_queue.empty() )
-            cmd_queue.created_at_ = std::time(nullptr),
-            cmd_queue.bulk_id_ = (last_bulk_id_ = ++bulk_id); 
+        {
+            cmd_queue.created_at_us_ = timestamp_us_ ? realtime_us() : 0;
+            cmd_queue.created_at_ = timestamp_us_ ? static_cast<time_t>(cmd_queue.created_at_us_ / 1000000) : coarse_time();
+            cmd_queue.bulk_id_ = (last_bulk_id_ = next_bulk_id()); 
+            if( sizer_ && !cmd_count_ )
+                chunk_size(sizer_->size(metrics_now_ns()));
+        }
 
         // std::cout << hex << this_thread::get_id() << " | " 
         //            << "read_next_bulk() ENTRY, cmd_queue.bulk_size_: " << cmd_queue.bulk_size_.load() 
@@ -54,6 +88,11 @@ namespace otus_hw7{
                     end_of_work = true;
                     if(!cmd_queue.empty())
                     {
+                        (dyn_block_closed_ ? metrics().bulks_dynamic_ : metrics().bulks_static_).add();
+                        cmd_queue.timeline_.parsed_ns_ = metrics_now_ns();
+                        metrics().stage_parse_ns_.record(cmd_queue.timeline_.parsed_ns_ - cmd_queue.timeline_.received_ns_);
+                        trace(TraceEventId::kParseBulk, TracePhase::kInstant, cmd_queue.bulk_id_, dyn_block_closed_);
+                        journal_bulk(journal_stream_, cmd_queue);
                         cmd = cmd_creator_->create_command_decorator(cmd_creator_->create_command(command_data_t{}, last_bulk_id_), ICommandCreator::CommandType::cmdLast);
                         need_push_cmd = true;
                     }
@@ -61,11 +100,20 @@ namespace otus_hw7{
 				case Status::kStop:
                     end_of_work = true;
 					if( !save_status_at_stop_ )
+                    {
+                        // неполный статический блок к этому моменту уже закрыт - отбрасывается только оборванный динамический
+                        if( !cmd_queue.empty() )
+                            journal_discard(journal_stream_);
                         cmd_queue.reset();
+                    }
 					break;
 			}
             if(need_push_cmd)
-        	    cmd_queue.push(std::move(cmd)), bulk_size++;
+            {
+                if( cmd_queue.empty() )
+                    cmd_queue.timeline_ = BulkTimeline{input_ns_ ? input_ns_ : metrics_now_ns(), 0, 0, false};
+                cmd_queue.push(std::move(cmd)), bulk_size++;
+            }
 		}
         cmd_queue.bulk_size_ = bulk_size;
         return st;
@@ -73,7 +121,8 @@ namespace otus_hw7{
 
     void     InputParser::set_status(Status new_st)
     {
-        if( new_st == last_stat_ )
+        // повторный kStop без сохранения состояния (отключение после приема с сохранением) все равно сбрасывает счетчики
+        if( new_st == last_stat_ && (new_st != Status::kStop || save_status_at_stop_) )
             return;
 
         switch(new_st)
@@ -102,9 +151,12 @@ namespace otus_hw7{
     {
         using token_map_t = std::map<std::string, Token>;
         static token_map_t tok_values = {{"{", Token::kBegin_Block}, {"}", Token::kEnd_Block}};
+        dyn_block_closed_ = false;
 
-        if( ((!save_status_at_stop_ && cmd_count_ > 0 && Status::kStop == last_stat_) || cmd_count_ == chunk_size_) && !block_count_ )
+        if( ((!save_status_at_stop_ && cmd_count_ > 0 && Status::kStop == last_stat_) || cmd_count_ >= chunk_size_ || 
+             (flush_requested_ && cmd_count_ > 0)) && !block_count_ )
         {
+            flush_requested_ = false;
             // std::cout << hex << this_thread::get_id() << " | " 
             //           << "save_status_at_stop_: " << save_status_at_stop_ 
             //           << ", last_stat_: " << int(last_stat_) 
@@ -136,6 +188,10 @@ namespace otus_hw7{
                 default:
                 case Token::kCommand:
                     ++cmd_count_;
+                    metrics().commands_parsed_.add();
+                    if( sizer_ )
+                        sizer_->count_command();
+                    journal_command(journal_stream_, inp_str, block_count_ > 0);
                     last_cmd_ = inp_str;
                     set_status(Status::kReading);
                     break;
@@ -151,6 +207,7 @@ namespace otus_hw7{
                     if( block_count_ > 0 )
                     {
                         if( !--block_count_ )
+                            dyn_block_closed_ = true,
                             set_status(Status::kReady);
                         else
                             set_status(Status::kIgnore);
@@ -190,12 +247,16 @@ namespace otus_hw7{
         execute(cmd_q, ctx);
     }      
 
+    void IQueueExecutor::execute_batch(ICommandQueue& cmd_q, BulkBatchPtr_t const& batch)
+    {
+        for(auto& bulk : batch->bulks_)
+            execute_from_array(cmd_q, bulk.ctx_, batch->commands_, bulk.pos_, bulk.cnt_);
+    }
+
     void QueueExecutor::execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt)
     {
         cnt = std::min(cnt, q.size());
-        DBG_TRACE( "execute", " this: " << this  
-                    << ", &q: " << &q << ", cnt: " << cnt << ", q:[" << q << "]"  
-                )
+        TraceScope trace_scope(TraceEventId::kExecuteQueue, ctx.bulk_id_, cnt);
         ICommandPtr_t cmd;
         for( ; cnt-- > 0 && q.pop(cmd) ; ++ctx.cmd_idx_)
         { 
@@ -228,13 +289,17 @@ namespace otus_hw7{
 			}
 		}
 		parser_->save_status_at_stop(save_status_at_stop0);
+        // принятое этим вызовом попадает в журнал до возврата вызывающему
+        journal_commit();
     }
 
     void    Processor::exec_queue( )
     {
+        TraceScope trace_scope(TraceEventId::kDispatchBulk, cmd_queue_->bulk_id_, cmd_queue_->bulk_size_);
         setup_context();
-        ICommandContextPtr_t exec_ctx = std::make_shared<ICommandContext>(*ctx_);
-        executor_->execute(*cmd_queue_, *exec_ctx, exec_ctx->bulk_size_);
+        // исполнители, которым контекст нужен после возврата, копируют его себе
+        ICommandContext exec_ctx = *ctx_;
+        executor_->execute(*cmd_queue_, exec_ctx, exec_ctx.bulk_size_);
     }
 
     void     Processor::setup_context()
@@ -242,7 +307,12 @@ namespace otus_hw7{
         ctx_->bulk_size_ = cmd_queue_->bulk_size_.load(); 
         ctx_->cmd_idx_ = 0;
         ctx_->cmd_created_at_ = cmd_queue_->created_at_;
+        ctx_->cmd_created_at_us_ = cmd_queue_->created_at_us_;
         ctx_->bulk_id_ = cmd_queue_->bulk_id_.load();
+        ctx_->timeline_ = cmd_queue_->timeline_;
+        ctx_->timeline_.dispatched_ns_ = metrics_now_ns();
+        if( ctx_->timeline_.parsed_ns_ )
+            metrics().stage_dispatch_ns_.record(ctx_->timeline_.dispatched_ns_ - ctx_->timeline_.parsed_ns_);
     }
 
 
@@ -257,7 +327,7 @@ namespace otus_hw7{
     {
         // забираем из входной очереди bulk_size команд в массив  
         ICommandPtrArray_t commands{};
-        q.move_commands_to_array(commands, cnt = std::min(ctx.bulk_size_.load(), cnt));
+        q.move_commands_to_array(commands, cnt = std::min(ctx.bulk_size_, cnt));
 
         // даем сигнал исполнителям выполнить из массива
         size_t i = 0;
@@ -268,6 +338,16 @@ namespace otus_hw7{
         }        
     }
 
+    void QueueExecutorMulti::execute_batch(ICommandQueue&, BulkBatchPtr_t const& batch) 
+    {
+        size_t i = 0;
+        for( auto& worker_executor: workers_ )
+        {
+            worker_executor->execute_batch(i ? *file_queue_ : *log_queue_, batch);
+            ++i;
+        }        
+    }
+
     QueueExecutorMulti& QueueExecutorMulti::remove_worker_at(size_t i)
     {  
         auto& w = workers_.at(i);
@@ -287,7 +367,11 @@ namespace otus_hw7{
     /// @return 
     IInputParserPtr_t create_parser(Options const& options)
     {
-        return IInputParserPtr_t{ new InputParser(options.cmd_chunk_sz, options.is_ ? *options.is_ : std::cin, ICommandCreatorPtr_t(new CommandCreator)) };
+        AdaptiveBulkSizePtr_t sizer;
+        if( options.cmd_chunk_max )
+            sizer = std::make_unique<AdaptiveBulkSize>(options.cmd_chunk_min, options.cmd_chunk_max, options.cmd_chunk_sz);
+        return IInputParserPtr_t{ new InputParser(options.cmd_chunk_sz, options.is_ ? *options.is_ : std::cin, ICommandCreatorPtr_t(new CommandCreator), 
+                                                  options.timestamp_us, std::move(sizer)) };
     }
     
     /// @brief Фабрика очереди команд
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <cstdint>
 #include <ctime>
 #include <iostream>
 #include <string>
 #include <memory>
 #include <queue>
 #include <atomic>
+#include <type_traits>
+#include <vector>
+
+#include "bulk_clock.h"
 
 namespace otus_hw7{
     using std::istream;
@@ -18,6 +23,7 @@ namespace otus_hw7{
     struct ICommandQueue;
     struct ICommandVisitor;
     struct IProcessor;
+    struct BulkBatch;
 
     using IQueueExecutorPtr_t = std::shared_ptr<IQueueExecutor>;
     using IQueueExecutorWPtr_t = std::weak_ptr<IQueueExecutor>;
@@ -30,8 +36,18 @@ namespace otus_hw7{
     using OStreamPtr_t = std::shared_ptr<std::ostream>;
 
     using ICommandPtrArray_t = std::vector<ICommandPtr_t>;
+    using BulkBatchPtr_t = std::shared_ptr<BulkBatch>;
     //---------------------------------------------------------------------------------------------------
     
+    /// @brief Отметки жизненного цикла блока в нс монотонных часов, 0 - этап не пройден
+    struct BulkTimeline
+    {
+        uint64_t received_ns_;      ///< получены входные данные с первой командой блока
+        uint64_t parsed_ns_;        ///< парсер закрыл блок (kReady)
+        uint64_t dispatched_ns_;    ///< Processor::exec_queue передал блок исполнителям
+        bool     to_file_;          ///< контекст исполнителя, пишущего блок в файл
+    };
+
     /// @brief  Парсер для четния, разбора ввода и формирования пакетов команд. 
     ///         Формирует пакеты, возвращая сразу данные в ICommandQueue 
     struct IInputParser
@@ -49,6 +65,18 @@ namespace otus_hw7{
         virtual Status   read_next_bulk(ICommandQueue& cmd_queue) = 0;
         virtual bool     save_status_at_stop(bool b_save) = 0;        
         virtual bool     save_status_at_stop() const = 0;        
+        /// @brief Время получения входных данных, которые будут прочитаны следующими
+        virtual void     input_received(uint64_t received_ns) = 0;
+        /// @brief Есть ли незакрытый статический блок с командами, который можно вывести досрочно
+        virtual bool     flushable() const = 0;
+        /// @brief Закрыть незакрытый статический блок на следующем чтении, не дожидаясь полного размера
+        /// @return false - выводить нечего
+        virtual bool     request_flush() = 0;
+        /// @brief Размер статического блока; новый размер действует со следующего блока
+        virtual size_t   chunk_size() const = 0;
+        virtual void     chunk_size(size_t sz) = 0;
+        /// @brief Есть ли уже полученные, но не прочитанные данные - следующее чтение не будет ждать ввода
+        virtual bool     input_buffered() const = 0;
     };
 
     /// @brief Очередь команд. Формируется парсером, затем выполняется исполнителем под управлением процессора.
@@ -63,13 +91,17 @@ namespace otus_hw7{
             qFile
         };  
 
-        time_t created_at_;
+        /// Заголовок блока (created_at_ ... timeline_) пишет парсер или процессор. Очередь создается на каждый блок, 
+        /// поэтому заголовок не выравнивается: от записи в него отделено только состояние общих очередей (CommandQueueMT)
+        time_t              created_at_;
+        uint64_t            created_at_us_;     ///< метка создания блока в мкс реального времени, 0 - не ведется
         std::atomic<id_t>   bulk_id_;
         std::atomic<size_t> bulk_size_;
+        BulkTimeline        timeline_;
 
         ICommandQueue& push_back(ICommandPtr_t cmd){ return push(cmd); }
 
-                ICommandQueue() : created_at_(std::time(nullptr)), bulk_id_{}, bulk_size_{} {}        
+                ICommandQueue() : created_at_(coarse_time()), created_at_us_{}, bulk_id_{}, bulk_size_{}, timeline_{} {}        
         virtual  ~ICommandQueue() = default;
         virtual  ICommandQueue& push(ICommandPtr_t cmd) = 0;
         virtual  bool pop(ICommandPtr_t& cmd) = 0;
@@ -111,6 +143,9 @@ namespace otus_hw7{
         /// @brief ИД блока, к которому принадлежит команда
         virtual ICommandQueue::id_t bulk_id() const = 0;
 
+        /// @brief Сколько команд ввода представляет команда: у блочной и у пакета - все их команды
+        virtual size_t command_count() const { return 1; }
+
         virtual void explore_me(ICommandVisitor& explorer) const = 0;
     };
 
@@ -122,58 +157,58 @@ namespace otus_hw7{
         virtual void execute_from_array(ICommandQueue& cmd_q, ICommandContext& ctx,
                                         const ICommandPtrArray_t& commands, size_t pos = 0, size_t cnt = size_t(-1));
         virtual void on_end_bulk(ICommandQueue&, ICommand&, ICommandContext&){ }
+        /// @brief  Выполнить пакет блоков. По умолчанию - поблочно через execute_from_array, исполнители с потоками 
+        ///         ставят весь пакет в свою очередь одной командой
+        virtual void execute_batch(ICommandQueue& cmd_q, BulkBatchPtr_t const& batch);
     };
 
-    /// @brief Контекст выполнения команды
+    /// @brief  Контекст выполнения команды. Копируется на каждый блок и каждому исполнителю, поэтому тривиально копируемый:
+    ///         без атомиков и владения потоком вывода. Поток вывода (консоль, файл блока) принадлежит тому, кто его открыл, 
+    ///         контекст держит на него невладеющий указатель. Между потоками контекст передается только копией
     struct ICommandContext
     {
-        std::atomic<size_t> bulk_size_;
+        size_t bulk_size_;
         size_t cmd_idx_;
-        OStreamPtr_t os_;
+        ostream* os_;
         time_t cmd_created_at_;
-        std::atomic<ICommandQueue::id_t> bulk_id_;
-        std::atomic_flag  interrupt_flag_; 
+        uint64_t cmd_created_at_us_;    ///< метка блока в мкс, если ведется - входит в имя файла
+        ICommandQueue::id_t bulk_id_;
+        BulkTimeline timeline_;
 
-        virtual ~ICommandContext() = default; 
         ICommandContext() 
-            : bulk_size_{}, cmd_idx_{}, os_{}, cmd_created_at_{std::time(nullptr)},
-              bulk_id_{}, interrupt_flag_{false}  {} 
+            : bulk_size_{}, cmd_idx_{}, os_{}, cmd_created_at_{coarse_time()}, cmd_created_at_us_{}, bulk_id_{}, timeline_{}  {} 
         ICommandContext(size_t bulk_size, size_t cmd_idx, ostream& os, time_t cmd_created_at) 
-            : bulk_size_(bulk_size), cmd_idx_(cmd_idx), os_(&os, [](OStreamPtr_t::element_type*){;}), 
-              cmd_created_at_(cmd_created_at), bulk_id_{}, interrupt_flag_(false) {}
-        ICommandContext(size_t bulk_size, size_t cmd_idx, OStreamPtr_t os, time_t cmd_created_at) 
-            : bulk_size_(bulk_size), cmd_idx_(cmd_idx), os_(os), 
-              cmd_created_at_(cmd_created_at), bulk_id_{}, interrupt_flag_(false) {}
-        ICommandContext(ICommandContext const& rhs) 
-            : bulk_size_(rhs.bulk_size_.load()), cmd_idx_(rhs.cmd_idx_), os_(rhs.os_), 
-              cmd_created_at_(rhs.cmd_created_at_), bulk_id_{rhs.bulk_id_.load()}, interrupt_flag_(false) {  }
-
-        void swap(ICommandContext& rhs)
-        {
-            if( &rhs != this )
-            {
-                bulk_size_.exchange(rhs.bulk_size_);
-                std::swap(cmd_idx_, rhs.cmd_idx_);
-                std::swap(os_, rhs.os_);
-                std::swap(cmd_created_at_, rhs.cmd_created_at_);
-                bulk_id_.exchange(rhs.bulk_id_);
-                bool lhs_f = interrupt_flag_.test_and_set();
-                bool rhs_f = rhs.interrupt_flag_.test_and_set();
-                std::swap(lhs_f, rhs_f);
-                if( !lhs_f ) interrupt_flag_.clear();
-                if( !rhs_f ) rhs.interrupt_flag_.clear();
-            }
-        } 
-
-        ICommandContext& operator=(ICommandContext const& rhs)
+            : bulk_size_(bulk_size), cmd_idx_(cmd_idx), os_(&os), 
+              cmd_created_at_(cmd_created_at), cmd_created_at_us_{}, bulk_id_{}, timeline_{} {}
+
+        void swap(ICommandContext& rhs) { std::swap(*this, rhs); } 
+    };
+    static_assert(std::is_trivially_copyable_v<ICommandContext>, "контекст копируется на каждый блок");
+
+    /// @brief  Контекст, который на каждом блоке пишет поток исполнителя (воркер, файловый этап): занимает целые строки кэша 
+    ///         и не делит их с соседними выделениями других потоков. Копии в пакетах и на стеке остаются плотными
+    struct alignas(64) PaddedCommandContext : ICommandContext
+    {
+        PaddedCommandContext() = default;
+        explicit PaddedCommandContext(ICommandContext const& ctx) : ICommandContext(ctx) {}
+    };
+
+    /// @brief  Пакет готовых блоков одного вызова IProcessor::process: команды всех блоков подряд и контекст каждого блока.
+    ///         Исполнители получают его целиком - одна постановка в очередь и одно пробуждение на пакет, а не на блок
+    struct BulkBatch
+    {
+        struct Bulk
         {
-            if( &rhs != this )
-            {
-                ICommandContext tmp(rhs);
-                swap(tmp);
-            }
-            return *this;
-        } 
+            size_t          pos_;   ///< первая команда блока в commands_
+            size_t          cnt_;   ///< команд блока, включая завершающую
+            ICommandContext ctx_;
+        };
+
+        ICommandPtrArray_t commands_;
+        std::vector<Bulk>  bulks_;
+
+        /// @brief ИД пакета - ИД его первого блока
+        ICommandQueue::id_t id() const { return bulks_.empty() ? ICommandQueue::id_t{} : bulks_.front().ctx_.bulk_id_; }
     };
 
     /// @brief Процессор - управляющий обработкой посредник
@@ -181,6 +216,13 @@ namespace otus_hw7{
     {
         virtual ~IProcessor() = default;
         virtual void process(bool save_status_at_stop = false) = 0;
+        /// @brief Время получения входных данных, которые будут обработаны следующим process()
+        virtual void input_received(uint64_t received_ns) = 0;
+        /// @brief Время получения первой команды неполного статического блока, 0 - такого блока нет
+        virtual uint64_t pending_since() const = 0;
+        /// @brief Досрочно вывести неполный статический блок
+        /// @return false - выводить нечего
+        virtual bool flush() = 0;
     };
 
     
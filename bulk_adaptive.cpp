@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "bulk_adaptive.h"
+#include "bulk_metrics.h"
+
+namespace otus_hw7{
+
+    namespace{
+        /// @brief Общая для процесса выборка: пересчет под мьютексом без ожидания, чтение - из атомиков
+        struct QueueDepthSampler
+        {
+            std::mutex              mx_;
+            std::atomic<uint64_t>   next_ns_{};
+            std::atomic<int64_t>    depth_{};
+        };
+    }
+
+    int64_t file_queue_depth_sample(uint64_t now_ns)
+    {
+        static QueueDepthSampler sampler;
+        if( now_ns >= sampler.next_ns_.load(std::memory_order_relaxed) )
+        {
+            std::unique_lock lk(sampler.mx_, std::try_to_lock);
+            if( lk && now_ns >= sampler.next_ns_.load(std::memory_order_relaxed) )
+            {
+                sampler.depth_.store(metrics().queue_depth_[static_cast<size_t>(ICommandQueue::Type::qFile)].value(), std::memory_order_relaxed);
+                sampler.next_ns_.store(now_ns + AdaptiveBulkSize::window_ns, std::memory_order_relaxed);
+            }
+        }
+        return sampler.depth_.load(std::memory_order_relaxed);
+    }
+
+    AdaptiveBulkSize::AdaptiveBulkSize(size_t min_size, size_t max_size, size_t initial, QueueDepthFn_t queue_depth)
+        : min_size_(std::max<size_t>(min_size, 1)), max_size_(std::max(max_size, min_size_)), 
+          current_(std::clamp(initial, min_size_, max_size_)), next_update_ns_{}, queue_depth_(queue_depth),
+          commands_{}, last_commands_{}, last_ns_{}, rate_{}
+    {
+        metrics().bulk_size_effective_.store(static_cast<int64_t>(current_), std::memory_order_relaxed);
+    }
+
+    size_t AdaptiveBulkSize::size(uint64_t now_ns)
+    {
+        if( now_ns < next_update_ns_ )
+            return current_;
+        next_update_ns_ = now_ns + window_ns;
+        if( last_ns_ && now_ns > last_ns_ )
+            rate_ = (rate_ + double(commands_ - last_commands_) * 1e9 / double(now_ns - last_ns_)) / 2;
+        last_ns_ = now_ns;
+        last_commands_ = commands_;
+        const size_t new_size = target(LoadSample{rate_, queue_depth_(now_ns)}, current_, min_size_, max_size_);
+        if( new_size != current_ )
+        {
+            current_ = new_size;
+            metrics().bulk_size_effective_.store(static_cast<int64_t>(current_), std::memory_order_relaxed);
+        }
+        return current_;
+    }
+
+    size_t AdaptiveBulkSize::target(LoadSample const& load, size_t current, size_t min_size, size_t max_size)
+    {
+        double size = load.commands_per_s_ * double(fill_budget_ns) / 1e9;
+        if( load.file_queue_depth_ > static_cast<int64_t>(backlog_bulks * current) )
+            size = std::max(size, double(current) * 2);
+        size = std::clamp(size, double(current) / 2, double(current) * 2);
+        return std::clamp(static_cast<size_t>(std::llround(size)), min_size, max_size);
+    }
+}
\ No newline at end of file
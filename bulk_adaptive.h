@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace otus_hw7{
+
+    /// @brief Нагрузка за последнее окно выборки
+    struct LoadSample
+    {
+        double   commands_per_s_;       ///< скорость потока команд своего парсера, сглаженная по окнам
+        int64_t  file_queue_depth_;     ///< команд ждет в очереди файловых воркеров процесса
+    };
+
+    /// @brief Глубина очереди файловых воркеров по метрикам процесса. Пересчитывается не чаще раза в окно тем, кто первым 
+    ///        спросил, остальные получают последнюю опубликованную - одна выборка на процесс, а не на сессию
+    int64_t file_queue_depth_sample(uint64_t now_ns);
+    using QueueDepthFn_t = int64_t (*)(uint64_t now_ns);
+
+    /// @brief  Адаптивный размер статического блока в границах [min_size, max_size]. Под нагрузкой блок растет - 
+    ///         меньше файлов на то же число команд, при слабом потоке уменьшается - блок не копится долго.
+    ///         Скорость потока - своя у каждого парсера: сессия видит только свою долю команд процесса.
+    ///         Размер пересчитывается раз в окно и применяется парсером к следующему блоку. Один объект на парсер.
+    class AdaptiveBulkSize
+    {
+    public:
+        static constexpr uint64_t window_ns = 100'000'000;      ///< окно выборки нагрузки
+        static constexpr uint64_t fill_budget_ns = 50'000'000;  ///< за сколько блок должен набираться при текущей скорости
+        static constexpr size_t   backlog_bulks = 4;            ///< очередь файловых воркеров длиннее стольких блоков - укрупнять
+
+        /// @param queue_depth - источник глубины очереди файловых воркеров, по умолчанию общий для процесса
+        AdaptiveBulkSize(size_t min_size, size_t max_size, size_t initial, QueueDepthFn_t queue_depth = file_queue_depth_sample);
+
+        /// @brief Парсер принял команду
+        void   count_command() { ++commands_; }
+
+        /// @brief Размер для очередного блока
+        size_t size(uint64_t now_ns);
+
+        /// @brief Политика: размер под скорость потока, удвоение при отставании файловых воркеров, 
+        ///        за одно окно - не больше чем вдвое от текущего
+        static size_t target(LoadSample const& load, size_t current, size_t min_size, size_t max_size);
+
+    private:
+        size_t          min_size_, max_size_, current_;
+        uint64_t        next_update_ns_;
+        QueueDepthFn_t  queue_depth_;
+        uint64_t        commands_;          ///< принято парсером за все время
+        uint64_t        last_commands_;     ///< ... на момент прошлой выборки
+        uint64_t        last_ns_;           ///< время прошлой выборки, 0 - выборок не было
+        double          rate_;              ///< сглаженная скорость потока парсера, команд в секунду
+    };
+
+    using AdaptiveBulkSizePtr_t = std::unique_ptr<AdaptiveBulkSize>;
+}
\ No newline at end of file
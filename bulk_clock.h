@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <time.h>
+
+namespace otus_hw7{
+
+    /// @brief Секунды реального времени по грубым часам ядра: CLOCK_REALTIME_COARSE читается из vDSO без системного вызова,
+    ///        точность - тик ядра (1-4 мс), для метки блока с точностью до секунды этого достаточно
+    inline time_t coarse_time()
+    {
+#ifdef CLOCK_REALTIME_COARSE
+        timespec ts{};
+        if( !clock_gettime(CLOCK_REALTIME_COARSE, &ts) )
+            return ts.tv_sec;
+#endif
+        return std::time(nullptr);
+    }
+
+    /// @brief Реальное время в мкс - для меток блоков и имен файлов с точностью до микросекунды
+    inline uint64_t realtime_us()
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+    }
+}
\ No newline at end of file
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -6,8 +8,13 @@
 
 #include <map>
 #include <algorithm>
+#include <charconv>
 
 #include "bulk.h"
+#include "bulk_adaptive.h"
+#include "bulk_journal.h"
+#include "bulk_metrics.h"
+#include "bulk_trace.h"
 
 #include "mydbgtrace.h"
 
@@ -29,13 +36,22 @@ namespace otus_hw7{
     /// @return Указатель на абстрактный интерфейс очереди команд 
     ICommandQueuePtr_t create_command_queue(ICommandQueue::Type);
 
+    /// @brief  ИД нового блока: уникален в процессе и растет в пределах потока. Поток арендует у общего счетчика 
+    ///         bulk_id_lease идущих подряд ИД и раздает их без атомарных операций - общая строка кэша трогается раз 
+    ///         на аренду, а не на каждый блок. ИД разных потоков перемежаются пачками, остаток аренды завершившегося 
+    ///         потока не используется
+    constexpr ICommandQueue::id_t bulk_id_lease = 256;
+    ICommandQueue::id_t next_bulk_id();
+
     /// @brief Реализация парсера входного потока команд
     class InputParser : public IInputParser
     {
     public:
-        InputParser(size_t chunk_size, istream& is, ICommandCreatorPtr_t cmd_creator) 
+        InputParser(size_t chunk_size, istream& is, ICommandCreatorPtr_t cmd_creator, bool timestamp_us = false, 
+                    AdaptiveBulkSizePtr_t sizer = nullptr) 
             : save_status_at_stop_(false), is_(is), chunk_size_(chunk_size), cmd_creator_{std::move(cmd_creator)},
-              last_tok_{}, last_stat_{}, last_bulk_id_{} { }
+              last_tok_{}, last_stat_{}, last_bulk_id_{}, timestamp_us_(timestamp_us), sizer_(std::move(sizer)), 
+              journal_stream_(journal_new_stream()) { }
         Status   read_next_command(ICommandPtr_t& cmd) override;        
         Status   read_next_bulk(ICommandQueue& cmd_queue) override;
         bool     save_status_at_stop(bool b_save) override 
@@ -44,6 +60,12 @@ namespace otus_hw7{
             return b_save;
         }
         bool     save_status_at_stop() const override { return save_status_at_stop_; }
+        void     input_received(uint64_t received_ns) override { input_ns_ = received_ns; }
+        bool     flushable() const override { return cmd_count_ > 0 && !block_count_; }
+        bool     request_flush() override { return flush_requested_ = flushable(); }
+        size_t   chunk_size() const override { return chunk_size_; }
+        void     chunk_size(size_t sz) override { chunk_size_ = std::max<size_t>(sz, 1); }
+        bool     input_buffered() const override { return is_.rdbuf() && is_.rdbuf()->in_avail() > 0; }
 
     private:
         enum class Token : uint8_t
@@ -60,12 +82,18 @@ namespace otus_hw7{
         bool       save_status_at_stop_;
         istream&   is_;
         size_t     chunk_size_, cmd_count_ = 0, block_count_ = 0;
+        bool       dyn_block_closed_ = false;   ///< последняя прочитанная лексема закрыла динамический блок
+        bool       flush_requested_ = false;    ///< закрыть неполный статический блок на следующем чтении
+        uint64_t   input_ns_ = 0;               ///< время получения читаемых данных, 0 - неизвестно
 
         ICommandCreatorPtr_t cmd_creator_;
         command_data_t  last_cmd_; 
         Token        last_tok_;       
         Status       last_stat_;
         ICommandQueue::id_t last_bulk_id_;               
+        bool         timestamp_us_;
+        AdaptiveBulkSizePtr_t sizer_;   ///< адаптивный размер блока, nullptr - размер фиксирован
+        uint64_t     journal_stream_;   ///< номер потока команд в журнале
     };
 
     class EmptyCommand;
@@ -130,6 +158,10 @@ namespace otus_hw7{
         {
             return wrapped_cmd_ ? wrapped_cmd_->bulk_id() : ICommandQueue::id_t{};
         }
+        virtual size_t command_count() const override
+        {
+            return wrapped_cmd_ ? wrapped_cmd_->command_count() : 1;
+        }
 
         virtual void explore_me(ICommandVisitor& explorer) const override
         {
@@ -151,6 +183,10 @@ namespace otus_hw7{
         {
             CommandDecorator::execute(ctx);
             *ctx.os_ << std::endl;
+            metrics().record_bulk_written(ctx.timeline_);
+            // std::endl уже сбросил блок из буфера файла
+            if( ctx.timeline_.to_file_ )
+                journal_done(ctx.bulk_id_);
         }
         virtual CommandType type() const override
         {
@@ -244,6 +280,7 @@ namespace otus_hw7{
         using  queue_t = std::queue<ICommandPtr_t>;
         queue_t q_;
     };
+    static_assert(alignof(CommandQueue) < 64, "очередь создается на каждый блок и не выравнивается по строке кэша");
 
     inline std::ostream& operator<<(std::ostream& os, ICommandQueue& q){ return q.print(os); } 
     std::ostream& operator<<(std::ostream& os, ICommandPtrArray_t const& arr);
@@ -265,6 +302,7 @@ namespace otus_hw7{
                            ICommandQueuePtr_t log_queue = create_command_queue(CommandQueue::Type::qLog), 
                            ICommandQueuePtr_t file_queue = create_command_queue(CommandQueue::Type::qFile));
         virtual void execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt) override;
+        virtual void execute_batch(ICommandQueue& q, BulkBatchPtr_t const& batch) override;
 
         QueueExecutorMulti& add_worker(IQueueExecutorPtr_t worker) { check_worker_count(); workers_.emplace_back(std::move(worker)); return *this; }
         QueueExecutorMulti& remove_worker_at(size_t i);
@@ -311,7 +349,7 @@ namespace otus_hw7{
     class CmdLogFileSetuper 
     {
     public:
-        CmdLogFileSetuper() : ctx_(std::make_shared<ICommandContext>())
+        CmdLogFileSetuper() : ctx_(std::make_shared<PaddedCommandContext>())
         {
         }
 
@@ -322,17 +360,50 @@ namespace otus_hw7{
         {
             std::unique_lock lk(guard_mx);
             *ctx_ = ctx;
+            ctx_->timeline_.to_file_ = true;
             init_log(ctx, q);
-            ctx_->os_ = log_;
+            ctx_->os_ = log_.get();
         }
 
+        /// @brief Имя файла блока <время>[.<мкс>]-<ИД блока>-<поток>-<объект>.log начинается с метки времени, поэтому 
+        ///        файлы упорядочены по времени. Собирается через to_chars, идентификатор потока форматируется один раз на поток
         std::string get_log_filenm(ICommandContext const& ctx)
         {
-            std::ostringstream oss;
-            oss << ctx.cmd_created_at_ << "-" << ctx.bulk_id_ 
-                << "-" << std::hex << std::this_thread::get_id() 
-                << "-" << this << ".log";
-            return oss.str();
+            std::string name;
+            format_log_filenm(ctx, name);
+            return name;
+        }
+
+        /// @brief Имя файла блока в переиспользуемую строку name
+        void format_log_filenm(ICommandContext const& ctx, std::string& name)
+        {
+            thread_local const std::string thread_part = [](){ 
+                std::ostringstream oss; 
+                oss << std::hex << std::this_thread::get_id(); 
+                return oss.str(); 
+            }();
+
+            char buf[64];
+            char* const end = buf + sizeof(buf);
+            char* p = std::to_chars(buf, end, ctx.cmd_created_at_).ptr;
+            if( ctx.cmd_created_at_us_ )
+            {
+                *p++ = '.';
+                uint64_t us = ctx.cmd_created_at_us_ % 1000000;
+                for(char* d = p + 5; d >= p; --d, us /= 10)
+                    *d = static_cast<char>('0' + us % 10);
+                p += 6;
+            }
+            *p++ = '-';
+            p = std::to_chars(p, end, ctx.bulk_id_).ptr;
+            *p++ = '-';
+
+            name.assign(buf, p);
+            name += thread_part;
+            name += "-0x";
+            p = std::to_chars(buf, end, reinterpret_cast<uintptr_t>(this), 16).ptr;
+            name.append(buf, p);
+            name += ".log";
         }
 
         void init_log(ICommandContext const& ctx, ICommandQueue& q)
@@ -348,8 +419,29 @@ namespace otus_hw7{
                 log_->open(file_nm, std::ios_base::out | std::ios_base::ate );
             }
         }
+        /// @brief Контекст очередного блока пакета: каждый блок - в свой новый файл. Поток файла и строка имени 
+        ///        переиспользуются от блока к блоку, файл закрывает close_bulk()
+        void setup_next_bulk(ICommandContext const& ctx)
+        {
+            *ctx_ = ctx;
+            ctx_->timeline_.to_file_ = true;
+            if( !log_ )
+                log_ = std::make_shared<std::ofstream>();
+            format_log_filenm(ctx, file_nm_);
+            log_->clear();
+            log_->open(file_nm_, std::ios_base::out | std::ios_base::ate);
+            ctx_->os_ = log_.get();
+        }
+
+        void close_bulk()
+        {
+            if( log_ )
+                log_->close();
+        }
+
         std::shared_ptr<std::ofstream>  log_;
         ICommandContextPtr_t ctx_;
+        std::string file_nm_;
         std::mutex guard_mx;
     };
 
@@ -394,14 +486,114 @@ namespace otus_hw7{
             setup_context(ctx, q_);
             {
                 std::unique_lock<std::mutex> lk(guard_mx);
-                ctx.os_ = log_;
+                ctx.os_ = log_.get();
             }
+            const uint64_t started_ns = metrics_now_ns();
+            TraceScope trace_scope(TraceEventId::kFileWrite, ctx_->bulk_id_);
             BaseCls_t::execute(*ctx_);
+            metrics().file_write_ns_.record(metrics_now_ns() - started_ns);
         }
     protected:
         ICommandQueue& q_;
     };
 
+    /// @brief Выполнить команды блока пакета в контексте ctx
+    inline void execute_bulk(BulkBatch const& batch, BulkBatch::Bulk const& bulk, ICommandContext& ctx)
+    {
+        auto it = batch.commands_.begin() + bulk.pos_;
+        for(auto last = it + bulk.cnt_; it != last; ++it, ++ctx.cmd_idx_)
+            (**it)(ctx);
+    }
+
+    /// @brief Буфер потока вывода в строку, память которой остается от записи к записи
+    class StringAppendBuf : public std::streambuf
+    {
+    public:
+        std::string& str() { return s_; }
+    protected:
+        int_type        overflow(int_type c) override 
+        { 
+            if( !traits_type::eq_int_type(c, traits_type::eof()) )
+                s_.push_back(traits_type::to_char_type(c));
+            return traits_type::not_eof(c); 
+        }
+        std::streamsize xsputn(const char* p, std::streamsize n) override { s_.append(p, static_cast<size_t>(n)); return n; }
+    private:
+        std::string s_;
+    };
+
+    /// @brief  Этап вывода блоков пакета на консоль - в поток контекста блока, по порядку. 
+    ///         Блок форматируется в буфер потока выполнения и уходит в поток вывода одной записью: 
+    ///         строки блоков из разных потоков (сессий) не перемешиваются, а консоль не блокируется на каждую команду.
+    ///         Пакет одновременно может выполнять и файловый этап, поэтому контекст блока только читается.
+    ///         Этап консоли в метриках замеряется здесь, после записи блока, а не в SimpleCommandLast
+    struct ConsoleStage
+    {
+        static constexpr ICommandQueue::Type queue_type = ICommandQueue::Type::qLog;
+
+        void operator()(BulkBatch const& batch) const
+        {
+            thread_local StringAppendBuf line_buf;
+            thread_local std::ostream     line_os(&line_buf);
+            for(auto const& bulk : batch.bulks_)
+            {
+                ICommandContext ctx = bulk.ctx_;
+                ctx.os_ = &line_os;
+                // блок выведен в консоль после write().flush(), а не при форматировании в буфер
+                ctx.timeline_.dispatched_ns_ = 0;
+                execute_bulk(batch, bulk, ctx);
+                std::string& line = line_buf.str();
+                bulk.ctx_.os_->write(line.data(), static_cast<std::streamsize>(line.size())).flush();
+                line.clear();
+                metrics().record_bulk_written(bulk.ctx_.timeline_);
+            }
+        }
+    };
+
+    /// @brief Этап вывода блоков пакета в файлы: каждый блок - в свой файл
+    class FileStage : protected CmdLogFileSetuper
+    {
+    public:
+        static constexpr ICommandQueue::Type queue_type = ICommandQueue::Type::qFile;
+
+        void operator()(BulkBatch const& batch)
+        {
+            for(auto const& bulk : batch.bulks_)
+            {
+                setup_next_bulk(bulk.ctx_);
+                const uint64_t started_ns = metrics_now_ns();
+                TraceScope trace_scope(TraceEventId::kFileWrite, ctx_->bulk_id_);
+                execute_bulk(batch, bulk, *ctx_);
+                close_bulk();
+                metrics().file_write_ns_.record(metrics_now_ns() - started_ns);
+            }
+        }
+    };
+
+    /// @brief  Команда пакета блоков для этапа Stage - для исполнителей, собранных из декораторов.
+    ///         Пакет - одна команда в очереди исполнителя вместо команды на каждую команду каждого блока
+    template <typename Stage>
+    class BulkBatchStageCommand : public ICommand
+    {
+    public:
+        explicit BulkBatchStageCommand(BulkBatchPtr_t batch) : batch_(std::move(batch)) {}
+
+        virtual void execute(ICommandContext&) override { stage_(*batch_); }
+        virtual CommandType type() const override { return CommandType::cmdBulk; }
+        virtual ICommandQueue::id_t bulk_id() const override { return batch_->id(); }
+        virtual size_t command_count() const override { return batch_->commands_.size(); }
+        virtual void explore_me(ICommandVisitor& explorer) const override
+        {
+            explorer.explore_cmd(static_cast<ICommand const&>(*this));
+        }
+    protected:
+        BulkBatchPtr_t batch_;
+        Stage          stage_;
+    };
+
+    using BulkBatchCommand = BulkBatchStageCommand<ConsoleStage>;
+    using BulkBatchToFileCommand = BulkBatchStageCommand<FileStage>;
+
     class QueueExecutorToFile : public QueueExecutorDecorator, protected CmdLogFileSetuper
     {
     public:
@@ -413,14 +605,20 @@ namespace otus_hw7{
         virtual void execute(ICommandQueue& q, ICommandContext& ctx, size_t cnt) override 
         {
             setup_context(ctx, q);
+            const uint64_t started_ns = metrics_now_ns();
+            TraceScope trace_scope(TraceEventId::kFileWrite, ctx_->bulk_id_);
             BaseCls_t::execute(q, *ctx_, cnt);
+            metrics().file_write_ns_.record(metrics_now_ns() - started_ns);
         }
 
         virtual void execute_from_array(ICommandQueue& q, ICommandContext& ctx,
                                         const ICommandPtrArray_t& commands, size_t pos, size_t cnt) override
         {
             setup_context(ctx, q);
+            const uint64_t started_ns = metrics_now_ns();
+            TraceScope trace_scope(TraceEventId::kFileWrite, ctx_->bulk_id_);
             BaseCls_t::execute_from_array(q, *ctx_, commands, pos, cnt);
+            metrics().file_write_ns_.record(metrics_now_ns() - started_ns);
         }
     };
 
@@ -460,6 +658,7 @@ namespace otus_hw7{
         }
 
         virtual CommandType type() const override { return CommandType::cmdBulk; }
+        virtual size_t command_count() const override { return cnt_; }
         virtual void explore_me(ICommandVisitor& explorer) const override
         {
             explorer.explore_cmd(*this);
@@ -527,9 +726,8 @@ namespace otus_hw7{
     public:
         using BaseCls_t = QueueExecutorDecorator;
         QueueExecutorToBulkInitializer(IQueueExecutorPtr_t wrapee, 
-                                       ICommandQueuePtr_t q = std::make_shared<CommandQueue>(),
                                        IQueueExecutorPtr_t q_executor = std::make_unique<QueueExecutor>()) 
-            : QueueExecutorDecorator(std::move(wrapee)), q_(q), q_executor_(q_executor)  
+            : QueueExecutorDecorator(std::move(wrapee)), q_executor_(q_executor)  
         {
         }
 
@@ -562,10 +760,10 @@ namespace otus_hw7{
                  */
         virtual ICommandPtr_t create_bulk_cmd(ICommandQueue&, ICommandPtrArray_t const& commands, size_t pos, size_t cnt)
         {
-            return std::make_shared<BulkCommand>(commands, pos, cnt, q_, q_executor_);
+            // у каждого блока своя очередь: блоки могут выполняться параллельно
+            return std::make_shared<BulkCommand>(commands, pos, cnt, std::make_shared<CommandQueue>(), q_executor_);
         }
 
-        ICommandQueuePtr_t  q_;
         IQueueExecutorPtr_t q_executor_;
     };
 
@@ -578,16 +776,28 @@ namespace otus_hw7{
     public:
         using BaseCls_t = QueueExecutorDecorator;
         QueueExecutorToFileInitializer(IQueueExecutorPtr_t wrapee, 
-                                       ICommandQueuePtr_t q = std::make_shared<CommandQueue>(),
                                        IQueueExecutorPtr_t q_executor = std::make_unique<QueueExecutor>()) 
-            : QueueExecutorToBulkInitializer(std::move(wrapee), q, q_executor)  
+            : QueueExecutorToBulkInitializer(std::move(wrapee), q_executor)  
+        {
+        }
+
+        /// @brief Весь пакет - одна команда вывода в файлы в очереди q
+        virtual void execute_batch(ICommandQueue& q, BulkBatchPtr_t const& batch) override
         {
+            if( batch->bulks_.empty() )
+                return;
+            q.bulk_id_ = batch->id();
+            q.push(std::make_shared<BulkBatchToFileCommand>(batch));
+            BaseCls_t::execute(q, batch->bulks_.front().ctx_, 1);
         }
 
     protected:
         virtual ICommandPtr_t create_bulk_cmd(ICommandQueue& q_up, ICommandPtrArray_t const& commands, size_t pos, size_t cnt)
         {
-            return std::make_shared<CommandToFileInitDecorator>(std::make_shared<BulkCommand>(commands, pos, cnt, q_, q_executor_), q_up);
+            // блоки выполняются файловыми воркерами параллельно - в общей очереди команды разных блоков перемешивались бы,
+            // поэтому у каждого блока своя очередь
+            return std::make_shared<CommandToFileInitDecorator>(std::make_shared<BulkCommand>(commands, pos, cnt, 
+                                                                                              std::make_shared<CommandQueue>(), q_executor_), q_up);
         }
     };
 
@@ -600,6 +810,18 @@ namespace otus_hw7{
         parser_(std::move(parser)), cmd_queue_(std::move(cmd_queue)), executor_(std::move(executor)),
         ctx_(std::make_unique<ICommandContext>(0, 0, std::cout, 0)) {}
         void process(bool save_status_at_stop) override;
+        void input_received(uint64_t received_ns) override { parser_->input_received(received_ns); }
+        uint64_t pending_since() const override 
+        { 
+            return !cmd_queue_->empty() && parser_->flushable() ? cmd_queue_->timeline_.received_ns_ : 0; 
+        }
+        bool flush() override
+        {
+            if( !parser_->request_flush() )
+                return false;
+            process(true);
+            return true;
+        }
     
     protected:
         virtual void     exec_queue( );
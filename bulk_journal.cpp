@@ -0,0 +1,540 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bulk_journal.h"
+#include "bulk_internal.h"
+#include "bulk_metrics.h"
+
+namespace otus_hw7{
+    namespace journal_detail{
+        std::atomic<bool> enabled{false};
+
+        namespace{
+            constexpr char   magic[8] = {'B', 'J', 'R', 'N', 'L', 0, 0, 1};
+            constexpr size_t header_size = 2 * sizeof(uint32_t);
+
+            /// @brief CRC32C (Castagnoli) таблицей по байту - когда нет SSE4.2
+            uint32_t crc32c_table(uint32_t crc, const char* data, size_t size)
+            {
+                static const auto table = [](){
+                    std::array<uint32_t, 256> t{};
+                    for(uint32_t i = 0; i < 256; ++i)
+                    {
+                        uint32_t c = i;
+                        for(int k = 0; k < 8; ++k)
+                            c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                        t[i] = c;
+                    }
+                    return t;
+                }();
+                for(size_t i = 0; i < size; ++i)
+                    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+                return crc;
+            }
+
+#if defined(__x86_64__)
+            __attribute__((target("sse4.2")))
+            uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t size)
+            {
+                uint64_t c = crc;
+                for( ; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t))
+                {
+                    uint64_t v;
+                    std::memcpy(&v, data, sizeof(v));
+                    c = __builtin_ia32_crc32di(c, v);
+                }
+                crc = static_cast<uint32_t>(c);
+                for( ; size; ++data, --size)
+                    crc = __builtin_ia32_crc32qi(crc, static_cast<uint8_t>(*data));
+                return crc;
+            }
+#endif
+
+            /// @brief Контрольная сумма записи - CRC32C, на x86-64 с SSE4.2 - инструкцией crc32
+            uint32_t crc32(const char* data, size_t size)
+            {
+#if defined(__x86_64__)
+                static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+                if( has_sse42 )
+                    return ~crc32c_sse42(~0u, data, size);
+#endif
+                return ~crc32c_table(~0u, data, size);
+            }
+
+            template <typename T>
+            void put(std::string& buf, T value)
+            {
+                buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            }
+
+            template <typename T>
+            bool get(std::string_view& data, T& value)
+            {
+                if( data.size() < sizeof(value) )
+                    return false;
+                std::memcpy(&value, data.data(), sizeof(value));
+                data.remove_prefix(sizeof(value));
+                return true;
+            }
+
+            /// @brief Начать запись: место под заголовок и тип. Возвращает смещение записи для finish_record()
+            size_t begin_record(std::string& buf, JournalRecordType type)
+            {
+                const size_t at = buf.size();
+                buf.append(header_size, '\0');
+                put(buf, static_cast<uint8_t>(type));
+                return at;
+            }
+
+            void finish_record(std::string& buf, size_t at)
+            {
+                const uint32_t size = static_cast<uint32_t>(buf.size() - at - header_size);
+                const uint32_t crc = crc32(buf.data() + at + header_size, size);
+                std::memcpy(buf.data() + at, &size, sizeof(size));
+                std::memcpy(buf.data() + at + sizeof(size), &crc, sizeof(crc));
+            }
+
+            void write_all(int fd, const char* data, size_t size)
+            {
+                while( size )
+                {
+                    const ssize_t n = ::write(fd, data, size);
+                    if( n < 0 && errno == EINTR )
+                        continue;
+                    if( n < 0 )
+                        throw std::system_error(errno, std::generic_category(), "journal write");
+                    data += n, size -= static_cast<size_t>(n);
+                }
+            }
+
+            /// @brief Блок, собранный по журналу
+            struct ReplayBulk
+            {
+                uint64_t                 stream_;
+                int64_t                  created_at_;
+                uint64_t                 created_at_us_;
+                std::vector<std::string> commands_;
+            };
+
+            /// @brief Незакрытый блок потока
+            struct ReplayStream
+            {
+                std::vector<std::string> commands_;
+                bool                     dynamic_ = false;
+            };
+
+            /// @brief  Незавершенное по журналу: незакрытые блоки потоков и закрытые блоки без отметки kDone. Завершенное 
+            ///         сразу забывается - память по числу незавершенных блоков, а не по всему журналу
+            class JournalState
+            {
+            public:
+                /// @brief Учесть запись rec без заголовка
+                void apply(std::string_view rec)
+                {
+                    uint8_t type{};
+                    uint64_t stream{};
+                    ICommandQueue::id_t bulk_id{};
+                    get(rec, type);
+                    switch( static_cast<JournalRecordType>(type) )
+                    {
+                        case JournalRecordType::kCommand:
+                        {
+                            uint8_t dynamic{};
+                            get(rec, stream), get(rec, dynamic);
+                            auto& s = streams_[stream];
+                            s.commands_.emplace_back(rec);
+                            s.dynamic_ = dynamic != 0;
+                            break;
+                        }
+                        case JournalRecordType::kBulk:
+                        {
+                            ReplayBulk bulk{stream, 0, 0, {}};
+                            get(rec, bulk.stream_), get(rec, bulk_id), get(rec, bulk.created_at_), get(rec, bulk.created_at_us_);
+                            auto p_stream = streams_.find(bulk.stream_);
+                            if( p_stream != streams_.end() )
+                                bulk.commands_ = std::move(p_stream->second.commands_), streams_.erase(p_stream);
+                            max_id_ = std::max(max_id_, bulk_id);
+                            // отметка может опередить kBulk: она пишется в журнал сразу
+                            if( !done_.erase(bulk_id) )
+                                bulks_[bulk_id] = std::move(bulk);
+                            break;
+                        }
+                        case JournalRecordType::kDiscard:
+                            get(rec, stream);
+                            streams_.erase(stream);
+                            break;
+                        case JournalRecordType::kDone:
+                            get(rec, bulk_id);
+                            if( !bulks_.erase(bulk_id) )
+                                done_.insert(bulk_id);
+                            break;
+                        default:
+                            break;
+                    }
+                }
+
+                /// @brief Дописать в buf записи, по которым восстанавливается это же состояние
+                void serialize(std::string& buf) const
+                {
+                    // закрытые блоки потока - раньше его незакрытого: kBulk забирает накопленные к нему команды
+                    for(auto const& [bulk_id, bulk] : bulks_)
+                    {
+                        for(auto const& cmd : bulk.commands_)
+                            put_command(buf, bulk.stream_, cmd, false);
+                        const size_t at = begin_record(buf, JournalRecordType::kBulk);
+                        put(buf, bulk.stream_), put(buf, bulk_id), put(buf, bulk.created_at_), put(buf, bulk.created_at_us_);
+                        finish_record(buf, at);
+                    }
+                    for(auto const& [stream, s] : streams_)
+                        for(auto const& cmd : s.commands_)
+                            put_command(buf, stream, cmd, s.dynamic_);
+                    for(auto bulk_id : done_)
+                    {
+                        const size_t at = begin_record(buf, JournalRecordType::kDone);
+                        put(buf, bulk_id);
+                        finish_record(buf, at);
+                    }
+                }
+
+                static void put_command(std::string& buf, uint64_t stream, std::string_view cmd, bool dynamic)
+                {
+                    const size_t at = begin_record(buf, JournalRecordType::kCommand);
+                    put(buf, stream), put(buf, static_cast<uint8_t>(dynamic));
+                    buf.append(cmd);
+                    finish_record(buf, at);
+                }
+
+                std::map<uint64_t, ReplayStream>           streams_;
+                std::map<ICommandQueue::id_t, ReplayBulk>  bulks_;
+                std::set<ICommandQueue::id_t>              done_;
+                ICommandQueue::id_t                        max_id_{};
+            };
+
+            /// @brief Учесть в state все целые записи data, записанные самим журналом
+            void apply_records(JournalState& state, std::string_view data)
+            {
+                uint32_t size{}, crc{};
+                while( get(data, size) && get(data, crc) && data.size() >= size )
+                    state.apply(data.substr(0, size)), data.remove_prefix(size);
+            }
+
+            /// @brief  Прочитать очередную запись в rec. remaining - байт до конца файла: заголовок с размером больше 
+            ///         остатка - оборванная запись, а не повод выделять память под мусорный размер
+            /// @return false - конец файла; torn - запись оборвана или не сходится контрольная сумма
+            bool read_record(std::istream& is, uint64_t& remaining, std::string& rec, bool& torn)
+            {
+                char header[header_size];
+                if( !remaining )
+                    return false;
+                uint32_t size{}, crc{};
+                if( remaining < header_size || !is.read(header, header_size) )
+                    return torn = true, false;
+                std::memcpy(&size, header, sizeof(size));
+                std::memcpy(&crc, header + sizeof(size), sizeof(crc));
+                remaining -= header_size;
+                if( size > remaining )
+                    return torn = true, false;
+                rec.resize(size);
+                if( !is.read(rec.data(), size) || crc32(rec.data(), size) != crc )
+                    return torn = true, false;
+                remaining -= size;
+                return true;
+            }
+
+            /// @brief  Файл журнала с групповой фиксацией: записи копятся в pending_, первый ожидающий фиксации становится
+            ///         ведущим и пишет все накопленное одним write() (и fdatasync), остальные ждут своей отметки durable_.
+            ///         Ведущий ведет и состояние незавершенных блоков: когда с прошлой контрольной точки записано больше 
+            ///         checkpoint_bytes, журнал заменяется новым сегментом только из незавершенного - размер журнала и 
+            ///         время восстановления растут с числом незавершенных блоков, а не со всем принятым трафиком
+            class JournalFile
+            {
+            public:
+                JournalFile(std::string const& path, bool sync, size_t checkpoint_bytes)
+                    : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)), sync_(sync),
+                      appended_{}, durable_{}, leader_{}, path_(path), checkpoint_bytes_(checkpoint_bytes), segment_bytes_{}
+                {
+                    if( fd_ < 0 )
+                        throw std::system_error(errno, std::generic_category(), "journal open " + path);
+                    write_all(fd_, magic, sizeof(magic));
+                    ::fsync(fd_);
+                }
+
+                ~JournalFile()
+                {
+                    try
+                    {
+                        std::string none;
+                        commit(none);
+                        ::fsync(fd_);
+                    }
+                    catch(std::exception const&)
+                    {
+                    }
+                    ::close(fd_);
+                }
+
+                void append(std::string_view records)
+                {
+                    std::unique_lock lk(guard_mx_);
+                    pending_.append(records);
+                    appended_ += records.size();
+                }
+
+                /// @brief Добавить records и дождаться записи всего добавленного к этому моменту
+                void commit(std::string& records)
+                {
+                    std::unique_lock lk(guard_mx_);
+                    if( !records.empty() )
+                        pending_.append(records), appended_ += records.size(), records.clear();
+                    const uint64_t target = appended_;
+                    while( durable_ < target )
+                    {
+                        if( leader_ )
+                        {
+                            written_cv_.wait(lk);
+                            continue;
+                        }
+                        leader_ = true;
+                        writing_.swap(pending_);
+                        const uint64_t end = appended_;
+                        lk.unlock();
+                        try
+                        {
+                            write_all(fd_, writing_.data(), writing_.size());
+                            if( sync_ )
+                                ::fdatasync(fd_);
+                            apply_records(state_, writing_);
+                            segment_bytes_ += writing_.size();
+                            if( checkpoint_bytes_ && segment_bytes_ >= checkpoint_bytes_ )
+                                checkpoint();
+                        }
+                        catch(...)
+                        {
+                            lk.lock();
+                            leader_ = false;
+                            written_cv_.notify_all();
+                            throw;
+                        }
+                        metrics().journal_writes_.add();
+                        metrics().journal_bytes_.add(static_cast<int64_t>(writing_.size()));
+                        writing_.clear();
+                        lk.lock();
+                        durable_ = end;
+                        leader_ = false;
+                        written_cv_.notify_all();
+                    }
+                }
+
+            private:
+                /// @brief  Новый сегмент из незавершенного: пишется рядом, сбрасывается на диск и атомарно заменяет журнал.
+                ///         Только ведущим. При ошибке журнал продолжается в прежнем файле до следующей попытки
+                void checkpoint()
+                {
+                    std::string buf(magic, sizeof(magic));
+                    state_.serialize(buf);
+                    const std::string next = path_ + ".next";
+                    const int fd = ::open(next.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+                    bool ok = fd >= 0;
+                    try
+                    {
+                        if( ok )
+                            write_all(fd, buf.data(), buf.size());
+                    }
+                    catch(std::system_error const&)
+                    {
+                        ok = false;
+                    }
+                    ok = ok && ::fsync(fd) == 0 && ::rename(next.c_str(), path_.c_str()) == 0;
+                    if( !ok )
+                    {
+                        if( fd >= 0 )
+                            ::close(fd), ::unlink(next.c_str());
+                        segment_bytes_ = 0;
+                        return;
+                    }
+                    // новое имя в каталоге - на диск раньше, чем в новый сегмент пойдут записи
+                    const std::filesystem::path dir = std::filesystem::path(path_).parent_path();
+                    const int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if( dir_fd >= 0 )
+                        ::fsync(dir_fd), ::close(dir_fd);
+                    ::close(fd_);
+                    fd_ = fd;
+                    segment_bytes_ = 0;
+                    metrics().journal_checkpoints_.add();
+                }
+
+                int                     fd_;
+                bool                    sync_;
+                std::mutex              guard_mx_;
+                std::condition_variable written_cv_;
+                std::string             pending_;   ///< добавлено, но еще не записано
+                std::string             writing_;   ///< пишется ведущим; емкость переиспользуется
+                uint64_t                appended_;  ///< байт добавлено за все время
+                uint64_t                durable_;   ///< байт записано
+                bool                    leader_;    ///< кто-то из фиксирующих уже пишет
+                const std::string       path_;
+                const size_t            checkpoint_bytes_;  ///< 0 - без контрольных точек
+                size_t                  segment_bytes_;     ///< записано с прошлой контрольной точки (или попытки)
+                JournalState            state_;             ///< незавершенное, только у ведущего
+            };
+
+            /// @brief  Открытый журнал. Публикуется атомарно: писатели берут локальную копию, и файл, закрытый 
+            ///         journal_close() во время их записи, разрушается последним из них
+            std::shared_ptr<JournalFile> s_journal;
+            std::atomic<uint64_t>        s_stream_id{};
+
+            /// @brief Записи парсеров текущего потока выполнения до фиксации
+            thread_local std::string     tls_records;
+
+            /// @brief Вывести блок в файл тем же исполнителем, что и конвейер
+            void write_bulk(ICommandQueue::id_t bulk_id, ReplayBulk const& bulk)
+            {
+                CommandCreator creator;
+                CommandQueue q;
+                for(auto const& cmd : bulk.commands_)
+                    q.push(creator.create_command_decorator(creator.create_command(cmd, bulk_id, ICommand::CommandType::cmdSimple),
+                                                            q.empty() ? ICommand::CommandType::cmdFirst : ICommand::CommandType::cmdSimple));
+                q.push(creator.create_command_decorator(creator.create_command(command_data_t{}, bulk_id, ICommand::CommandType::cmdSimple), ICommand::CommandType::cmdLast));
+
+                ICommandContext ctx(q.size(), 0, std::cout, static_cast<time_t>(bulk.created_at_));
+                ctx.cmd_created_at_us_ = bulk.created_at_us_;
+                ctx.bulk_id_ = bulk_id;
+                QueueExecutorToFile executor(std::make_shared<QueueExecutor>());
+                executor.execute(q, ctx, q.size());
+            }
+
+            /// @brief Восстановление по журналу: записи читаются по одной, в памяти - только незавершенные блоки
+            JournalReplay replay(std::string const& path)
+            {
+                JournalReplay result{};
+                std::ifstream ifs(path, std::ios_base::binary | std::ios_base::ate);
+                if( !ifs )
+                    return result;
+                uint64_t remaining = static_cast<uint64_t>(ifs.tellg());
+                ifs.seekg(0);
+                char file_magic[sizeof(magic)];
+                if( remaining < sizeof(magic) || !ifs.read(file_magic, sizeof(magic)) || std::memcmp(file_magic, magic, sizeof(magic)) )
+                    throw std::runtime_error("not a bulk journal: " + path);
+                remaining -= sizeof(magic);
+
+                JournalState state;
+                std::string rec;
+                while( read_record(ifs, remaining, rec, result.torn_) )
+                {
+                    ++result.records_;
+                    state.apply(rec);
+                }
+
+                // оборванные потоки завершаются как при отключении: неполный статический блок выводится, динамический - нет
+                for(auto& [stream, s] : state.streams_)
+                    if( !s.dynamic_ && !s.commands_.empty() )
+                        state.bulks_[++state.max_id_] = ReplayBulk{stream, coarse_time(), 0, std::move(s.commands_)};
+                for(auto const& [bulk_id, bulk] : state.bulks_)
+                {
+                    if( bulk.commands_.empty() )
+                        continue;
+                    write_bulk(bulk_id, bulk);
+                    ++result.bulks_;
+                    result.commands_ += bulk.commands_.size();
+                }
+                return result;
+            }
+        }
+
+        void command(uint64_t stream, std::string_view cmd, bool dynamic)
+        {
+            // горячий путь - запись собирается одним resize вместо пяти дозаписей
+            std::string& buf = tls_records;
+            const size_t at = buf.size();
+            buf.resize(at + header_size + 2 + sizeof(stream) + cmd.size());
+            char* p = buf.data() + at + header_size;
+            *p++ = static_cast<char>(JournalRecordType::kCommand);
+            std::memcpy(p, &stream, sizeof(stream)), p += sizeof(stream);
+            *p++ = static_cast<char>(dynamic);
+            std::memcpy(p, cmd.data(), cmd.size());
+            finish_record(buf, at);
+        }
+
+        void bulk(uint64_t stream, ICommandQueue const& q)
+        {
+            std::string& buf = tls_records;
+            const size_t at = begin_record(buf, JournalRecordType::kBulk);
+            put(buf, stream);
+            put(buf, q.bulk_id_.load());
+            put(buf, static_cast<int64_t>(q.created_at_));
+            put(buf, q.created_at_us_);
+            finish_record(buf, at);
+        }
+
+        void discard(uint64_t stream)
+        {
+            std::string& buf = tls_records;
+            const size_t at = begin_record(buf, JournalRecordType::kDiscard);
+            put(buf, stream);
+            finish_record(buf, at);
+        }
+
+        void done(ICommandQueue::id_t bulk_id)
+        {
+            std::string rec;
+            const size_t at = begin_record(rec, JournalRecordType::kDone);
+            put(rec, bulk_id);
+            finish_record(rec, at);
+            if( std::shared_ptr<JournalFile> journal = std::atomic_load(&s_journal) )
+                journal->append(rec);
+        }
+
+        void commit()
+        {
+            if( tls_records.empty() )
+                return;
+            // журнал закрыт после проверки enabled - записи не должны попасть в следующий
+            if( std::shared_ptr<JournalFile> journal = std::atomic_load(&s_journal) )
+                journal->commit(tls_records);
+            else
+                tls_records.clear();
+        }
+    }
+
+    JournalReplay journal_open(std::string const& path, bool sync, size_t checkpoint_bytes)
+    {
+        journal_close();
+        JournalReplay result = journal_detail::replay(path);
+        // восстановленные файлы должны попасть на диск раньше, чем журнал, по которому они выведены, будет перезаписан
+        if( result.bulks_ )
+        {
+            int fd = ::open(".", O_RDONLY | O_DIRECTORY);
+            if( fd >= 0 )
+                ::syncfs(fd), ::close(fd);
+        }
+        std::atomic_store(&journal_detail::s_journal, std::make_shared<journal_detail::JournalFile>(path, sync, checkpoint_bytes));
+        journal_detail::enabled = true;
+        return result;
+    }
+
+    void journal_close()
+    {
+        journal_detail::enabled = false;
+        journal_detail::commit();
+        std::atomic_store(&journal_detail::s_journal, std::shared_ptr<journal_detail::JournalFile>{});
+    }
+
+    uint64_t journal_new_stream()
+    {
+        return ++journal_detail::s_stream_id;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "bulk.h"
+
+namespace otus_hw7{
+
+    /// @brief  Записи журнала упреждающей записи. Журнал ведется по разобранным командам: поток (stream) - один парсер,
+    ///         блок - команды потока после предыдущего kBulk/kDiscard. Запись: [u32 размер][u32 crc32][тип][данные],
+    ///         числа в порядке байт платформы
+    enum class JournalRecordType : uint8_t
+    {
+        kCommand = 1,   ///< команда принята в блок: поток, признак динамического блока, текст
+        kBulk,          ///< парсер закрыл блок из накопленных команд потока: поток, ИД блока, время создания
+        kDiscard,       ///< накопленные команды потока отброшены (динамический блок оборван отключением)
+        kDone           ///< блок записан в файл: ИД блока
+    };
+
+    /// @brief Порог контрольной точки журнала по умолчанию, байт
+    constexpr size_t journal_checkpoint_bytes = 64u << 20;
+
+    /// @brief Итог восстановления по журналу
+    struct JournalReplay
+    {
+        size_t records_;    ///< прочитано целых записей
+        size_t bulks_;      ///< блоков, не записанных до сбоя и выведенных в файлы при восстановлении
+        size_t commands_;   ///< команд в этих блоках
+        bool   torn_;       ///< журнал оборван на незаписанной до конца записи
+    };
+
+    namespace journal_detail{
+        extern std::atomic<bool> enabled;
+        void command(uint64_t stream, std::string_view cmd, bool dynamic);
+        void bulk(uint64_t stream, ICommandQueue const& q);
+        void discard(uint64_t stream);
+        void done(ICommandQueue::id_t bulk_id);
+        void commit();
+    }
+
+    /// @brief Ведется ли журнал - единственная проверка на горячем пути, когда он выключен
+    inline bool journal_enabled() { return journal_detail::enabled.load(std::memory_order_relaxed); }
+
+    /// @brief  Включить журнал в файле path. Сначала по прежнему журналу восстанавливаются блоки, которые не дошли до файлов:
+    ///         закрытые блоки без отметки kDone и неполные статические блоки оборванных потоков. После записи их файлов
+    ///         на диск журнал начинается заново. sync - fdatasync при каждой групповой фиксации, иначе только write():
+    ///         журнал переживает падение процесса, но не сбой питания. checkpoint_bytes - после стольких байт записей
+    ///         журнал заменяется сегментом только из незавершенных блоков, 0 - не заменяется до перезапуска
+    JournalReplay journal_open(std::string const& path, bool sync, size_t checkpoint_bytes = journal_checkpoint_bytes);
+    /// @brief Зафиксировать накопленное и закрыть журнал
+    void          journal_close();
+
+    /// @brief Номер нового потока команд для записей журнала
+    uint64_t      journal_new_stream();
+
+    /// @brief Записи копятся в буфере потока выполнения и попадают в журнал при journal_commit()
+    inline void journal_command(uint64_t stream, std::string_view cmd, bool dynamic)
+    {
+        if( journal_enabled() )
+            journal_detail::command(stream, cmd, dynamic);
+    }
+    inline void journal_bulk(uint64_t stream, ICommandQueue const& q)
+    {
+        if( journal_enabled() )
+            journal_detail::bulk(stream, q);
+    }
+    inline void journal_discard(uint64_t stream)
+    {
+        if( journal_enabled() )
+            journal_detail::discard(stream);
+    }
+
+    /// @brief Отметка записи блока в файл - сразу в общий буфер журнала, без ожидания фиксации:
+    ///        потерянная отметка означает лишь повторный вывод блока при восстановлении
+    inline void journal_done(ICommandQueue::id_t bulk_id)
+    {
+        if( journal_enabled() )
+            journal_detail::done(bulk_id);
+    }
+
+    /// @brief  Групповая фиксация: записи текущего потока выполнения добавляются в журнал, и вызов ждет, пока они
+    ///         не будут записаны. Пишет один из ожидающих - все, что накопилось к этому моменту, одним write()
+    inline void journal_commit()
+    {
+        if( journal_enabled() )
+            journal_detail::commit();
+    }
+}
@@ -0,0 +1,120 @@
+#include <iomanip>
+#include <string>
+#include "bulk_metrics.h"
+
+namespace otus_hw7{
+
+    size_t MetricCounter::thread_slot()
+    {
+        static std::atomic<size_t> next_slot{};
+        thread_local const size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % slot_count;
+        return slot;
+    }
+
+    int64_t MetricCounter::value() const
+    {
+        int64_t sum{};
+        for(auto const& slot : slots_)
+            sum += slot.value_.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    BulkMetrics& metrics()
+    {
+        static BulkMetrics instance;
+        return instance;
+    }
+
+    namespace{
+        void render_metric(std::ostream& os, const char* name, const char* type, const char* help, int64_t value)
+        {
+            os << "# HELP " << name << ' ' << help << '\n'
+               << "# TYPE " << name << ' ' << type << '\n'
+               << name << ' ' << value << '\n';
+        }
+
+        /// @brief Гистограмма в нс как summary в секундах; label - дополнительная метка вида stage="parse"
+        void render_summary(std::ostream& os, const char* name, std::string const& label, LatencyHistogram const& hist)
+        {
+            const std::string sep = label.empty() ? "" : ",";
+            for(double q : {0.5, 0.9, 0.99, 0.999})
+                os << name << '{' << label << sep << "quantile=\"" << q << "\"} " << double(hist.percentile(q * 100.0)) / 1e9 << '\n';
+            const std::string labels = label.empty() ? "" : "{" + label + "}";
+            os << name << "_sum" << labels << ' ' << double(hist.sum()) / 1e9 << '\n'
+               << name << "_count" << labels << ' ' << hist.count() << '\n';
+        }
+
+        struct StageRef
+        {
+            const char*             name_;
+            LatencyHistogram const& hist_;
+        };
+    }
+
+    void BulkMetrics::record_bulk_written(BulkTimeline const& timeline)
+    {
+        if( !timeline.dispatched_ns_ )
+            return;
+        const uint64_t now = metrics_now_ns();
+        (timeline.to_file_ ? stage_file_ns_ : stage_console_ns_).record(now > timeline.dispatched_ns_ ? now - timeline.dispatched_ns_ : 0);
+    }
+
+    void BulkMetrics::render_stages(std::ostream& os) const
+    {
+        const StageRef stages[] = {{"parse", stage_parse_ns_}, {"dispatch", stage_dispatch_ns_}, 
+                                   {"console", stage_console_ns_}, {"file", stage_file_ns_}};
+        const auto flags = os.flags();
+        const auto precision = os.precision();
+        os << std::fixed << std::setprecision(1)
+           << "bulk stages, us:      count        p50        p99       p999        max\n";
+        for(auto const& stage : stages)
+            os << "  " << std::left << std::setw(10) << stage.name_ << std::right
+               << std::setw(14) << stage.hist_.count() 
+               << std::setw(11) << double(stage.hist_.percentile(50.0)) / 1e3
+               << std::setw(11) << double(stage.hist_.percentile(99.0)) / 1e3
+               << std::setw(11) << double(stage.hist_.percentile(99.9)) / 1e3
+               << std::setw(11) << double(stage.hist_.max()) / 1e3 << '\n';
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+    void BulkMetrics::render(std::ostream& os) const
+    {
+        static constexpr const char* queue_types[queue_type_count] = {"input", "log", "file"};
+
+        render_metric(os, "bulk_connections_total", "counter", "Accepted connections", connections_total_.value());
+        render_metric(os, "bulk_connections_active", "gauge", "Open connections", connections_active_.value());
+        render_metric(os, "bulk_connections_idle_closed_total", "counter", "Connections closed by idle timeout", connections_idle_closed_.value());
+        render_metric(os, "bulk_bytes_received_total", "counter", "Bytes received from clients", bytes_received_.value());
+        render_metric(os, "bulk_commands_parsed_total", "counter", "Commands parsed", commands_parsed_.value());
+        os << "# HELP bulk_bulks_total Bulks emitted\n"
+           << "# TYPE bulk_bulks_total counter\n"
+           << "bulk_bulks_total{kind=\"static\"} " << bulks_static_.value() << '\n'
+           << "bulk_bulks_total{kind=\"dynamic\"} " << bulks_dynamic_.value() << '\n';
+        render_metric(os, "bulk_size_effective", "gauge", "Static bulk size chosen by adaptive sizing, 0 if fixed", 
+                      bulk_size_effective_.load(std::memory_order_relaxed));
+        render_metric(os, "bulk_journal_writes_total", "counter", "Group commits written to the journal", journal_writes_.value());
+        render_metric(os, "bulk_journal_bytes_total", "counter", "Bytes written to the journal", journal_bytes_.value());
+        render_metric(os, "bulk_journal_checkpoints_total", "counter", "Journal segments replaced by a checkpoint", journal_checkpoints_.value());
+        os << "# HELP bulk_queue_depth Commands waiting in thread-safe queues\n"
+           << "# TYPE bulk_queue_depth gauge\n";
+        for(size_t i = 0; i < queue_type_count; ++i)
+            os << "bulk_queue_depth{queue=\"" << queue_types[i] << "\"} " << queue_depth_[i].value() << '\n';
+        os << "# HELP bulk_queues Thread-safe queues alive\n"
+           << "# TYPE bulk_queues gauge\n";
+        for(size_t i = 0; i < queue_type_count; ++i)
+            os << "bulk_queues{queue=\"" << queue_types[i] << "\"} " << queue_count_[i].value() << '\n';
+
+        const auto precision = os.precision(9);
+        os << "# HELP bulk_file_write_seconds Time to write a bulk to its file\n"
+           << "# TYPE bulk_file_write_seconds summary\n";
+        render_summary(os, "bulk_file_write_seconds", {}, file_write_ns_);
+        os << "# HELP bulk_stage_seconds Bulk lifecycle stages: parse, dispatch, console and file write\n"
+           << "# TYPE bulk_stage_seconds summary\n";
+        const StageRef stages[] = {{"parse", stage_parse_ns_}, {"dispatch", stage_dispatch_ns_}, 
+                                   {"console", stage_console_ns_}, {"file", stage_file_ns_}};
+        for(auto const& stage : stages)
+            render_summary(os, "bulk_stage_seconds", std::string("stage=\"") + stage.name_ + "\"", stage.hist_);
+        os.precision(precision);
+    }
+}
\ No newline at end of file
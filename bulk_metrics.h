@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include "bulk.h"
+#include "latency_histogram.h"
+
+namespace otus_hw7{
+
+    /// @brief Счетчик с ячейкой на поток: запись - relaxed fetch_add в свою строку кэша без разделения с другими потоками,
+    ///        чтение суммирует ячейки. Отрицательные приращения позволяют использовать его как датчик текущего значения
+    class MetricCounter
+    {
+    public:
+        static constexpr size_t slot_count = 64;
+
+        void    add(int64_t n = 1) { slots_[thread_slot()].value_.fetch_add(n, std::memory_order_relaxed); }
+        void    sub(int64_t n = 1) { add(-n); }
+        int64_t value() const;
+
+    private:
+        struct alignas(64) Slot
+        {
+            std::atomic<int64_t> value_{};
+        };
+        static size_t thread_slot();
+        std::array<Slot, slot_count> slots_;
+    };
+
+    /// @brief Метрики обработки команд. Один экземпляр на процесс - metrics()
+    struct BulkMetrics
+    {
+        static constexpr size_t queue_type_count = 3;
+
+        MetricCounter    connections_total_;
+        MetricCounter    connections_active_;
+        MetricCounter    connections_idle_closed_;  ///< соединения, закрытые по тайм-ауту простоя
+        MetricCounter    bytes_received_;
+        MetricCounter    commands_parsed_;
+        MetricCounter    bulks_static_;
+        MetricCounter    bulks_dynamic_;
+        std::array<MetricCounter, queue_type_count> queue_depth_;  ///< команд в очередях, по ICommandQueue::Type
+        std::array<MetricCounter, queue_type_count> queue_count_;  ///< число очередей, по ICommandQueue::Type
+        LatencyHistogram file_write_ns_;                           ///< запись блока в файл, нс
+        std::atomic<int64_t> bulk_size_effective_{};               ///< последний выбранный адаптивный размер блока, 0 - размер фиксирован
+        MetricCounter    journal_writes_;       ///< групповых записей в журнал
+        MetricCounter    journal_bytes_;        ///< байт записано в журнал
+        MetricCounter    journal_checkpoints_;  ///< замен журнала сегментом из незавершенных блоков
+
+        /// @brief Этапы жизни блока (BulkTimeline), нс
+        LatencyHistogram stage_parse_ns_;       ///< получена первая команда -> блок собран парсером
+        LatencyHistogram stage_dispatch_ns_;    ///< блок собран -> передан исполнителям
+        LatencyHistogram stage_console_ns_;     ///< передан -> выведен в консоль
+        LatencyHistogram stage_file_ns_;        ///< передан -> записан в файл
+
+        /// @brief Учет вывода последней команды блока в консоль или файл
+        void record_bulk_written(BulkTimeline const& timeline);
+
+        /// @brief Вывод в текстовом формате Prometheus
+        void render(std::ostream& os) const;
+        /// @brief Таблица этапов для людей - при завершении работы
+        void render_stages(std::ostream& os) const;
+    };
+
+    BulkMetrics& metrics();
+
+    /// @brief Монотонное время в нс для замеров
+    inline uint64_t metrics_now_ns()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bulk_trace.h"
+
+namespace otus_hw7{
+    namespace trace_detail{
+        std::atomic<bool> enabled{false};
+
+        namespace{
+            uint64_t now_ticks()
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                return __rdtsc();
+#else
+                timespec ts{};
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+            }
+
+            uint64_t now_ns()
+            {
+                return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                std::chrono::steady_clock::now().time_since_epoch()).count());
+            }
+
+            /// @brief Кольцо записей одного потока. Пишет только владелец, читает trace_dump()
+            struct Ring
+            {
+                std::vector<TraceRecord> records_;
+                std::atomic<uint64_t>    head_{};   ///< всего записано
+                std::atomic<bool>        owned_{};
+                std::atomic<bool>        busy_{};   ///< владелец внутри write(), см. Registry::quiesce()
+            };
+
+            /// @brief Все кольца процесса. Кольцо завершившегося потока достается следующему новому потоку
+            struct Registry
+            {
+                std::mutex                          guard_mx_;
+                std::vector<std::unique_ptr<Ring>>  rings_;
+                size_t                              ring_events_ = 8192;
+                uint64_t                            base_ticks_{};
+                uint64_t                            base_ns_{};
+
+                static Registry& instance()
+                {
+                    static Registry registry;
+                    return registry;
+                }
+
+                Ring* acquire()
+                {
+                    std::unique_lock lk(guard_mx_);
+                    for(auto& ring : rings_)
+                    {
+                        bool owned = false;
+                        if( ring->owned_.compare_exchange_strong(owned, true, std::memory_order_acq_rel) )
+                        {
+                            if( ring->records_.size() != ring_events_ )
+                                ring->records_.assign(ring_events_, TraceRecord{}), ring->head_ = 0;
+                            return ring.get();
+                        }
+                    }
+                    rings_.emplace_back(std::make_unique<Ring>());
+                    rings_.back()->records_.resize(ring_events_);
+                    rings_.back()->owned_ = true;
+                    return rings_.back().get();
+                }
+
+                /// @brief Дождаться выхода всех писателей из write(). Вызывается под guard_mx_ после enabled = false:
+                ///        писатель, увидевший enabled до сброса, уже поднял busy_ (оба обращения - seq_cst)
+                void quiesce()
+                {
+                    for(auto const& ring : rings_)
+                        while( ring->busy_.load() )
+                            std::this_thread::yield();
+                }
+            };
+
+            struct RingHolder
+            {
+                Ring* ring_ = nullptr;
+                ~RingHolder()
+                {
+                    if( ring_ )
+                        ring_->owned_.store(false, std::memory_order_release);
+                }
+            };
+            thread_local RingHolder t_ring;
+            thread_local uint32_t   t_tid = 0;
+        }
+
+        void write(TraceEventId event, TracePhase phase, uint64_t arg0, uint64_t arg1)
+        {
+            Ring* ring = t_ring.ring_;
+            if( !ring )
+                ring = t_ring.ring_ = Registry::instance().acquire();
+            if( !t_tid )
+                t_tid = static_cast<uint32_t>(::syscall(SYS_gettid));
+
+            ring->busy_.store(true);
+            if( !enabled.load() )
+            {
+                ring->busy_.store(false, std::memory_order_release);
+                return;
+            }
+            const uint64_t head = ring->head_.load(std::memory_order_relaxed);
+            ring->records_[head % ring->records_.size()] = 
+                TraceRecord{now_ticks(), t_tid, static_cast<uint16_t>(event), static_cast<uint8_t>(phase), 0, arg0, arg1};
+            ring->head_.store(head + 1, std::memory_order_release);
+            ring->busy_.store(false, std::memory_order_release);
+        }
+    }
+
+    void trace_start(size_t ring_events)
+    {
+        using namespace trace_detail;
+        Registry& registry = Registry::instance();
+        std::unique_lock lk(registry.guard_mx_);
+        enabled = false;
+        registry.quiesce();
+        registry.ring_events_ = std::max<size_t>(ring_events, 16);
+        for(auto& ring : registry.rings_)
+            ring->head_ = 0;
+        registry.base_ticks_ = now_ticks();
+        registry.base_ns_ = now_ns();
+        enabled = true;
+    }
+
+    void trace_stop()
+    {
+        using namespace trace_detail;
+        Registry& registry = Registry::instance();
+        std::unique_lock lk(registry.guard_mx_);
+        enabled = false;
+        registry.quiesce();
+    }
+
+    size_t trace_dump(std::string const& path)
+    {
+        using namespace trace_detail;
+        Registry& registry = Registry::instance();
+        std::vector<TraceRecord> records;
+        TraceFileHeader header{};
+        {
+            std::unique_lock lk(registry.guard_mx_);
+            for(auto const& ring : registry.rings_)
+            {
+                const uint64_t head = ring->head_.load(std::memory_order_acquire);
+                const uint64_t size = ring->records_.size();
+                for(uint64_t i = head > size ? head - size : 0; i < head; ++i)
+                    records.push_back(ring->records_[i % size]);
+            }
+            const uint64_t elapsed_ns = now_ns() - registry.base_ns_;
+            const uint64_t elapsed_ticks = now_ticks() - registry.base_ticks_;
+            header.base_ticks_ = registry.base_ticks_;
+            header.ticks_per_us_ = elapsed_ns ? double(elapsed_ticks) * 1000.0 / double(elapsed_ns) : 1000.0;
+        }
+        std::sort(records.begin(), records.end(), [](TraceRecord const& a, TraceRecord const& b){ return a.ticks_ < b.ticks_; });
+
+        std::memcpy(header.magic_, "BTRC", 4);
+        header.version_ = 1;
+        header.record_size_ = sizeof(TraceRecord);
+        header.count_ = records.size();
+
+        std::ofstream ofs(path, std::ios_base::binary | std::ios_base::trunc);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(TraceRecord)));
+        if( !ofs )
+            throw std::runtime_error("trace_dump: can't write " + path);
+        return records.size();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace otus_hw7{
+
+    /// @brief События трассировки. Имена для декодера - trace_event_name()
+    enum class TraceEventId : uint16_t
+    {
+        kSessionRead,       ///< прочитаны данные сессии: a0 - байт
+        kParseBulk,         ///< парсер собрал блок: a0 - ИД блока, a1 - 1 для динамического блока
+        kDispatchBulk,      ///< Processor::exec_queue: a0 - ИД блока, a1 - размер блока
+        kExecuteQueue,      ///< QueueExecutor::execute: a0 - ИД блока, a1 - число команд
+        kFileWrite,         ///< запись блока в файл: a0 - ИД блока
+        kSteal,             ///< воркер планировщика забрал задачу чужого дека: a0 - свой слот, a1 - слот жертвы
+        kGrow,              ///< планировщик добавил воркер: a0 - воркеров стало
+        kShrink,            ///< планировщик убрал воркер: a0 - воркеров стало
+        kCount
+    };
+
+    inline const char* trace_event_name(uint16_t id)
+    {
+        static constexpr const char* names[] = {
+            "session_read", "parse_bulk", "dispatch_bulk", "execute_queue", "file_write", "steal", "grow", "shrink"
+        };
+        static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(TraceEventId::kCount));
+        return id < static_cast<uint16_t>(TraceEventId::kCount) ? names[id] : "unknown";
+    }
+
+    /// @brief Фаза события - как в Chrome trace: начало/конец интервала или мгновенное событие
+    enum class TracePhase : uint8_t
+    {
+        kBegin,
+        kEnd,
+        kInstant
+    };
+
+    /// @brief Запись трассы фиксированного размера
+    struct TraceRecord
+    {
+        uint64_t ticks_;    ///< rdtsc на x86-64, иначе нс CLOCK_MONOTONIC
+        uint32_t tid_;
+        uint16_t event_;
+        uint8_t  phase_;
+        uint8_t  reserved_;
+        uint64_t arg0_;
+        uint64_t arg1_;
+    };
+    static_assert(sizeof(TraceRecord) == 32);
+
+    /// @brief Заголовок файла трассы, за ним count_ записей TraceRecord
+    struct TraceFileHeader
+    {
+        char     magic_[4];     ///< "BTRC"
+        uint32_t version_;
+        uint32_t record_size_;
+        uint32_t reserved_;
+        uint64_t count_;
+        uint64_t base_ticks_;   ///< отметка trace_start()
+        double   ticks_per_us_;
+    };
+
+    namespace trace_detail{
+        extern std::atomic<bool> enabled;
+        void write(TraceEventId event, TracePhase phase, uint64_t arg0, uint64_t arg1);
+    }
+
+    /// @brief Включена ли трассировка - единственная проверка на горячем пути, когда она выключена
+    inline bool trace_enabled() { return trace_detail::enabled.load(std::memory_order_relaxed); }
+
+    /// @brief Включить трассировку, предыдущие записи сбрасываются. ring_events - емкость кольца потоков, еще не писавших в трассу
+    void   trace_start(size_t ring_events = 8192);
+    /// @brief Выключить трассировку и дождаться, пока все потоки допишут начатые записи
+    void   trace_stop();
+    /// @brief Выгрузить кольца всех потоков в файл. Согласованный снимок - после trace_stop(). Возвращает число записей
+    size_t trace_dump(std::string const& path);
+
+    inline void trace(TraceEventId event, TracePhase phase, uint64_t arg0 = 0, uint64_t arg1 = 0)
+    {
+        if( trace_enabled() )
+            trace_detail::write(event, phase, arg0, arg1);
+    }
+
+    /// @brief Интервал трассы на время жизни объекта
+    class TraceScope
+    {
+    public:
+        TraceScope(TraceEventId event, uint64_t arg0 = 0, uint64_t arg1 = 0) : event_(event), active_(trace_enabled())
+        {
+            if( active_ )
+                trace_detail::write(event_, TracePhase::kBegin, arg0, arg1);
+        }
+        ~TraceScope()
+        {
+            if( active_ )
+                trace_detail::write(event_, TracePhase::kEnd, 0, 0);
+        }
+        TraceScope(TraceScope const&) = delete;
+        TraceScope& operator=(TraceScope const&) = delete;
+
+    private:
+        TraceEventId event_;
+        bool         active_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "bulk_trace.h"
+
+/// @brief Декодер трассы: файл trace_dump() -> JSON формата Chrome trace (chrome://tracing, Perfetto)
+int main(int argc, char const* argv[]) 
+{
+	using namespace otus_hw7;
+	if( argc < 2 )
+	{
+		std::cerr << "Вызов: bulk_trace_decode <trace.bin> [trace.json]" << std::endl;
+		return 1;
+	}
+
+	std::ifstream ifs(argv[1], std::ios_base::binary);
+	TraceFileHeader header{};
+	if( !ifs.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic_, "BTRC", 4) 
+	    || header.record_size_ != sizeof(TraceRecord) )
+	{
+		std::cerr << "not a bulk trace: " << argv[1] << std::endl;
+		return 1;
+	}
+	std::vector<TraceRecord> records(header.count_);
+	if( !ifs.read(reinterpret_cast<char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(TraceRecord))) )
+	{
+		std::cerr << "truncated trace: " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::ofstream ofs;
+	if( argc > 2 )
+		ofs.open(argv[2]);
+	std::ostream& os = argc > 2 ? ofs : std::cout;
+
+	static constexpr const char* phases[] = {"B", "E", "i"};
+	os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	os.precision(3);
+	os << std::fixed;
+	for(size_t i = 0; i < records.size(); ++i)
+	{
+		TraceRecord const& r = records[i];
+		const double ts_us = double(r.ticks_ - std::min(r.ticks_, header.base_ticks_)) / header.ticks_per_us_;
+		os << (i ? ",\n" : "\n")
+		   << "{\"name\":\"" << trace_event_name(r.event_) << "\",\"ph\":\"" << phases[std::min<uint8_t>(r.phase_, 2)] 
+		   << "\",\"ts\":" << ts_us << ",\"pid\":1,\"tid\":" << r.tid_;
+		if( r.phase_ == static_cast<uint8_t>(TracePhase::kInstant) )
+			os << ",\"s\":\"t\"";
+		if( r.phase_ != static_cast<uint8_t>(TracePhase::kEnd) )
+			os << ",\"args\":{\"a0\":" << r.arg0_ << ",\"a1\":" << r.arg1_ << "}";
+		os << "}";
+	}
+	os << "\n]}" << std::endl;
+	return 0;
+}
\ No newline at end of file
@@ -11,6 +11,9 @@ namespace otus_hw7{
     namespace {
         constexpr const char* const OPTION_NAME_HELP = "help"; 
         constexpr const char* const OPTION_NAME_CHUNK_SIZE = "chunk_size"; 
+        constexpr const char* const OPTION_NAME_TIMESTAMP_US = "timestamp_us"; 
+        constexpr const char* const OPTION_NAME_CHUNK_MIN = "chunk_min"; 
+        constexpr const char* const OPTION_NAME_CHUNK_MAX = "chunk_max"; 
     };
     Options& Options::add_options(po::options_description& desc)
     {
@@ -18,9 +21,18 @@ namespace otus_hw7{
                           { 
                             if( sz < 1 ) throw po::invalid_option_value(OPTION_NAME_CHUNK_SIZE); 
                           };
+        auto check_min = [](const size_t& sz) 
+                          { 
+                            if( sz < 1 ) throw po::invalid_option_value(OPTION_NAME_CHUNK_MIN); 
+                          };
         desc.add_options()
             (OPTION_NAME_HELP, po::bool_switch(&show_help), "Отображение справки")
-            (OPTION_NAME_CHUNK_SIZE, po::value<size_t>(&cmd_chunk_sz)->notifier(check_size), "Размер блока команд");
+            (OPTION_NAME_CHUNK_SIZE, po::value<size_t>(&cmd_chunk_sz)->notifier(check_size), "Размер блока команд")
+            (OPTION_NAME_TIMESTAMP_US, po::bool_switch(&timestamp_us), "Метки блоков и имена файлов с точностью до микросекунды")
+            (OPTION_NAME_CHUNK_MIN, po::value<size_t>(&cmd_chunk_min)->notifier(check_min), "Нижняя граница адаптивного размера блока")
+            (OPTION_NAME_CHUNK_MAX, po::value<size_t>(&cmd_chunk_max), 
+                "Верхняя граница адаптивного размера блока: размер меняется от chunk_min до chunk_max по скорости потока команд "
+                "и очереди файловых воркеров, начиная с chunk_size. 0 - размер фиксирован");
 
         return *this;
     }
@@ -12,8 +12,12 @@ namespace otus_hw7{
         bool      show_help;
         size_t    cmd_chunk_sz;
         istream*  is_;
-        Options() : show_help(false), cmd_chunk_sz(3), is_(nullptr) {}
-        Options(size_t cmd_bulk_sz, istream* istrm = nullptr) : show_help(false), cmd_chunk_sz(cmd_bulk_sz), is_(istrm) {}
+        bool      timestamp_us;     ///< метки блоков и имена файлов с точностью до микросекунды
+        size_t    cmd_chunk_min;    ///< нижняя граница адаптивного размера блока
+        size_t    cmd_chunk_max;    ///< верхняя граница адаптивного размера блока, 0 - размер фиксирован (cmd_chunk_sz)
+        Options() : show_help(false), cmd_chunk_sz(3), is_(nullptr), timestamp_us(false), cmd_chunk_min(1), cmd_chunk_max(0) {}
+        Options(size_t cmd_bulk_sz, istream* istrm = nullptr) 
+            : show_help(false), cmd_chunk_sz(cmd_bulk_sz), is_(istrm), timestamp_us(false), cmd_chunk_min(1), cmd_chunk_max(0) {}
         virtual bool parse_command_line(int argc, const char* argv[]);
         virtual Options& add_options(otus_hw7::po::options_description& desc);
         virtual Options& add_positional(otus_hw7::po::positional_options_description& pos_desc);
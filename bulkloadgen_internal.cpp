@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <boost/asio.hpp>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "bulkloadgen_internal.h"
+
+namespace otus_hw10{
+    namespace ba = boost::asio;
+    using ba::ip::tcp;
+
+    std::string make_token(size_t conn, size_t seq)
+    {
+        return "c" + std::to_string(conn) + "." + std::to_string(seq);
+    }
+
+    bool parse_token(std::string_view token, size_t& conn, size_t& seq)
+    {
+        if( token.size() < 4 || token.front() != 'c' )
+            return false;
+        const char* first = token.data() + 1;
+        const char* last = token.data() + token.size();
+        auto [p, ec] = std::from_chars(first, last, conn);
+        if( ec != std::errc{} || p == last || *p != '.' )
+            return false;
+        auto [q, ec2] = std::from_chars(p + 1, last, seq);
+        return ec2 == std::errc{} && q == last;
+    }
+
+    SentRegistry::SentRegistry(size_t connections, size_t max_per_conn)
+        : connections_(connections), max_per_conn_(max_per_conn), 
+          sent_at_(new std::atomic<int64_t>[connections * max_per_conn]())
+    {
+    }
+
+    bool SentRegistry::mark_sent(size_t conn, size_t seq, int64_t t_ns)
+    {
+        if( conn >= connections_ || seq >= max_per_conn_ )
+            return false;
+        sent_at_[conn * max_per_conn_ + seq].store(t_ns, std::memory_order_release);
+        return true;
+    }
+
+    bool SentRegistry::take(size_t conn, size_t seq, int64_t& t_ns)
+    {
+        if( conn >= connections_ || seq >= max_per_conn_ )
+            return false;
+        t_ns = sent_at_[conn * max_per_conn_ + seq].exchange(0, std::memory_order_acq_rel);
+        return t_ns != 0;
+    }
+
+    void LoadStats::print(std::ostream& os) const
+    {
+        const double send_s = double(send_finished_ns_ - send_started_ns_) / 1e9;
+        const double recv_s = double(std::max(last_received_ns_, send_finished_ns_) - send_started_ns_) / 1e9;
+        const uint64_t sent = sent_cmds_, received = received_cmds_;
+        auto us = [](uint64_t ns){ return double(ns) / 1e3; };
+        os << std::fixed << std::setprecision(1)
+           << "sent:       " << sent << " commands, " << sent_static_ << " static, " << sent_dynamic_ << " dynamic blocks"
+           << " in " << send_s << " s, " << (send_s > 0 ? double(sent) / send_s : 0.0) << " cmd/s\n"
+           << "received:   " << received << " commands in " << received_bulks_ << " bulks, lost " << (sent - std::min(sent, received))
+           << ", foreign " << foreign_cmds_ << ", " << (recv_s > 0 ? double(received) / recv_s : 0.0) << " cmd/s\n";
+        if( failed_connections_ )
+            os << "failed:     " << failed_connections_ << " connections\n";
+        os << "latency us: p50 " << us(latency_ns_.percentile(50.0)) 
+           << " p99 " << us(latency_ns_.percentile(99.0))
+           << " p999 " << us(latency_ns_.percentile(99.9)) 
+           << " max " << us(latency_ns_.max()) 
+           << " mean " << us(static_cast<uint64_t>(latency_ns_.mean())) << "\n"
+           << "send lag us: p50 " << us(send_lag_ns_.percentile(50.0)) 
+           << " p99 " << us(send_lag_ns_.percentile(99.0)) 
+           << " max " << us(send_lag_ns_.max()) << std::endl;
+    }
+
+    namespace{
+        /// @brief Поток отправки: соединения first, first + step, ... ; команды идут по соединениям по кругу
+        void send_worker(size_t first, size_t step, LoadgenOptions const& options, SentRegistry& registry, LoadStats& stats)
+        {
+            struct Connection
+            {
+                size_t      id_;
+                tcp::socket socket_;
+                size_t      seq_;
+            };
+
+            ba::io_context io;
+            std::vector<Connection> conns;
+            tcp::resolver resolver(io);
+            const auto endpoints = resolver.resolve(options.host, std::to_string(options.port));
+            for(size_t id = first; id < options.connections; id += step)
+            {
+                tcp::socket socket(io);
+                boost::system::error_code ec;
+                ba::connect(socket, endpoints, ec);
+                if( ec )
+                    ++stats.failed_connections_;
+                else
+                {
+                    socket.set_option(tcp::no_delay(true));
+                    conns.push_back(Connection{id, std::move(socket), 0});
+                }
+            }
+            if( conns.empty() )
+                return;
+
+            using clock_t = std::chrono::steady_clock;
+            const double thread_rate = options.rate * double(conns.size()) / double(options.connections);
+            const auto start = clock_t::now();
+            const auto deadline = start + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(options.duration));
+            std::minstd_rand rng(static_cast<unsigned>(first + 1));
+            std::bernoulli_distribution is_dynamic(options.dynamic_ratio);
+            std::string msg;
+            double due_s = 0.0;
+            for(size_t rr = 0; !conns.empty(); ++rr)
+            {
+                const auto due = start + std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(due_s));
+                if( due >= deadline )
+                    break;
+                std::this_thread::sleep_until(due);
+
+                Connection& c = conns[rr % conns.size()];
+                const bool dyn = is_dynamic(rng);
+                const size_t n = dyn ? options.dynamic_size : 1;
+                if( c.seq_ + n > registry.capacity() )
+                    break;
+
+                msg.clear();
+                if( dyn ) msg += "{\n";
+                for(size_t k = 0; k < n; ++k)
+                    msg += make_token(c.id_, c.seq_ + k), msg += '\n';
+                if( dyn ) msg += "}\n";
+
+                // отсчет от расписания: часы те же, что у loadgen_now_ns()
+                const int64_t due_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(due.time_since_epoch()).count();
+                for(size_t k = 0; k < n; ++k)
+                    registry.mark_sent(c.id_, c.seq_ + k, due_ns);
+                boost::system::error_code ec;
+                ba::write(c.socket_, ba::buffer(msg), ec);
+                stats.send_lag_ns_.record(static_cast<uint64_t>(std::max<int64_t>(loadgen_now_ns() - due_ns, 0)));
+                if( ec )
+                {
+                    ++stats.failed_connections_;
+                    conns.erase(conns.begin() + static_cast<std::ptrdiff_t>(rr % conns.size()));
+                    continue;
+                }
+                c.seq_ += n;
+                stats.sent_cmds_ += n;
+                ++(dyn ? stats.sent_dynamic_ : stats.sent_static_);
+                due_s += double(n) / thread_rate;
+            }
+            // закрытие соединений завершает неполные статические блоки на сервере
+            for(auto& c : conns)
+            {
+                boost::system::error_code ec;
+                c.socket_.shutdown(tcp::socket::shutdown_both, ec);
+                c.socket_.close(ec);
+            }
+        }
+    }
+
+    void run_senders(LoadgenOptions const& options, SentRegistry& registry, LoadStats& stats)
+    {
+        size_t threads = options.threads ? options.threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        threads = std::min(threads, options.connections);
+
+        stats.send_started_ns_ = loadgen_now_ns();
+        std::vector<std::thread> workers;
+        for(size_t t = 0; t < threads; ++t)
+            workers.emplace_back(send_worker, t, threads, std::cref(options), std::ref(registry), std::ref(stats));
+        for(auto& w : workers)
+            w.join();
+        stats.send_finished_ns_ = loadgen_now_ns();
+    }
+
+    void BulkObserver::on_line(std::string_view line, int64_t now_ns)
+    {
+        constexpr std::string_view prefix = "bulk: ";
+        if( line.substr(0, prefix.size()) != prefix )
+            return;
+        line.remove_prefix(prefix.size());
+        ++stats_.received_bulks_;
+        while( !line.empty() )
+        {
+            size_t pos = line.find(", ");
+            std::string_view token = line.substr(0, pos);
+            line.remove_prefix(pos == std::string_view::npos ? line.size() : pos + 2);
+
+            size_t conn{}, seq{};
+            int64_t sent_ns{};
+            if( parse_token(token, conn, seq) && registry_.take(conn, seq, sent_ns) )
+            {
+                stats_.latency_ns_.record(static_cast<uint64_t>(std::max<int64_t>(now_ns - sent_ns, 0)));
+                ++stats_.received_cmds_;
+            }
+            else
+                ++stats_.foreign_cmds_;
+        }
+        stats_.last_received_ns_ = now_ns;
+    }
+
+    void BulkObserver::run_stream(int fd, std::atomic<bool> const& stop)
+    {
+        std::string pending;
+        char buf[64 * 1024];
+        // после stop дочитывается то, что уже пришло
+        for(bool stopping = false; ; )
+        {
+            stopping = stop;
+            pollfd pfd{fd, POLLIN, 0};
+            if( ::poll(&pfd, 1, stopping ? 0 : 20) <= 0 )
+            {
+                if( stopping ) break;
+                continue;
+            }
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if( n <= 0 )
+                break;
+            const int64_t now = loadgen_now_ns();
+            pending.append(buf, static_cast<size_t>(n));
+            size_t start = 0;
+            for(size_t eol; (eol = pending.find('\n', start)) != std::string::npos; start = eol + 1)
+                on_line(std::string_view(pending).substr(start, eol - start), now);
+            pending.erase(0, start);
+        }
+    }
+
+    void BulkObserver::run_dir(std::string const& dir, std::atomic<bool> const& stop)
+    {
+#ifdef __linux__
+        int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if( fd < 0 )
+            throw std::system_error(errno, std::generic_category(), "inotify_init1");
+        if( ::inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY) < 0 )
+        {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), "inotify_add_watch " + dir);
+        }
+
+        alignas(inotify_event) char buf[64 * 1024];
+        std::string content;
+        // после stop дочитываются уже пришедшие события
+        for(bool stopping = false; ; )
+        {
+            stopping = stop;
+            pollfd pfd{fd, POLLIN, 0};
+            if( ::poll(&pfd, 1, stopping ? 0 : 20) <= 0 )
+            {
+                if( stopping ) break;
+                continue;
+            }
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if( n <= 0 )
+                continue;
+            const int64_t now = loadgen_now_ns();
+            for(ssize_t off = 0; off < n; )
+            {
+                const auto* ev = reinterpret_cast<const inotify_event*>(buf + off);
+                off += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
+                if( !ev->len )
+                    continue;
+                std::string name(ev->name);
+                if( name.size() < 4 || name.compare(name.size() - 4, 4, ".log") || seen_files_.count(name) )
+                    continue;
+                
+                std::ifstream ifs(dir + "/" + name);
+                content.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+                // блок записан целиком, когда файл заканчивается переводом строки
+                if( content.empty() || content.back() != '\n' )
+                    continue;
+                seen_files_.insert(name);
+                size_t start = 0;
+                for(size_t eol; (eol = content.find('\n', start)) != std::string::npos; start = eol + 1)
+                    on_line(std::string_view(content).substr(start, eol - start), now);
+            }
+        }
+        ::close(fd);
+#else
+        (void)dir, (void)stop;
+        throw std::runtime_error("watching a directory requires inotify (Linux)");
+#endif
+    }
+}
\ No newline at end of file
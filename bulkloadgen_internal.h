@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#include "latency_histogram.h"
+#include "bulkloadgen_utils.h"
+
+namespace otus_hw10{
+
+    /// @brief Текущее время генератора в нс, по монотонным часам
+    inline int64_t loadgen_now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// @brief Команда генератора - уникальная метка c<соединение>.<номер>
+    std::string make_token(size_t conn, size_t seq);
+    bool        parse_token(std::string_view token, size_t& conn, size_t& seq);
+
+    /// @brief  Время отправки каждой команды по расписанию, а не фактическое: задержка отстающего от расписания 
+    ///         отправителя входит в задержку команды (без coordinated omission). Пишут потоки отправки, 
+    ///         забирает наблюдатель - по одному разу на команду
+    class SentRegistry
+    {
+    public:
+        SentRegistry(size_t connections, size_t max_per_conn);
+
+        size_t capacity() const { return max_per_conn_; }
+        bool   mark_sent(size_t conn, size_t seq, int64_t t_ns);
+        /// @brief Забрать время отправки команды, false - команда неизвестна или уже учтена
+        bool   take(size_t conn, size_t seq, int64_t& t_ns);
+
+    private:
+        size_t                              connections_;
+        size_t                              max_per_conn_;
+        std::unique_ptr<std::atomic<int64_t>[]> sent_at_;
+    };
+
+    /// @brief Счетчики прогона
+    struct LoadStats
+    {
+        otus_hw7::LatencyHistogram  latency_ns_;        ///< от времени по расписанию до появления команды в выводе
+        otus_hw7::LatencyHistogram  send_lag_ns_;       ///< отставание отправки от расписания, включая ba::write
+        std::atomic<uint64_t>       sent_cmds_{};
+        std::atomic<uint64_t>       sent_static_{};
+        std::atomic<uint64_t>       sent_dynamic_{};
+        std::atomic<uint64_t>       received_cmds_{};
+        std::atomic<uint64_t>       received_bulks_{};
+        std::atomic<uint64_t>       foreign_cmds_{};    ///< чужие или повторные команды в выводе сервера
+        std::atomic<size_t>         failed_connections_{};
+        int64_t                     send_started_ns_{};
+        int64_t                     send_finished_ns_{};
+        int64_t                     last_received_ns_{};
+
+        void print(std::ostream& os) const;
+    };
+
+    /// @brief Потоки отправки: открывают соединения и с заданной скоростью шлют в них статические команды и блоки {}
+    void run_senders(LoadgenOptions const& options, SentRegistry& registry, LoadStats& stats);
+
+    /// @brief Наблюдатель вывода сервера: строки "bulk: ..." со стандартного ввода или файлы блоков в каталоге
+    class BulkObserver
+    {
+    public:
+        BulkObserver(SentRegistry& registry, LoadStats& stats) : registry_(registry), stats_(stats) {}
+
+        /// @brief Чтение строк из дескриптора до stop
+        void run_stream(int fd, std::atomic<bool> const& stop);
+        /// @brief Слежение за новыми файлами *.log в каталоге через inotify до stop
+        void run_dir(std::string const& dir, std::atomic<bool> const& stop);
+
+        /// @brief Учет одной строки блока, полученной в момент now_ns
+        void on_line(std::string_view line, int64_t now_ns);
+
+    private:
+        SentRegistry&                    registry_;
+        LoadStats&                       stats_;
+        std::unordered_set<std::string>  seen_files_;
+    };
+}
\ No newline at end of file
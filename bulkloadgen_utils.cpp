@@ -0,0 +1,102 @@
+#include <iostream>
+#include "bulkloadgen_utils.h"
+
+namespace otus_hw10{
+
+    namespace{
+        constexpr const char* const OPTION_NAME_HELP = "help"; 
+        constexpr const char* const OPTION_NAME_HOST = "host";
+        constexpr const char* const OPTION_NAME_PORT = "port";
+        constexpr const char* const OPTION_NAME_CONNECTIONS = "connections";
+        constexpr const char* const OPTION_NAME_THREADS = "threads";
+        constexpr const char* const OPTION_NAME_RATE = "rate";
+        constexpr const char* const OPTION_NAME_DURATION = "duration";
+        constexpr const char* const OPTION_NAME_DYNAMIC_RATIO = "dynamic_ratio";
+        constexpr const char* const OPTION_NAME_DYNAMIC_SIZE = "dynamic_size";
+        constexpr const char* const OPTION_NAME_WATCH_DIR = "watch_dir";
+        constexpr const char* const OPTION_NAME_GRACE = "grace";
+    }
+
+    LoadgenOptions& LoadgenOptions::add_caption_lines(std::string& caption)
+    {
+        BaseCls_t::add_caption_lines(caption);
+        caption += "\nВызов: bulk_loadgen <port> [--watch_dir <каталог сервера>]"
+                   "\n   или: bulk_server <port> <chunk_size> | bulk_loadgen <port>";
+        return *this;
+    }
+
+    LoadgenOptions::BaseCls_t& LoadgenOptions::add_options(otus_hw7::po::options_description& desc)
+    {
+        auto check_port = [](const uint16_t& port) 
+                          { 
+                            if( port < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_PORT); 
+                          };
+        auto check_connections = [](const size_t& cnt) 
+                          { 
+                            if( cnt < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_CONNECTIONS); 
+                          };
+        auto check_rate = [](const double& rate) 
+                          { 
+                            if( !(rate > 0.0) ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_RATE); 
+                          };
+        auto check_duration = [](const double& d) 
+                          { 
+                            if( !(d > 0.0) ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_DURATION); 
+                          };
+        auto check_ratio = [](const double& r) 
+                          { 
+                            if( r < 0.0 || r > 1.0 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_DYNAMIC_RATIO); 
+                          };
+        auto check_dyn_size = [](const size_t& sz) 
+                          { 
+                            if( sz < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_DYNAMIC_SIZE); 
+                          };
+        auto check_grace = [](const double& g) 
+                          { 
+                            if( g < 0.0 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_GRACE); 
+                          };
+        desc.add_options()
+            (OPTION_NAME_HELP, otus_hw7::po::bool_switch(&show_help), "Отображение справки")
+            (OPTION_NAME_HOST, otus_hw7::po::value<std::string>(&host), "Адрес сервера")
+            (OPTION_NAME_PORT, otus_hw7::po::value<uint16_t>(&port)->notifier(check_port), "Номер порта сервера")
+            (OPTION_NAME_CONNECTIONS, otus_hw7::po::value<size_t>(&connections)->notifier(check_connections), "Число одновременных соединений")
+            (OPTION_NAME_THREADS, otus_hw7::po::value<size_t>(&threads), "Число потоков отправки, 0 - по числу процессоров")
+            (OPTION_NAME_RATE, otus_hw7::po::value<double>(&rate)->notifier(check_rate), "Целевая скорость отправки, команд в секунду")
+            (OPTION_NAME_DURATION, otus_hw7::po::value<double>(&duration)->notifier(check_duration), "Длительность отправки, с")
+            (OPTION_NAME_DYNAMIC_RATIO, otus_hw7::po::value<double>(&dynamic_ratio)->notifier(check_ratio), "Доля динамических блоков {} среди отправок, 0..1")
+            (OPTION_NAME_DYNAMIC_SIZE, otus_hw7::po::value<size_t>(&dynamic_size)->notifier(check_dyn_size), "Число команд в динамическом блоке")
+            (OPTION_NAME_WATCH_DIR, otus_hw7::po::value<std::string>(&watch_dir), 
+                "Каталог, в который сервер пишет файлы блоков. Без него строки блоков читаются со стандартного ввода")
+            (OPTION_NAME_GRACE, otus_hw7::po::value<double>(&grace)->notifier(check_grace), "Ожидание последних блоков после отправки, с");
+        return *this;
+    }
+    
+    LoadgenOptions& LoadgenOptions::add_positional(otus_hw7::po::positional_options_description& pos_desc)
+    {
+        pos_desc.add(OPTION_NAME_PORT, 1); 
+        return *this;                        
+    }   
+
+    bool LoadgenOptions::parse_command_line(int argc, const char* argv[])
+    {
+        *this = LoadgenOptions();
+
+        std::string caption;
+        add_caption_lines( caption );
+        otus_hw7::po::options_description desc(caption);
+        otus_hw7::po::positional_options_description pos_desc;
+        add_options(desc).add_positional(pos_desc);
+
+        otus_hw7::po::variables_map vm;
+        otus_hw7::po::store(otus_hw7::po::command_line_parser(argc, argv).options(desc).positional(pos_desc).run(), vm);
+        otus_hw7::po::notify(vm);
+
+        bool not_need_exit = true;
+        if( !vm.count(OPTION_NAME_PORT) )
+            show_help = true;
+        if( show_help )
+            std::cout << desc << std::endl,
+            not_need_exit = false;
+        return not_need_exit;
+    }
+};
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include "bulk_utils.h"
+
+namespace otus_hw10{
+    /// @brief Настройки генератора нагрузки bulk_loadgen
+    struct LoadgenOptions : public otus_hw7::Options
+    {
+        using BaseCls_t = otus_hw7::Options;
+        std::string host;
+        uint16_t    port;
+        size_t      connections;    ///< число одновременных соединений
+        size_t      threads;        ///< число потоков отправки, 0 - по числу процессоров
+        double      rate;           ///< целевая скорость, команд в секунду на все соединения
+        double      duration;       ///< длительность отправки, с
+        double      dynamic_ratio;  ///< доля динамических блоков {} среди отправок
+        size_t      dynamic_size;   ///< число команд в динамическом блоке
+        std::string watch_dir;      ///< каталог с файлами блоков, пусто - строки "bulk: ..." читаются со стандартного ввода
+        double      grace;          ///< ожидание последних блоков после отправки, с
+
+        LoadgenOptions() 
+            : host("127.0.0.1"), port(9000), connections(10), threads(0), rate(1000.0), duration(5.0), 
+              dynamic_ratio(0.1), dynamic_size(5), grace(2.0) {}
+        virtual bool parse_command_line(int argc, const char* argv[]) override;
+        virtual BaseCls_t& add_options(otus_hw7::po::options_description& desc) override;
+        virtual LoadgenOptions& add_positional(otus_hw7::po::positional_options_description& pos_desc) override;
+        virtual LoadgenOptions& add_caption_lines( std::string& caption) override;
+    };
+};
\ No newline at end of file
@@ -1,7 +1,31 @@
+#pragma once
+
 #include <iostream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/asio.hpp>
+#ifdef USE_ASIO_COROUTINES
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#endif
 
 #include "async.h"
+#include "async_affinity.h"
+#include "bulk_metrics.h"
+#include "bulk_trace.h"
+#include "bulkserver_utils.h"
+#include "timer_wheel.h"
 
 namespace otus_hw10{
     namespace ba = boost::asio;
@@ -10,24 +34,353 @@ namespace otus_hw10{
     using std::istream;
     using std::ostream;
 
-    /// @brief  Класс сессии приема и обработки команд. Для обработки устанавливает соединение с libasync и работает через него.
+    /// @brief Число открытых сессий
+    inline std::atomic<size_t> s_live_sessions{};
+
+    class session_registry;
+
+    /// @brief Учет открытой сессии на время жизни объекта. В кадре сопрограммы снимается и тогда, когда 
+    ///        незавершенный кадр разрушается вместе с io_context при остановке сервера.
+    ///        С реестром отметка - узел списка его открытых соединений
+    class live_session_mark
+    {
+    public:
+        explicit live_session_mark(std::shared_ptr<session_registry> registry = {}, tcp::socket* socket = nullptr);
+        ~live_session_mark();
+        live_session_mark(live_session_mark const&) = delete;
+        live_session_mark& operator=(live_session_mark const&) = delete;
+
+    private:
+        friend class session_registry;
+        std::shared_ptr<session_registry>   registry_;
+        tcp::socket*                        socket_;
+        live_session_mark*                  prev_;
+        live_session_mark*                  next_;
+    };
+
+    /// @brief  Открытые соединения одного io_context - чтобы закрыть их все при остановке сервера. 
+    ///         Используется только из потока своего io_context
+    class session_registry
+    {
+    public:
+        session_registry() : head_{}, closed_{} {}
+
+        /// @brief  Закрыть сокеты всех открытых сессий: ожидающие чтения завершатся с ошибкой, и сессии закроются 
+        ///         как при отключении клиента. Новые сессии после этого не начинаются
+        /// @return Число закрытых соединений
+        size_t close_all()
+        {
+            closed_ = true;
+            size_t n = 0;
+            for(live_session_mark* mark = head_; mark; mark = mark->next_)
+            {
+                if( !mark->socket_ || !mark->socket_->is_open() )
+                    continue;
+                boost::system::error_code ignored;
+                mark->socket_->close(ignored);
+                ++n;
+            }
+            return n;
+        }
+
+        bool closed() const { return closed_; }
+
+        /// @brief Число открытых сессий
+        size_t live_count() const
+        {
+            size_t n = 0;
+            for(live_session_mark* mark = head_; mark; mark = mark->next_)
+                ++n;
+            return n;
+        }
+
+    private:
+        friend class live_session_mark;
+        void link(live_session_mark& mark)
+        {
+            mark.next_ = head_;
+            if( head_ )
+                head_->prev_ = &mark;
+            head_ = &mark;
+        }
+        void unlink(live_session_mark& mark)
+        {
+            (mark.prev_ ? mark.prev_->next_ : head_) = mark.next_;
+            if( mark.next_ )
+                mark.next_->prev_ = mark.prev_;
+        }
+
+        live_session_mark*  head_;
+        bool                closed_;
+    };
+
+    inline live_session_mark::live_session_mark(std::shared_ptr<session_registry> registry, tcp::socket* socket)
+        : registry_(std::move(registry)), socket_(socket), prev_{}, next_{}
+    {
+        ++s_live_sessions;
+        otus_hw7::metrics().connections_total_.add();
+        otus_hw7::metrics().connections_active_.add();
+        if( registry_ )
+            registry_->link(*this);
+    }
+
+    inline live_session_mark::~live_session_mark()
+    {
+        if( registry_ )
+            registry_->unlink(*this);
+        --s_live_sessions;
+        otus_hw7::metrics().connections_active_.sub();
+    }
+
+    /// @brief  Сборщик строк потока TCP: границы чтений не совпадают с границами команд, поэтому в сессию 
+    ///         передаются только целые строки, а хвост без перевода строки дожидается следующего чтения.
+    class line_assembler
+    {
+    public:
+        /// @brief Передать в feed все целые строки из data, остаток сохранить
+        template <typename Feed>
+        int push(const char* data, std::size_t length, Feed&& feed)
+        {
+            std::string_view chunk(data, length);
+            const std::size_t eol = chunk.rfind('\n');
+            if( eol == std::string_view::npos )
+            {
+                tail_.append(chunk);
+                return 0;
+            }
+            int rc = 0;
+            if( tail_.empty() )
+                rc = feed(chunk.substr(0, eol + 1));
+            else
+            {
+                tail_.append(chunk.substr(0, eol + 1));
+                rc = feed(std::string_view(tail_));
+                tail_.clear();
+            }
+            tail_.append(chunk.substr(eol + 1));
+            return rc;
+        }
+
+        /// @brief Передать остаток без перевода строки - при закрытии соединения
+        template <typename Feed>
+        int finish(Feed&& feed)
+        {
+            int rc = tail_.empty() ? 0 : feed(std::string_view(tail_));
+            tail_.clear();
+            return rc;
+        }
+
+    private:
+        std::string tail_;
+    };
+
+    class session_timer;
+
+    /// @brief  Колесо таймеров сессий одного io_context (linger блоков и простой соединений): один steady_timer на поток 
+    ///         ввода-вывода вместо таймера на сессию в куче таймеров Asio. steady_timer взводится только до ближайшего 
+    ///         события колеса и только пока в нем есть таймеры. Само колесо разделяется с таймерами сессий - 
+    ///         сессии, разрушаемые вместе с io_context уже после сервера, снимаются с живого колеса.
+    class session_wheel
+    {
+    public:
+        session_wheel(ba::io_context& io, std::chrono::nanoseconds tick, std::chrono::milliseconds idle_timeout)
+            : timer_(io), wheel_(std::make_shared<otus_hw9::TimerWheel>(tick, otus_hw7::metrics_now_ns())), 
+              idle_timeout_(idle_timeout), waiting_until_{} {}
+
+        std::shared_ptr<otus_hw9::TimerWheel> const& wheel() const { return wheel_; }
+
+        /// @brief Тайм-аут простоя соединений, 0 - выключен
+        std::chrono::milliseconds idle_timeout() const { return idle_timeout_; }
+
+        void schedule(otus_hw9::TimerNode& node, uint64_t deadline_ns)
+        {
+            wheel_->schedule(node, deadline_ns);
+            wait();
+        }
+
+    private:
+        /// @brief Взвести steady_timer на ближайшее событие колеса, если он не ждет уже более раннего
+        void wait()
+        {
+            const uint64_t next = wheel_->next_expiry_ns();
+            if( waiting_until_ && waiting_until_ <= next )
+                return;
+            waiting_until_ = next;
+            const uint64_t now = otus_hw7::metrics_now_ns();
+            timer_.expires_after(std::chrono::nanoseconds(next > now ? next - now : 0));
+            timer_.async_wait([this](boost::system::error_code ec)
+                {
+                    if( ec )
+                        return;
+                    waiting_until_ = 0;
+                    on_tick();
+                });
+        }
+
+        inline void on_tick();
+
+        ba::steady_timer                        timer_;
+        std::shared_ptr<otus_hw9::TimerWheel>   wheel_;
+        std::chrono::milliseconds               idle_timeout_;
+        uint64_t                                waiting_until_;     ///< срок взведенного steady_timer, 0 - не взведен
+    };
+
+    /// @brief  Таймер сессии в колесе ее io_context. Снимается с колеса при разрушении, поэтому обработчик может 
+    ///         ссылаться на владельца; без колеса (nullptr) таймер выключен
+    class session_timer : public otus_hw9::TimerNode
+    {
+    public:
+        explicit session_timer(session_wheel* wheel) : owner_(wheel), wheel_(wheel ? wheel->wheel() : nullptr) {}
+        virtual ~session_timer() { if( wheel_ ) wheel_->cancel(*this); }
+
+        virtual void expire() = 0;
+
+    protected:
+        bool enabled() const { return owner_ != nullptr; }
+        void schedule(uint64_t deadline_ns) { owner_->schedule(*this, deadline_ns); }
+
+        session_wheel*                          owner_;
+    private:
+        std::shared_ptr<otus_hw9::TimerWheel>   wheel_;
+    };
+
+    void session_wheel::on_tick()
+    {
+        wheel_->advance(otus_hw7::metrics_now_ns(), [](otus_hw9::TimerNode& node){ static_cast<session_timer&>(node).expire(); });
+        if( !wheel_->empty() )
+            wait();
+    }
+
+    /// @brief  Таймер linger сессии: по сроку выводит неполный статический блок или ждет срока нового блока
+    class linger_timer : public session_timer
+    {
+    public:
+        linger_timer(session_wheel* wheel, otus_hw9::BulkSession& session) : session_timer(wheel), session_(session) {}
+
+        /// @brief Завести таймер, если в сессии копится неполный блок. Зовется после каждого feed()
+        void arm()
+        {
+            if( !enabled() || armed() )
+                return;
+            if( uint64_t deadline = session_.flush_deadline() )
+                schedule(deadline);
+        }
+
+        void expire() override
+        {
+            uint64_t deadline = session_.flush_deadline();
+            if( !deadline )
+                return;
+            if( deadline <= otus_hw7::metrics_now_ns() )
+                session_.flush();
+            else
+                schedule(deadline);
+        }
+
+    private:
+        otus_hw9::BulkSession&  session_;
+    };
+
+    /// @brief  Тайм-аут простоя соединения. Чтение только обновляет отметку активности, срок перепроверяется 
+    ///         при срабатывании - на каждое чтение не приходится ни одной операции с колесом
+    class idle_timer : public session_timer
+    {
+    public:
+        idle_timer(session_wheel* wheel, tcp::socket& socket) 
+            : session_timer(wheel && wheel->idle_timeout().count() ? wheel : nullptr), socket_(socket), 
+              timeout_ns_(enabled() ? static_cast<uint64_t>(std::chrono::nanoseconds(owner_->idle_timeout()).count()) : 0), 
+              last_ns_{} 
+        {
+            if( enabled() )
+                touch(), schedule(last_ns_ + timeout_ns_);
+        }
+
+        void touch() 
+        { 
+            if( enabled() ) 
+                last_ns_ = otus_hw7::metrics_now_ns(); 
+        }
+
+        void expire() override
+        {
+            const uint64_t deadline = last_ns_ + timeout_ns_;
+            if( deadline > otus_hw7::metrics_now_ns() )
+                return schedule(deadline);
+            // ожидающее чтение завершится с ошибкой, и сессия закроется как при отключении клиента
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            otus_hw7::metrics().connections_idle_closed_.add();
+        }
+
+    private:
+        tcp::socket&    socket_;
+        uint64_t        timeout_ns_;
+        uint64_t        last_ns_;
+    };
+
+    /// @brief  Пул сессий libasync одного io_context. Сессии создаются заранее, а закрытая сессия после reset() 
+    ///         возвращается в пул вместе с конвейером - новое соединение не строит парсер, очереди и потоки исполнителей.
+    ///         Используется только из потока своего io_context; сессии держат пул через shared_ptr, т.к. могут 
+    ///         разрушаться вместе с io_context уже после сервера. Там же - реестр открытых соединений этого io_context.
+    class session_pool
+    {
+    public:
+        /// @param capacity - сколько сессий создать сразу и держать свободными, 0 - сессия на соединение без переиспользования
+        session_pool(otus_hw9::Options const& options, size_t capacity) 
+            : options_(options), capacity_(capacity), registry_(std::make_shared<session_registry>())
+        {
+            free_.reserve(capacity_);
+            while( free_.size() < capacity_ )
+                free_.emplace_back(std::make_unique<otus_hw9::BulkSession>(options_));
+        }
+
+        otus_hw9::BulkSessionPtr_t acquire()
+        {
+            if( free_.empty() )
+                return std::make_unique<otus_hw9::BulkSession>(options_);
+            otus_hw9::BulkSessionPtr_t session = std::move(free_.back());
+            free_.pop_back();
+            return session;
+        }
+
+        /// @brief Завершить текущий блок сессии и вернуть ее в пул; сверх емкости сессия закрывается и разрушается
+        void release(otus_hw9::BulkSessionPtr_t session)
+        {
+            if( !session )
+                return;
+            if( free_.size() < capacity_ && !session->reset() )
+                free_.emplace_back(std::move(session));
+        }
+
+        size_t free_count() const { return free_.size(); }
+
+        std::shared_ptr<session_registry> const& registry() const { return registry_; }
+
+    private:
+        otus_hw9::Options                       options_;
+        size_t                                  capacity_;
+        std::shared_ptr<session_registry>       registry_;
+        std::vector<otus_hw9::BulkSessionPtr_t> free_;
+    };
+
+    using session_pool_ptr_t = std::shared_ptr<session_pool>;
+
+    /// @brief  Класс сессии приема и обработки команд. Для обработки владеет сессией libasync (BulkSession) напрямую.
     ///         За основу взят класс session из примера Урок 31
     class async_session
     : public std::enable_shared_from_this<async_session>
     {
     public:
-        async_session(tcp::socket socket, size_t bulk_size)
-            : socket_(std::move(socket))
+        async_session(tcp::socket socket, session_pool_ptr_t sessions, session_wheel* timers = nullptr)
+            : live_(sessions->registry(), &socket_), socket_(std::move(socket)), sessions_(std::move(sessions)), session_(sessions_->acquire()), 
+              linger_(timers, *session_), idle_(timers, socket_)
         {
-            ctx_ = libasync_connect(bulk_size);
-            if( !ctx_ )
-            	throw std::runtime_error("Cannot connect to libasync!");
-
         }
 
         ~async_session()
         {
-            libasync_disconnect(ctx_);
+            lines_.finish([this](std::string_view s){ return session_->feed(s); });
+            sessions_->release(std::move(session_));
         }
 
         void start()
@@ -47,33 +400,143 @@ namespace otus_hw10{
                     if (!ec)
                     {
                         //std::cout << "receive " << length << "=" << std::string{data_, length} << std::endl;
-                        int rc = libasync_receive(ctx_, data_, length);
+                        otus_hw7::metrics().bytes_received_.add(static_cast<int64_t>(length));
+                        otus_hw7::trace(otus_hw7::TraceEventId::kSessionRead, otus_hw7::TracePhase::kInstant, length);
+                        idle_.touch();
+                        int rc = lines_.push(data_, length, [this](std::string_view s){ return session_->feed(s); });
                         if( rc )
-                            throw std::runtime_error("libasync_receive error: " + std::to_string(rc));
+                            throw std::runtime_error("BulkSession::feed error: " + std::to_string(rc));
+                        linger_.arm();
                         do_read();
                     }
                 }
             );
         }
 
+        live_session_mark live_;
         tcp::socket socket_;
         enum { max_length = 1024 };
         char data_[max_length];
-        libasync_ctx_t  ctx_;
+        line_assembler lines_;
+        session_pool_ptr_t sessions_;
+        otus_hw9::BulkSessionPtr_t session_;
+        linger_timer linger_;
+        idle_timer idle_;
     };
 
+#ifdef USE_ASIO_COROUTINES
+    /// @brief  Сессия на сопрограммах C++20: читает из сокета, разбирает и отдает блоки исполнителям напрямую.
+    ///         Буфер и сессия libasync живут в кадре сопрограммы.
+    inline ba::awaitable<void> co_session(tcp::socket socket, session_pool_ptr_t sessions, session_wheel* timers = nullptr)
+    {
+        enum { max_length = 1024 };
+        live_session_mark live(sessions->registry(), &socket);
+        otus_hw9::BulkSessionPtr_t session = sessions->acquire();
+        linger_timer linger(timers, *session);
+        idle_timer idle(timers, socket);
+        line_assembler lines;
+        auto feed = [&session](std::string_view s){ return session->feed(s); };
+        char data[max_length];
+        try
+        {
+            for(;;)
+            {
+                std::size_t length = co_await socket.async_read_some(ba::buffer(data, max_length), ba::use_awaitable);
+                otus_hw7::metrics().bytes_received_.add(static_cast<int64_t>(length));
+                otus_hw7::trace(otus_hw7::TraceEventId::kSessionRead, otus_hw7::TracePhase::kInstant, length);
+                idle.touch();
+                lines.push(data, length, feed);
+                linger.arm();
+            }
+        }
+        catch(boost::system::system_error const&)
+        {
+            // соединение закрыто клиентом или оборвано - дальше как при disconnect
+        }
+        catch(std::exception const&)
+        {
+            // ошибка обработки (feed, нехватка памяти): под ba::detached исключение не должно обойти закрытие сессии,
+            // соединение закрывается как при disconnect
+            boost::system::error_code ec;
+            socket.close(ec);
+        }
+        // закрытие сессии завершает текущий блок команд
+        lines.finish(feed);
+        sessions->release(std::move(session));
+    }
+#endif
+
+    /// @brief Соединение со страницей статистики: читает заголовок запроса, отвечает метриками и закрывается.
+    ///        /trace/start и /trace/stop включают трассировку и выгружают ее в trace_file
+    class stats_connection
+    : public std::enable_shared_from_this<stats_connection>
+    {
+    public:
+        stats_connection(tcp::socket socket, std::string const& trace_file) : socket_(std::move(socket)), trace_file_(trace_file) {}
 
-    /// @brief Сервер асинхронного приема соединений и их дальнейшей асинхронной обработки в объектах КлиентскаяСессия
-    ///        За основу взят класс server из примера Урока 31
-    class async_server
+        void start()
+        {
+            auto self(shared_from_this());
+            ba::async_read_until(socket_, request_, "\r\n\r\n",
+                [this, self](boost::system::error_code ec, std::size_t)
+                {
+                    if( ec )
+                        return;
+                    std::istream is(&request_);
+                    std::string method, path;
+                    is >> method >> path;
+
+                    std::ostringstream body;
+                    bool found = method == "GET";
+                    if( found && (path == "/metrics" || path == "/") )
+                        otus_hw7::metrics().render(body);
+                    else if( found && path == "/trace/start" && !trace_file_.empty() )
+                    {
+                        otus_hw7::trace_start();
+                        body << "tracing\n";
+                    }
+                    else if( found && path == "/trace/stop" && !trace_file_.empty() )
+                    {
+                        otus_hw7::trace_stop();
+                        body << otus_hw7::trace_dump(trace_file_) << " events written to " << trace_file_ << "\n";
+                    }
+                    else
+                    {
+                        found = false;
+                        body << "not found\n";
+                    }
+                    response_ = std::string(found ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n")
+                              + "Content-Type: text/plain; version=0.0.4\r\n"
+                              + "Content-Length: " + std::to_string(body.str().size()) + "\r\n"
+                              + "Connection: close\r\n\r\n" + body.str();
+                    ba::async_write(socket_, ba::buffer(response_),
+                        [this, self](boost::system::error_code, std::size_t)
+                        {
+                            boost::system::error_code ignored;
+                            socket_.shutdown(tcp::socket::shutdown_both, ignored);
+                        });
+                });
+        }
+
+    private:
+        tcp::socket      socket_;
+        ba::streambuf    request_;
+        std::string      response_;
+        std::string      trace_file_;
+    };
+
+    /// @brief Страница статистики на 127.0.0.1: обслуживается тем же io_context, что и прием соединений
+    class stats_server
     {
     public:
-        async_server(ba::io_context& io_context, short port, size_t bulk_size)
-            : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), bulk_size_(bulk_size)
+        stats_server(ba::io_context& io, uint16_t port, std::string trace_file = {})
+            : acceptor_(io, tcp::endpoint(ba::ip::address_v4::loopback(), port)), trace_file_(std::move(trace_file))
         {
             do_accept();
         }
 
+        uint16_t port() const { return acceptor_.local_endpoint().port(); }
+
     private:
         void do_accept()
         {
@@ -81,15 +544,323 @@ namespace otus_hw10{
                 [this](boost::system::error_code ec, tcp::socket socket)
                 {
                     if (!ec)
-                    {
-                        std::make_shared<async_session>(std::move(socket), bulk_size_)->start();
-                    }
+                        std::make_shared<stats_connection>(std::move(socket), trace_file_)->start();
                     do_accept();
                 });
         }
 
         tcp::acceptor acceptor_;
-        size_t        bulk_size_;
+        std::string   trace_file_;
+    };
+
+    /// @brief Пул io_context - по одному на поток ввода-вывода. Сессия целиком обслуживается одним io_context, 
+    ///        т.е. одним потоком, а при привязке потоков к процессорам - и одним узлом NUMA.
+    class io_context_pool
+    {
+    public:
+        io_context_pool(size_t pool_size, otus_hw9::CpuSet_t cpus) : cpus_(std::move(cpus)), next_{}
+        {
+            for(size_t i = 0; i < std::max<size_t>(pool_size, 1); ++i)
+            {
+                contexts_.emplace_back(std::make_unique<ba::io_context>(1));
+                work_guards_.emplace_back(ba::make_work_guard(*contexts_.back()));
+            }
+        }
+
+        size_t           size() const { return contexts_.size(); }
+        ba::io_context&  context(size_t i) { return *contexts_.at(i); }
+
+        /// @brief Номер следующего io_context по кругу
+        size_t           next() { return next_++ % contexts_.size(); }
+
+        /// @brief Процессор потока i, -1 - поток не привязан
+        int              cpu_of(size_t i) const { return cpus_.empty() ? -1 : cpus_[i % cpus_.size()]; }
+
+        /// @brief Запускает потоки ввода-вывода, 0-й io_context обслуживается вызывающим потоком. Возвращает после stop()
+        void run()
+        {
+            for(size_t i = 1; i < contexts_.size(); ++i)
+                threads_.emplace_back([this, i](){ run_context(i); });
+            run_context(0);
+            for(auto& t : threads_)
+                t.join();
+            threads_.clear();
+        }
+
+        void stop()
+        {
+            for(auto& ctx : contexts_)
+                ctx->stop();
+        }
+
+    private:
+        void run_context(size_t i)
+        {
+            int cpu = cpu_of(i);
+            if( cpu >= 0 )
+                otus_hw9::pin_current_thread(otus_hw9::CpuSet_t{cpu});
+            contexts_[i]->run();
+        }
+
+        using work_guard_t = ba::executor_work_guard<ba::io_context::executor_type>;
+        otus_hw9::CpuSet_t                            cpus_;
+        std::vector<std::unique_ptr<ba::io_context>>  contexts_;
+        std::vector<work_guard_t>                     work_guards_;
+        std::vector<std::thread>                      threads_;
+        size_t                                        next_;
+    };
+
+    /// @brief Сервер асинхронного приема соединений и их дальнейшей асинхронной обработки в объектах КлиентскаяСессия
+    ///        За основу взят класс server из примера Урока 31
+    class async_server
+    {
+    public:
+        async_server(io_context_pool& pool, Options const& options)
+            : pool_(pool), reuse_port_(options.reuse_port && pool.size() > 1), closed_sessions_{}
+        {
+            // для каждого потока ввода-вывода - свои настройки конвейера: исполнители на том же узле NUMA, что и поток
+            const otus_hw9::CpuSet_t worker_cpus = options.worker_cpus.empty() ? otus_hw9::CpuSet_t{} 
+                                                                               : otus_hw9::parse_cpu_list(options.worker_cpus);
+            for(size_t i = 0; i < pool_.size(); ++i)
+            {
+                Options slot_options = options;
+                int cpu = pool_.cpu_of(i);
+                if( cpu >= 0 && !worker_cpus.empty() )
+                {
+                    otus_hw9::CpuSet_t node_cpus = otus_hw9::cpus_on_node(worker_cpus, otus_hw9::numa_node_of(cpu));
+                    if( !node_cpus.empty() )
+                        slot_options.worker_cpus = to_cpu_list(node_cpus);
+                }
+                sessions_.emplace_back(std::make_shared<session_pool>(slot_options, options.session_pool));
+                registries_.emplace_back(sessions_.back()->registry());
+                slot_options_.emplace_back(std::move(slot_options));
+                // колесо с шагом в четверть меньшего из сроков: срок сдвигается не больше чем на шаг
+                if( options.linger_ms || options.idle_timeout_ms )
+                {
+                    const size_t base_ms = std::min(options.linger_ms ? options.linger_ms : options.idle_timeout_ms, 
+                                                    options.idle_timeout_ms ? options.idle_timeout_ms : options.linger_ms);
+                    timers_.emplace_back(std::make_unique<session_wheel>(pool_.context(i), 
+                                            std::clamp(std::chrono::nanoseconds(std::chrono::milliseconds(base_ms)) / 4,
+                                                       std::chrono::nanoseconds(std::chrono::milliseconds(1)), 
+                                                       std::chrono::nanoseconds(std::chrono::milliseconds(100))),
+                                            std::chrono::milliseconds(options.idle_timeout_ms)));
+                }
+            }
+
+            // с SO_REUSEPORT у каждого потока свой приемник и соединения между потоками раздает ядро, 
+            // иначе один приемник на 0-м потоке раздает их по кругу
+            uint16_t port = options.port;
+            for(size_t i = 0; i < (reuse_port_ ? pool_.size() : 1); ++i)
+            {
+                acceptors_.emplace_back(std::make_unique<tcp::acceptor>(pool_.context(i)));
+                tcp::acceptor& acceptor = *acceptors_.back();
+                const tcp::endpoint endpoint(tcp::v4(), port);
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(tcp::acceptor::reuse_address(true));
+                if( reuse_port_ )
+                    acceptor.set_option(ba::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                acceptor.bind(endpoint);
+                acceptor.listen();
+                port = acceptor.local_endpoint().port();
+            }
+            // несколько ожидающих приемов: пока обрабатывается одно соединение, следующие уже принимаются
+            for(size_t a = 0; a < acceptors_.size(); ++a)
+                for(size_t i = 0; i < std::max<size_t>(options.accept_backlog, 1); ++i)
+                    do_accept(a);
+        }
+
+        /// @brief Порт, на котором фактически принимаются соединения (полезно при port == 0)
+        uint16_t port() const { return acceptors_.front()->local_endpoint().port(); }
+
+        /// @brief  Прекратить прием и закрыть все соединения - каждое в потоке своего io_context. Сессии завершаются 
+        ///         как при отключении клиента: хвост без перевода строки и неполный статический блок уходят исполнителям.
+        ///         Можно звать из любого потока
+        void shutdown()
+        {
+            for(size_t a = 0; a < acceptors_.size(); ++a)
+                ba::post(pool_.context(a), [this, a]()
+                                           {
+                                             boost::system::error_code ignored;
+                                             acceptors_[a]->close(ignored);
+                                           });
+            for(size_t slot = 0; slot < sessions_.size(); ++slot)
+                ba::post(pool_.context(slot), [this, slot](){ closed_sessions_ += sessions_[slot]->registry()->close_all(); });
+        }
+
+        /// @brief Число соединений, закрытых shutdown()
+        size_t closed_sessions() const { return closed_sessions_; }
+
+        /// @brief  Число сессий, еще не завершенных: их неполные блоки не выведены. 
+        ///         Только после остановки потоков ввода-вывода
+        size_t unfinished_sessions() const
+        {
+            size_t n = 0;
+            for(auto const& registry : registries_)
+                n += registry->live_count();
+            return n;
+        }
+
+        /// @brief  Закрыть пулы сессий после остановки потоков ввода-вывода: исполнители дорабатывают свои очереди, 
+        ///         и их потоки завершаются. Пулы закрываются в отдельном потоке, который не дожидаются дольше timeout
+        /// @return false - исполнители не уложились в срок и еще работают, или потоки ввода-вывода остановлены 
+        ///         раньше, чем завершились все сессии (unfinished_sessions())
+        bool drain(std::chrono::milliseconds timeout)
+        {
+            const size_t unfinished = unfinished_sessions();
+            std::promise<void> done;
+            std::future<void> drained = done.get_future();
+            std::thread closer([pools = std::move(sessions_), done = std::move(done)]() mutable
+                               {
+                                 pools.clear();
+                                 done.set_value();
+                               });
+            if( drained.wait_for(timeout) != std::future_status::ready )
+            {
+                closer.detach();
+                return false;
+            }
+            closer.join();
+            return unfinished == 0;
+        }
+
+    private:
+        void do_accept(size_t a)
+        {
+            const size_t slot = reuse_port_ ? a : pool_.next();
+            acceptors_[a]->async_accept(pool_.context(slot),
+                [this, a, slot](boost::system::error_code ec, tcp::socket socket)
+                {
+                    if( ec == ba::error::operation_aborted )
+                        return;
+                    if (!ec)
+                    {
+                        // сессия создается в потоке своего io_context - там же живут ее пул и колесо таймеров
+                        if( reuse_port_ )
+                            start_session(slot, std::move(socket));
+                        else
+                            ba::post(pool_.context(slot), [this, slot, socket = std::move(socket)]() mutable 
+                                                          { 
+                                                            start_session(slot, std::move(socket)); 
+                                                          });
+                    }
+                    do_accept(a);
+                });
+        }
+
+        void start_session(size_t slot, tcp::socket socket)
+        {
+            // соединение, принятое до закрытия приемника, но дошедшее до своего потока после shutdown()
+            if( sessions_[slot]->registry()->closed() )
+                return;
+#ifdef USE_ASIO_COROUTINES
+            if( slot_options_[slot].co_sessions )
+                ba::co_spawn(pool_.context(slot), co_session(std::move(socket), sessions_[slot], timers(slot)), ba::detached);
+            else
+#endif
+            std::make_shared<async_session>(std::move(socket), sessions_[slot], timers(slot))->start();
+        }
+
+        session_wheel* timers(size_t slot) { return timers_.empty() ? nullptr : timers_[slot].get(); }
+
+        static std::string to_cpu_list(otus_hw9::CpuSet_t const& cpus)
+        {
+            std::string s;
+            for(int cpu : cpus)
+                s += (s.empty() ? "" : ",") + std::to_string(cpu);
+            return s;
+        }
+
+        io_context_pool&        pool_;
+        bool                    reuse_port_;
+        std::vector<std::unique_ptr<tcp::acceptor>> acceptors_;
+        std::vector<Options>    slot_options_;
+        std::vector<session_pool_ptr_t> sessions_;
+        std::vector<std::shared_ptr<session_registry>> registries_;
+        std::vector<std::unique_ptr<session_wheel>> timers_;
+        std::atomic<size_t>     closed_sessions_;
+    };
+
+    /// @brief  Плавная остановка сервера по SIGINT/SIGTERM: прием прекращается, соединения закрываются, и когда все сессии 
+    ///         завершились или истек срок - потоки ввода-вывода останавливаются. После выхода из io_context_pool::run() 
+    ///         finish() дорабатывает очереди исполнителей, сбрасывает файлы блоков на диск и выводит отчет
+    class graceful_stop
+    {
+    public:
+        graceful_stop(io_context_pool& pool, async_server& server, std::chrono::milliseconds timeout)
+            : pool_(pool), server_(server), timeout_(timeout), signals_(pool.context(0), SIGINT, SIGTERM), 
+              poll_(pool.context(0)), started_ns_{}
+        {
+            signals_.async_wait([this](boost::system::error_code ec, int)
+                {
+                    if( ec )
+                        return;
+                    started_ns_ = otus_hw7::metrics_now_ns();
+                    server_.shutdown();
+                    wait_sessions();
+                });
+        }
+
+        /// @brief Пришел ли сигнал остановки
+        bool requested() const { return started_ns_ != 0; }
+
+        /// @return false - исполнители не вывели все блоки до истечения срока
+        bool finish(std::ostream& report)
+        {
+            const std::chrono::nanoseconds spent = elapsed();
+            const bool drained = server_.drain(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                    spent < timeout_ ? timeout_ - spent : std::chrono::nanoseconds{}));
+            std::cout.flush();
+            if( drained )
+                sync_outputs();
+
+            otus_hw7::BulkMetrics const& m = otus_hw7::metrics();
+            int64_t queued = 0;
+            for(auto const& depth : m.queue_depth_)
+                queued += depth.value();
+            report << "drain: " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed()).count() << " ms"
+                   << ", connections closed: " << server_.closed_sessions()
+                   << ", unfinished: " << server_.unfinished_sessions()
+                   << ", bulks: " << m.bulks_static_.value() << " static, " << m.bulks_dynamic_.value() << " dynamic"
+                   << ", commands: " << m.commands_parsed_.value() 
+                   << ", left in queues: " << queued << (drained ? "" : " (timeout)") << std::endl;
+            return drained;
+        }
+
+    private:
+        std::chrono::nanoseconds elapsed() const 
+        { 
+            return std::chrono::nanoseconds(otus_hw7::metrics_now_ns() - started_ns_); 
+        }
+
+        /// @brief Ждать завершения всех сессий, опрашивая их число, затем остановить потоки ввода-вывода
+        void wait_sessions()
+        {
+            if( !s_live_sessions || elapsed() >= timeout_ )
+                return pool_.stop();
+            poll_.expires_after(std::chrono::milliseconds(10));
+            poll_.async_wait([this](boost::system::error_code ec)
+                {
+                    if( !ec )
+                        wait_sessions();
+                });
+        }
+
+        /// @brief Файлы блоков пишутся в текущий каталог - на диск сбрасывается его файловая система
+        static void sync_outputs()
+        {
+            int fd = ::open(".", O_RDONLY | O_DIRECTORY);
+            if( fd < 0 )
+                return;
+            ::syncfs(fd);
+            ::close(fd);
+        }
+
+        io_context_pool&            pool_;
+        async_server&               server_;
+        std::chrono::milliseconds   timeout_;
+        ba::signal_set              signals_;
+        ba::steady_timer            poll_;
+        uint64_t                    started_ns_;
     };
     
 }
\ No newline at end of file
@@ -1,11 +1,24 @@
 #include <iostream>
 #include "bulkserver_utils.h"
+#include "async_affinity.h"
 
 namespace otus_hw10{
 
     namespace{
         constexpr const char* const OPTION_NAME_PORT = "port";
         constexpr const char* const OPTION_NAME_CHUNK_SIZE = "chunk_size";  
+        constexpr const char* const OPTION_NAME_IO_THREADS = "io_threads";
+        constexpr const char* const OPTION_NAME_IO_CPUS = "io_cpus";
+        constexpr const char* const OPTION_NAME_CO_SESSIONS = "co_sessions";
+        constexpr const char* const OPTION_NAME_STATS_PORT = "stats_port";
+        constexpr const char* const OPTION_NAME_TRACE_FILE = "trace_file";
+        constexpr const char* const OPTION_NAME_IDLE_TIMEOUT_MS = "idle_timeout_ms";
+        constexpr const char* const OPTION_NAME_ACCEPT_BACKLOG = "accept_backlog";
+        constexpr const char* const OPTION_NAME_REUSE_PORT = "reuse_port";
+        constexpr const char* const OPTION_NAME_SESSION_POOL = "session_pool";
+        constexpr const char* const OPTION_NAME_DRAIN_TIMEOUT_MS = "drain_timeout_ms";
+        constexpr const char* const OPTION_NAME_JOURNAL = "journal";
+        constexpr const char* const OPTION_NAME_JOURNAL_SYNC = "journal_sync";
     }
 
     Options& Options::add_caption_lines(std::string& caption)
@@ -22,8 +35,49 @@ namespace otus_hw10{
                           { 
                             if( port < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_PORT); 
                           };
+        auto check_threads = [](const size_t& cnt) 
+                          { 
+                            if( cnt < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_IO_THREADS); 
+                          };
+        auto check_cpus = [](const std::string& cpus) 
+                          { 
+                            try{ otus_hw9::parse_cpu_list(cpus); }
+                            catch(std::invalid_argument const&){ throw otus_hw7::po::invalid_option_value(OPTION_NAME_IO_CPUS); }
+                          };
+        auto check_backlog = [](const size_t& cnt) 
+                          { 
+                            if( cnt < 1 ) throw otus_hw7::po::invalid_option_value(OPTION_NAME_ACCEPT_BACKLOG); 
+                          };
         desc.add_options()
-            (OPTION_NAME_PORT, otus_hw7::po::value<uint16_t>(&port)->notifier(check_size), "Номер порта для подключения");
+            (OPTION_NAME_PORT, otus_hw7::po::value<uint16_t>(&port)->notifier(check_size), "Номер порта для подключения")
+            (OPTION_NAME_IO_THREADS, otus_hw7::po::value<size_t>(&io_threads)->notifier(check_threads), "Число потоков ввода-вывода")
+            (OPTION_NAME_IO_CPUS, otus_hw7::po::value<std::string>(&io_cpus)->notifier(check_cpus), 
+                "Привязка потоков ввода-вывода к процессорам, например 0,1. Конвейер сессии размещается на узле NUMA ее потока")
+            (OPTION_NAME_STATS_PORT, otus_hw7::po::value<uint16_t>(&stats_port), 
+                "Порт HTTP на 127.0.0.1 для метрик в формате Prometheus (GET /metrics), 0 - выключено")
+            (OPTION_NAME_TRACE_FILE, otus_hw7::po::value<std::string>(&trace_file), 
+                "Файл бинарной трассы (декодер bulk_trace_decode). Трассировка включается при запуске и через "
+                "GET /trace/start, выгружается в файл по GET /trace/stop на порту статистики")
+            (OPTION_NAME_IDLE_TIMEOUT_MS, otus_hw7::po::value<size_t>(&idle_timeout_ms), 
+                "Закрывать соединение, от которого не было данных дольше заданного числа мс (блок завершается как при отключении), 0 - не закрывать")
+            (OPTION_NAME_ACCEPT_BACKLOG, otus_hw7::po::value<size_t>(&accept_backlog)->notifier(check_backlog), 
+                "Число одновременно ожидающих приемов соединения на каждом приемнике")
+            (OPTION_NAME_REUSE_PORT, otus_hw7::po::bool_switch(&reuse_port), 
+                "Свой приемник с SO_REUSEPORT у каждого потока ввода-вывода: соединения между потоками раздает ядро")
+            (OPTION_NAME_SESSION_POOL, otus_hw7::po::value<size_t>(&session_pool), 
+                "Число заранее созданных сессий libasync на поток ввода-вывода; закрытая сессия возвращается в пул с сохранением конвейера")
+            (OPTION_NAME_DRAIN_TIMEOUT_MS, otus_hw7::po::value<size_t>(&drain_timeout_ms), 
+                "Срок плавной остановки по SIGINT/SIGTERM в мс: соединения закрываются с выводом неполных блоков, "
+                "исполнители дорабатывают очереди, файлы сбрасываются на диск")
+            (OPTION_NAME_JOURNAL, otus_hw7::po::value<std::string>(&journal_file), 
+                "Журнал упреждающей записи принятых команд. При запуске блоки, не записанные в файлы до сбоя, "
+                "восстанавливаются по журналу, и он начинается заново")
+            (OPTION_NAME_JOURNAL_SYNC, otus_hw7::po::bool_switch(&journal_sync), 
+                "fdatasync журнала при каждой групповой фиксации: журнал переживает и сбой питания, а не только падение процесса")
+#ifdef USE_ASIO_COROUTINES
+            (OPTION_NAME_CO_SESSIONS, otus_hw7::po::bool_switch(&co_sessions), "Сессии на сопрограммах C++20 без реестра контекстов libasync")
+#endif
+            ;
         return *this;
     }
     
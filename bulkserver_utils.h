@@ -9,8 +9,23 @@ namespace otus_hw10{
     {
         using BaseCls_t = otus_hw9::Options;
         uint16_t    port;
-        Options() : port(9000) {}
-        Options(uint16_t p, size_t cmd_bulk_sz, istream* istrm, size_t thread_cnt) : BaseCls_t(cmd_bulk_sz, istrm, thread_cnt), port(p) {}
+        size_t      io_threads;     ///< число потоков ввода-вывода, у каждого свой io_context
+        std::string io_cpus;        ///< процессоры для потоков ввода-вывода в формате "0-3,8", пусто - без привязки
+        bool        co_sessions;    ///< сессии на сопрограммах C++20 (если сервер собран с USE_ASIO_COROUTINES)
+        uint16_t    stats_port;     ///< порт HTTP со статистикой на 127.0.0.1, 0 - выключено
+        std::string trace_file;     ///< файл бинарной трассы; если задан, трассировка включена с запуска
+        size_t      idle_timeout_ms;///< закрывать соединение без данных дольше заданного, 0 - не закрывать
+        size_t      accept_backlog; ///< одновременно ожидающих async_accept на каждом приемнике
+        bool        reuse_port;     ///< свой приемник с SO_REUSEPORT у каждого потока ввода-вывода
+        size_t      session_pool;   ///< готовых сессий libasync на поток ввода-вывода, 0 - сессия создается на соединение
+        size_t      drain_timeout_ms;///< срок плавной остановки по SIGINT/SIGTERM: закрытие соединений и дообработка очередей
+        std::string journal_file;   ///< журнал упреждающей записи принятых команд, пусто - не ведется
+        bool        journal_sync;   ///< fdatasync журнала при каждой групповой фиксации
+        Options() : port(9000), io_threads(1), co_sessions(false), stats_port(0), idle_timeout_ms(0), 
+                    accept_backlog(4), reuse_port(false), session_pool(0), drain_timeout_ms(5000), journal_sync(false) { thread_count = 3; }
+        Options(uint16_t p, size_t cmd_bulk_sz, istream* istrm, size_t thread_cnt) 
+            : BaseCls_t(cmd_bulk_sz, istrm, thread_cnt), port(p), io_threads(1), co_sessions(false), stats_port(0), idle_timeout_ms(0), 
+              accept_backlog(4), reuse_port(false), session_pool(0), drain_timeout_ms(5000), journal_sync(false) {}
         virtual BaseCls_t& add_options(otus_hw7::po::options_description& desc) override;
         virtual Options& add_positional(otus_hw7::po::positional_options_description& pos_desc) override;
         virtual Options& add_caption_lines( std::string& caption) override;
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+namespace otus_hw7{
+
+    /// @brief Гистограмма задержек в духе HDR Histogram: значения делятся на диапазоны-степени двойки, 
+    ///        каждый диапазон - на 2^(sub_bucket_bits - 1) линейных корзин. Относительная погрешность ~ 2^-(sub_bucket_bits - 1).
+    ///        Запись без блокировок (relaxed атомики), чтение - снимок на момент вызова.
+    class LatencyHistogram
+    {
+    public:
+        static constexpr unsigned sub_bucket_bits = 7;
+        static constexpr size_t   sub_bucket_count = size_t(1) << sub_bucket_bits;
+        static constexpr size_t   sub_bucket_half = sub_bucket_count / 2;
+        static constexpr size_t   bucket_count = sub_bucket_count + (64 - sub_bucket_bits) * sub_bucket_half;
+
+        LatencyHistogram() { reset(); }
+        LatencyHistogram(LatencyHistogram const&) = delete;
+        LatencyHistogram& operator=(LatencyHistogram const&) = delete;
+
+        void record(uint64_t value)
+        {
+            buckets_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+            for(uint64_t prev = max_.load(std::memory_order_relaxed); 
+                value > prev && !max_.compare_exchange_weak(prev, value, std::memory_order_relaxed); );
+        }
+
+        void merge(LatencyHistogram const& rhs)
+        {
+            for(size_t i = 0; i < bucket_count; ++i)
+                buckets_[i].fetch_add(rhs.buckets_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            count_.fetch_add(rhs.count(), std::memory_order_relaxed);
+            sum_.fetch_add(rhs.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            const uint64_t value = rhs.max();
+            for(uint64_t prev = max_.load(std::memory_order_relaxed); 
+                value > prev && !max_.compare_exchange_weak(prev, value, std::memory_order_relaxed); );
+        }
+
+        void reset()
+        {
+            for(auto& b : buckets_)
+                b.store(0, std::memory_order_relaxed);
+            count_ = 0, sum_ = 0, max_ = 0;
+        }
+
+        uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+        uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+        uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+        double   mean() const { const uint64_t cnt = count(); return cnt ? double(sum_.load(std::memory_order_relaxed)) / double(cnt) : 0.0; }
+
+        /// @brief Значение процентиля p (0..100) - верхняя граница корзины, в которую он попал
+        uint64_t percentile(double p) const
+        {
+            const uint64_t cnt = count();
+            if( !cnt )
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(p / 100.0 * double(cnt) + 0.5);
+            if( rank < 1 ) rank = 1;
+            if( rank > cnt ) rank = cnt;
+            uint64_t seen = 0;
+            for(size_t i = 0; i < bucket_count; ++i)
+            {
+                seen += buckets_[i].load(std::memory_order_relaxed);
+                if( seen >= rank )
+                {
+                    const uint64_t upper = highest_of(i);
+                    return upper < max() ? upper : max();
+                }
+            }
+            return max();
+        }
+
+        /// @brief Число значений в корзине и ее верхняя граница - для вывода всей гистограммы
+        uint64_t bucket_value_count(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+        static uint64_t highest_of(size_t idx)
+        {
+            if( idx < sub_bucket_count )
+                return idx;
+            const size_t shift = (idx - sub_bucket_count) / sub_bucket_half + 1;
+            const uint64_t sub = (idx - sub_bucket_count) % sub_bucket_half + sub_bucket_half;
+            const uint64_t lowest = sub << shift;
+            const uint64_t width = uint64_t(1) << shift;
+            return lowest > std::numeric_limits<uint64_t>::max() - width ? std::numeric_limits<uint64_t>::max() : lowest + width - 1;
+        }
+
+        static size_t index_of(uint64_t value)
+        {
+            if( value < sub_bucket_count )
+                return static_cast<size_t>(value);
+            const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+            const unsigned shift = msb - (sub_bucket_bits - 1);
+            const uint64_t sub = value >> shift;
+            return sub_bucket_count + (shift - 1) * sub_bucket_half + static_cast<size_t>(sub - sub_bucket_half);
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, bucket_count> buckets_;
+        std::atomic<uint64_t> count_, sum_, max_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cmath>
+#include <exception>
+#include <filesystem>
+#include <thread>
+#include <unistd.h>
+
+#include "bulkloadgen_utils.h"
+#include "bulkloadgen_internal.h"
+
+int main(int argc, char const* argv[]) 
+{
+	using namespace otus_hw10;
+	try
+	{
+		LoadgenOptions options;
+		if (!options.parse_command_line(argc, argv))
+			return 1;
+		if( !options.watch_dir.empty() && !std::filesystem::is_directory(options.watch_dir) )
+			throw std::runtime_error("not a directory: " + options.watch_dir);
+
+		// запас на неравномерность распределения команд по соединениям
+		const size_t per_conn = static_cast<size_t>(std::ceil(options.rate / double(options.connections) * options.duration * 1.5)) 
+		                        + options.dynamic_size + 16;
+		SentRegistry registry(options.connections, per_conn);
+		LoadStats stats;
+		BulkObserver observer(registry, stats);
+		std::atomic<bool> stop{false};
+		std::exception_ptr observer_error;
+		std::thread observer_thread([&]()
+			{
+				try
+				{
+					if( options.watch_dir.empty() )
+						observer.run_stream(STDIN_FILENO, stop);
+					else
+						observer.run_dir(options.watch_dir, stop);
+				}
+				catch(...)
+				{
+					observer_error = std::current_exception();
+				}
+			});
+
+		run_senders(options, registry, stats);
+
+		const auto grace_end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		                                                              std::chrono::duration<double>(options.grace));
+		while( stats.received_cmds_ < stats.sent_cmds_ && std::chrono::steady_clock::now() < grace_end )
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		stop = true;
+		observer_thread.join();
+		if( observer_error )
+			std::rethrow_exception(observer_error);
+
+		std::cout << "target:     " << options.rate << " cmd/s over " << options.connections << " connections for " 
+		          << options.duration << " s, dynamic ratio " << options.dynamic_ratio << std::endl;
+		stats.print(std::cout);
+	}	
+	catch(const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
@@ -1,10 +1,13 @@
 #include <iostream>
+#include <utility>
+#include <cstdlib>
 #include <boost/asio.hpp>
 
 #include "vers.h"
 #include "bulkserver_utils.h"
 #include "bulkserver_internal.h"
 #include "async.h"
+#include "bulk_journal.h"
 
 using namespace std::literals::string_literals;
 
@@ -17,9 +20,29 @@ int main(int argc, char const* argv[])
 		if (!options.parse_command_line(argc, argv))
 			return 1;
 		
-		ba::io_context io_context;
-	    async_server server(io_context, options.port, options.cmd_chunk_sz);
-		io_context.run();
+		if( !options.journal_file.empty() )
+		{
+			const otus_hw7::JournalReplay replay = otus_hw7::journal_open(options.journal_file, options.journal_sync);
+			if( replay.bulks_ || replay.torn_ )
+				std::cerr << "journal: " << replay.bulks_ << " bulks (" << replay.commands_ << " commands) restored from " 
+				          << replay.records_ << " records" << (replay.torn_ ? ", torn tail dropped" : "") << std::endl;
+		}
+		io_context_pool pool(options.io_threads, options.io_cpus.empty() ? otus_hw9::CpuSet_t{} : otus_hw9::parse_cpu_list(options.io_cpus));
+	    async_server server(pool, options);
+		std::unique_ptr<stats_server> stats;
+		if( options.stats_port )
+			stats = std::make_unique<stats_server>(pool.context(0), options.stats_port, options.trace_file);
+		if( !options.trace_file.empty() )
+			otus_hw7::trace_start();
+		graceful_stop stop(pool, server, std::chrono::milliseconds(options.drain_timeout_ms));
+		pool.run();
+		const bool drained = !stop.requested() || stop.finish(std::cerr);
+		if( drained )
+			otus_hw7::journal_close();
+		otus_hw7::metrics().render_stages(std::cerr);
+		// исполнители, не уложившиеся в срок, еще работают - без разрушения статических объектов под ними
+		if( !drained )
+			std::quick_exit(EXIT_FAILURE);
 	}	
 	catch(const std::exception &e)
 	{
@@ -7,7 +7,10 @@
 #include "pretty.h"
 #endif
 #include "async_internal.h"
+#include "async_pipeline.h"
 #include "async.h"
+#include "timer_wheel.h"
+#include "bulkserver_internal.h"
 
 using namespace otus_hw7;
 using namespace otus_hw9;
@@ -174,3 +177,590 @@ TEST(test_async, test_receive_mt)
     t1.join();
     t2.join();
 }
+
+TEST(test_async, test_receive_batch)
+{
+    using namespace std;
+
+    /// @brief Исполнитель, запоминающий размеры пакетов и выводящий их в строку
+    struct BatchRecorder : public otus_hw7::QueueExecutor
+    {
+        vector<size_t>                bulks_;
+        shared_ptr<ostringstream>     os_ = make_shared<ostringstream>();
+        void execute_batch(ICommandQueue&, BulkBatchPtr_t const& batch) override
+        {
+            bulks_.push_back(batch->bulks_.size());
+            for(auto& bulk : batch->bulks_)
+                bulk.ctx_.os_ = os_.get();
+            ICommandContext ctx;
+            otus_hw7::BulkBatchCommand{batch}(ctx);
+        }
+    };
+
+    stringstream iostm;
+    auto recorder = make_shared<BatchRecorder>();
+    ProcessorMT processor(otus_hw7::create_parser(otus_hw9::Options(2, &iostm, 3)),
+                          otus_hw9::create_command_queue(ICommandQueue::Type::qInput), recorder);
+
+    // все блоки одного приема - один пакет
+    iostm << "a\nb\nc\nd\n{\ne\nf\ng\n}\n";
+    processor.process(false);
+    EXPECT_EQ(recorder->bulks_, (vector<size_t>{3}));
+    EXPECT_EQ(recorder->os_->str(), "bulk: a, b\nbulk: c, d\nbulk: e, f, g\n");
+
+    processor.process(false);
+    EXPECT_EQ(recorder->bulks_.size(), 1u);
+
+    iostm.clear();
+    iostm << "h\ni\nj\n";
+    processor.process(true);
+    EXPECT_EQ(recorder->bulks_, (vector<size_t>{3, 1}));
+    EXPECT_EQ(recorder->os_->str(), "bulk: a, b\nbulk: c, d\nbulk: e, f, g\nbulk: h, i\n");
+}
+
+TEST(test_async, test_static_pipeline)
+{
+    using namespace std;
+
+    otus_hw9::Options options(2, nullptr, 3, FileSinkMode::kStatic);
+    EXPECT_TRUE( dynamic_pointer_cast<StaticPipelineMT>(otus_hw9::create_queue_executor(options)) );
+
+    // консоль перехватывается, файлы блоков пишутся в рабочий каталог теста
+    ostringstream out;
+    streambuf* prev_cout = cout.rdbuf(out.rdbuf());
+    auto& m = otus_hw7::metrics();
+    const int64_t bulks0 = m.bulks_static_.value() + m.bulks_dynamic_.value();
+    {
+        BulkSession session(options);
+        session.feed("s1\ns2\ns3\n{\ns4\n}\n");
+    }
+    cout.rdbuf(prev_cout);
+    EXPECT_EQ(out.str(), "bulk: s1, s2\nbulk: s3\nbulk: s4\n");
+    EXPECT_EQ(m.bulks_static_.value() + m.bulks_dynamic_.value(), bulks0 + 3);
+}
+
+TEST(test_async, test_work_stealing_scheduler)
+{
+    using namespace std;
+
+    /// @brief Команда-счетчик выполнений
+    struct CountingCommand : public otus_hw7::EmptyCommand
+    {
+        atomic<size_t>& counter_;
+        CountingCommand(atomic<size_t>& counter) : EmptyCommand("count"), counter_(counter) {}
+        void execute(ICommandContext&) override { ++counter_; }
+    };
+
+    atomic<size_t> counter{};
+    constexpr size_t task_count = 1000;
+    {
+        WorkStealingScheduler scheduler(4);
+        EXPECT_EQ(scheduler.worker_count(), 4);
+        for(size_t i = 0; i < task_count; ++i)
+            scheduler.submit( WorkStealingScheduler::Task{make_shared<CountingCommand>(counter), make_shared<ICommandContext>()} );
+    }
+    EXPECT_EQ(counter.load(), task_count);
+}
+
+TEST(test_async, test_receive_work_stealing)
+{
+    using namespace std;
+
+    otus_hw9::Options options(3, nullptr, 4, FileSinkMode::kWorkStealing);
+    libasync_ctx_t ctx0 = connect(options);
+    EXPECT_TRUE(ctx0);
+
+    auto inp_s = "ws-1\nws-2\nws-3\nws-4\n{\nws-5\nws-6\n}\nws-7\n"s; 
+    int rc = receive(ctx0, inp_s.c_str(), inp_s.length());
+    EXPECT_EQ(rc, 0);
+
+    rc = disconnect(ctx0);
+    EXPECT_EQ(rc, 0);
+}
+
+TEST(test_async, test_work_stealing_autoscale)
+{
+    using namespace std;
+
+    /// @brief Медленная команда - имитирует запись в файл
+    struct SlowCommand : public otus_hw7::EmptyCommand
+    {
+        atomic<size_t>& counter_;
+        SlowCommand(atomic<size_t>& counter) : EmptyCommand("slow"), counter_(counter) {}
+        void execute(ICommandContext&) override { this_thread::sleep_for(1ms); ++counter_; }
+    };
+
+    WorkStealingScheduler::AutoscalePolicy policy;
+    policy.tick_ = 5ms;
+    policy.shrink_ticks_ = 2;
+
+    atomic<size_t> counter{};
+    constexpr size_t task_count = 200;
+    {
+        WorkStealingScheduler scheduler(1, 4, policy);
+        EXPECT_EQ(scheduler.min_worker_count(), 1);
+        EXPECT_EQ(scheduler.max_worker_count(), 4);
+        for(size_t i = 0; i < task_count; ++i)
+            scheduler.submit( WorkStealingScheduler::Task{make_shared<SlowCommand>(counter), make_shared<ICommandContext>()} );
+
+        size_t peak = scheduler.worker_count();
+        for(int i = 0; i < 200 && counter.load() < task_count; ++i, this_thread::sleep_for(5ms))
+            peak = max(peak, scheduler.worker_count());
+        EXPECT_GT(peak, 1);
+
+        for(int i = 0; i < 200 && scheduler.worker_count() > 1; ++i)
+            this_thread::sleep_for(5ms);
+        EXPECT_EQ(scheduler.worker_count(), 1);
+    }
+    EXPECT_EQ(counter.load(), task_count);
+}
+
+TEST(test_async, test_parse_cpu_list)
+{
+    EXPECT_EQ(parse_cpu_list("0-3,8"), (CpuSet_t{0, 1, 2, 3, 8}));
+    EXPECT_EQ(parse_cpu_list("5,1,1-2"), (CpuSet_t{1, 2, 5}));
+    EXPECT_TRUE(parse_cpu_list("").empty());
+    EXPECT_THROW(parse_cpu_list("3-1"), std::invalid_argument);
+    EXPECT_THROW(parse_cpu_list("a,b"), std::invalid_argument);
+    EXPECT_THROW(parse_cpu_list("1-2x"), std::invalid_argument);
+}
+
+TEST(test_async, test_receive_pinned)
+{
+    using namespace std;
+
+    otus_hw9::Options options(3, nullptr, 3, FileSinkMode::kWorkStealing);
+    options.worker_cpus = "0";
+    libasync_ctx_t ctx0 = connect(options);
+    EXPECT_TRUE(ctx0);
+
+    auto inp_s = "pin-1\npin-2\npin-3\npin-4\n"s; 
+    EXPECT_EQ(receive(ctx0, inp_s.c_str(), inp_s.length()), 0);
+    EXPECT_EQ(disconnect(ctx0), 0);
+}
+
+TEST(test_async, test_ring_pipeline)
+{
+    using namespace std;
+
+    // кольцо: емкость до степени двойки, полное кольцо не принимает, порядок сохраняется при переходе через край
+    SpscRing<int> ring(3);
+    EXPECT_EQ(ring.capacity(), 4u);
+    int v = 0;
+    for(int round = 0; round < 3; ++round)
+    {
+        for(int i = 0; i < 4; ++i)
+            EXPECT_TRUE(ring.try_push(round * 10 + i));
+        EXPECT_FALSE(ring.try_push(99));
+        for(int i = 0; i < 4; ++i)
+        {
+            EXPECT_TRUE(ring.try_pop(v));
+            EXPECT_EQ(v, round * 10 + i);
+        }
+        EXPECT_FALSE(ring.try_pop(v));
+        EXPECT_TRUE(ring.empty());
+    }
+
+    otus_hw9::Options options(2, nullptr, 4, FileSinkMode::kRing);
+    EXPECT_TRUE( dynamic_pointer_cast<StaticPipelineRing>(otus_hw9::create_queue_executor(options)) );
+
+    ostringstream out;
+    streambuf* prev_cout = cout.rdbuf(out.rdbuf());
+    auto& m = otus_hw7::metrics();
+    const uint64_t files0 = m.file_write_ns_.count();
+    {
+        BulkSession session(options);
+        for(int i = 0; i < 100; ++i)
+            session.feed("r" + to_string(i) + "\n");
+    }
+    cout.rdbuf(prev_cout);
+    string expected;
+    for(int i = 0; i < 100; i += 2)
+        expected += "bulk: r" + to_string(i) + ", r" + to_string(i + 1) + "\n";
+    EXPECT_EQ(out.str(), expected);
+    EXPECT_EQ(m.file_write_ns_.count(), files0 + 50);
+}
+
+TEST(test_async, test_sync_session)
+{
+    using namespace std;
+
+    // синхронный режим: блок выведен на консоль и в файл уже к возврату из receive, без потоков исполнителей
+    set_default_thread_count(1);
+    EXPECT_EQ(default_thread_count(), 1u);
+    ostringstream out;
+    streambuf* prev_cout = cout.rdbuf(out.rdbuf());
+    auto& m = otus_hw7::metrics();
+    const uint64_t files0 = m.file_write_ns_.count();
+    libasync_ctx_t ctx = connect(2);
+    EXPECT_EQ(receive(ctx, "y1\ny2\ny3\n", 9), 0);
+    EXPECT_EQ(out.str(), "bulk: y1, y2\n");
+    EXPECT_EQ(m.file_write_ns_.count(), files0 + 1);
+    EXPECT_EQ(receive(ctx, "{\ny4\n}\n", 8), 0);
+    EXPECT_EQ(out.str(), "bulk: y1, y2\nbulk: y3\nbulk: y4\n");
+    EXPECT_EQ(disconnect(ctx), 0);
+    cout.rdbuf(prev_cout);
+    set_default_thread_count(3);
+}
+
+TEST(test_async, test_bulk_session)
+{
+    using namespace std;
+
+    BulkSession session(otus_hw9::Options(2, nullptr, 3));
+    EXPECT_FALSE(session.closed());
+    EXPECT_EQ(session.feed("bs-1\nbs-2\nbs-3\n"sv), 0);
+    EXPECT_EQ(session.feed("{\nbs-4\n}\n"sv), 0);
+    EXPECT_EQ(session.close(), 0);
+    EXPECT_TRUE(session.closed());
+    EXPECT_NE(session.feed("bs-5\n"sv), 0);
+    EXPECT_NE(session.close(), 0);
+}
+
+TEST(test_async, test_bulk_session_reset)
+{
+    using namespace std;
+
+    // reset() завершает блок, как close(), но сессия остается открытой для следующего соединения,
+    // а незакрытый динамический блок предыдущего соединения не переходит в следующее
+    auto& m = otus_hw7::metrics();
+    BulkSession session(otus_hw9::Options(3, nullptr, 3));
+    const int64_t static0 = m.bulks_static_.value(), dynamic0 = m.bulks_dynamic_.value();
+    EXPECT_EQ(session.feed("rs-1\nrs-2\n"sv), 0);
+    EXPECT_EQ(session.reset(), 0);
+    EXPECT_FALSE(session.closed());
+    EXPECT_EQ(m.bulks_static_.value(), static0 + 1);
+    EXPECT_EQ(session.feed("{\nrs-3\n"sv), 0);
+    EXPECT_EQ(session.reset(), 0);
+    EXPECT_EQ(session.feed("rs-4\nrs-5\nrs-6\n"sv), 0);
+    EXPECT_EQ(m.bulks_static_.value(), static0 + 2);
+    EXPECT_EQ(m.bulks_dynamic_.value(), dynamic0);
+    EXPECT_EQ(session.close(), 0);
+    EXPECT_NE(session.reset(), 0);
+}
+
+
+TEST(test_async, test_connect_pool)
+{
+    // отключенный контекст с готовым конвейером достается следующему connect с тем же размером блока
+    set_context_pool_capacity(1);
+    libasync_ctx_t ctx = connect(4);
+    EXPECT_EQ(receive(ctx, "p1\np2\n{\np3\n", 11), 0);
+    EXPECT_EQ(disconnect(ctx), 0);
+    EXPECT_NE(receive(ctx, "p4\n", 3), 0);
+
+    libasync_ctx_t other = connect(5);
+    EXPECT_NE(other, ctx);
+    // контекст из пула выдается под новым ид - прежний ид отклоняется
+    libasync_ctx_t again = connect(4);
+    EXPECT_NE(again, ctx);
+    EXPECT_NE(receive(ctx, "p4\n", 3), 0);
+    EXPECT_EQ(disconnect(ctx), -1);
+
+    // незакрытый динамический блок прежнего владельца не переходит к новому
+    const int64_t static0 = otus_hw7::metrics().bulks_static_.value();
+    EXPECT_EQ(receive(again, "p5\np6\np7\np8\n", 12), 0);
+    EXPECT_EQ(otus_hw7::metrics().bulks_static_.value(), static0 + 1);
+
+    // пул полон - второй контекст закрывается
+    EXPECT_EQ(disconnect(again), 0);
+    EXPECT_EQ(disconnect(other), 0);
+    set_context_pool_capacity(0);
+    EXPECT_EQ(disconnect(again), -1);
+
+    // то же через C ABI
+    libasync_set_context_pool_capacity(1);
+    libasync_ctx_t c_ctx = libasync_connect(4);
+    EXPECT_EQ(libasync_receive(c_ctx, "p9\n", 3), 0);
+    EXPECT_EQ(libasync_disconnect(c_ctx), 0);
+    libasync_ctx_t c_again = libasync_connect(4);
+    EXPECT_NE(c_again, c_ctx);
+    EXPECT_NE(libasync_receive(c_ctx, "p10\n", 4), 0);
+    EXPECT_EQ(libasync_disconnect(c_again), 0);
+    libasync_set_context_pool_capacity(0);
+}
+
+TEST(test_async, test_metrics)
+{
+    auto& m = otus_hw7::metrics();
+    const size_t file_q = static_cast<size_t>(ICommandQueue::Type::qFile);
+    const int64_t depth0 = m.queue_depth_[file_q].value(), queues0 = m.queue_count_[file_q].value();
+    {
+        ICommandQueuePtr_t cmd_q = otus_hw9::create_command_queue(ICommandQueue::Type::qFile);
+        EXPECT_EQ(m.queue_count_[file_q].value(), queues0 + 1);
+        ICommandCreatorPtr_t cmd_creator{std::make_unique<CommandCreator>()};
+        std::thread t([&](){ cmd_q->push(cmd_creator->create_command("1", 0)); });
+        t.join();
+        cmd_q->push(cmd_creator->create_command("2", 0));
+        cmd_q->push(cmd_creator->create_command("3", 0));
+        EXPECT_EQ(m.queue_depth_[file_q].value(), depth0 + 3);
+        ICommandPtr_t cmd;
+        cmd_q->pop(cmd);
+        EXPECT_EQ(m.queue_depth_[file_q].value(), depth0 + 2);
+        // блочная команда учитывается по числу своих команд
+        ICommandPtrArray_t bulk{cmd, cmd, cmd};
+        cmd_q->push(std::make_shared<otus_hw7::BulkCommand>(bulk, 0, bulk.size()));
+        EXPECT_EQ(m.queue_depth_[file_q].value(), depth0 + 5);
+    }
+    // разрушенная очередь снимает свои команды с датчика
+    EXPECT_EQ(m.queue_depth_[file_q].value(), depth0);
+    EXPECT_EQ(m.queue_count_[file_q].value(), queues0);
+
+    const int64_t parsed0 = m.commands_parsed_.value(), static0 = m.bulks_static_.value(), dynamic0 = m.bulks_dynamic_.value();
+    otus_hw9::BulkSession session(2);
+    session.feed("1\n2\n3\n{\n4\n5\n}\n");
+    session.close();
+    EXPECT_EQ(m.commands_parsed_.value(), parsed0 + 5);
+    EXPECT_EQ(m.bulks_static_.value(), static0 + 2);
+    EXPECT_EQ(m.bulks_dynamic_.value(), dynamic0 + 1);
+
+    std::ostringstream oss;
+    m.render(oss);
+    EXPECT_NE(oss.str().find("bulk_bulks_total{kind=\"dynamic\"}"), std::string::npos);
+    EXPECT_NE(oss.str().find("bulk_file_write_seconds_count"), std::string::npos);
+}
+
+TEST(test_async, test_bulk_timeline)
+{
+    auto& m = otus_hw7::metrics();
+    const uint64_t parse0 = m.stage_parse_ns_.count(), dispatch0 = m.stage_dispatch_ns_.count(),
+                   console0 = m.stage_console_ns_.count(), file0 = m.stage_file_ns_.count();
+    {
+        otus_hw9::BulkSession session(2);
+        session.feed("t1\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        session.feed("t2\n{\nt3\n}\n");
+        session.close();
+    }
+    EXPECT_EQ(m.stage_parse_ns_.count(), parse0 + 2);
+    EXPECT_EQ(m.stage_dispatch_ns_.count(), dispatch0 + 2);
+    EXPECT_EQ(m.stage_console_ns_.count(), console0 + 2);
+    EXPECT_EQ(m.stage_file_ns_.count(), file0 + 2);
+    // первый блок копился с получения t1
+    EXPECT_GE(m.stage_parse_ns_.max(), 20'000'000u);
+
+    std::ostringstream oss;
+    m.render_stages(oss);
+    EXPECT_NE(oss.str().find("dispatch"), std::string::npos);
+}
+
+TEST(test_async, test_bulk_timeline_console_write)
+{
+    using namespace std;
+
+    // этап консоли включает саму запись блока в поток вывода, а не только форматирование
+    struct SlowBuf : stringbuf
+    {
+        int sync() override { this_thread::sleep_for(chrono::milliseconds(20)); return stringbuf::sync(); }
+    } slow;
+    auto& m = otus_hw7::metrics();
+    const uint64_t console0 = m.stage_console_ns_.count();
+    streambuf* prev_cout = cout.rdbuf(&slow);
+    {
+        BulkSession session(otus_hw9::Options(2, nullptr, 3, FileSinkMode::kStatic));
+        session.feed("w1\nw2\n");
+    }
+    cout.rdbuf(prev_cout);
+    EXPECT_EQ(slow.str(), "bulk: w1, w2\n");
+    EXPECT_EQ(m.stage_console_ns_.count(), console0 + 1);
+    EXPECT_GE(m.stage_console_ns_.max(), 20'000'000u);
+}
+TEST(test_async, test_timer_wheel)
+{
+    constexpr uint64_t ms = 1'000'000;
+    TimerWheel wheel(std::chrono::milliseconds(1), 0);
+    std::vector<TimerNode*> fired;
+    auto on_expire = [&fired](TimerNode& n){ fired.push_back(&n); };
+
+    // срок округляется вверх до тика, снятый таймер не срабатывает
+    TimerNode t1, t2;
+    wheel.schedule(t1, 2 * ms + ms / 2);
+    wheel.schedule(t2, 3 * ms);
+    wheel.cancel(t2);
+    EXPECT_FALSE(t2.armed());
+    EXPECT_EQ(wheel.size(), 1);
+    EXPECT_EQ(wheel.next_expiry_ns(), 3 * ms);
+    EXPECT_EQ(wheel.advance(2 * ms + ms * 9 / 10, on_expire), 0);
+    EXPECT_EQ(wheel.advance(3 * ms, on_expire), 1);
+    EXPECT_EQ(fired, std::vector<TimerNode*>{&t1});
+    EXPECT_TRUE(wheel.empty());
+
+    // сроки на разных уровнях (до 64, 64^2, 64^3 тиков и за горизонтом 64^4) спускаются и срабатывают ровно в срок
+    const uint64_t deadlines[] = {10, 100, 5'000, 300'000, 20'000'000};
+    TimerNode far[std::size(deadlines)];
+    for(size_t i = std::size(deadlines); i-- > 0; )
+        wheel.schedule(far[i], deadlines[i] * ms);
+    fired.clear();
+    for(size_t i = 0; i < std::size(deadlines); ++i)
+    {
+        EXPECT_EQ(wheel.advance(deadlines[i] * ms - 1, on_expire), 0) << deadlines[i];
+        // пустые тики проматываются: ближайшее событие колеса - не позже срока
+        EXPECT_LE(wheel.next_expiry_ns(), deadlines[i] * ms);
+        EXPECT_EQ(wheel.advance(deadlines[i] * ms, on_expire), 1) << deadlines[i];
+        EXPECT_EQ(fired.back(), &far[i]);
+    }
+    EXPECT_TRUE(wheel.empty());
+
+    // обработчик перевзводит свой таймер и снимает соседний из того же слота
+    TimerNode a, b;
+    const uint64_t now = 20'000'000 * ms;
+    wheel.schedule(a, now + 5 * ms);
+    wheel.schedule(b, now + 5 * ms);
+    size_t calls = 0;
+    wheel.advance(now + 5 * ms, [&](TimerNode& n)
+                  {
+                      ++calls;
+                      wheel.cancel(&n == &a ? b : a);
+                      wheel.schedule(n, now + 500 * ms);
+                  });
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(wheel.size(), 1);
+    EXPECT_EQ(wheel.advance(now + 500 * ms, on_expire), 1);
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(test_async, test_linger_flush)
+{
+    auto& m = otus_hw7::metrics();
+    {
+        // сессия напрямую: срок считается от первой команды неполного блока, flush() выводит его
+        otus_hw9::Options options(10, nullptr, 3);
+        options.linger_ms = 50;
+        otus_hw9::BulkSession session(options);
+        EXPECT_EQ(session.flush_deadline(), 0u);
+        session.feed("l1\nl2\n");
+        EXPECT_GT(session.flush_deadline(), otus_hw7::metrics_now_ns());
+        const int64_t static0 = m.bulks_static_.value();
+        EXPECT_TRUE(session.flush());
+        EXPECT_EQ(m.bulks_static_.value(), static0 + 1);
+        EXPECT_EQ(session.flush_deadline(), 0u);
+        EXPECT_FALSE(session.flush());
+        // внутри динамического блока досрочного вывода нет
+        session.feed("{\nl3\n");
+        EXPECT_EQ(session.flush_deadline(), 0u);
+    }
+    {
+        // C ABI: неполный блок выводит служба linger без новых данных от клиента
+        otus_hw9::Options options(10, nullptr, 3);
+        options.linger_ms = 20;
+        const int64_t static0 = m.bulks_static_.value();
+        libasync_ctx_t ctx = connect(options);
+        receive(ctx, "c1\nc2\n", 6);
+        for(int i = 0; i < 100 && m.bulks_static_.value() == static0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(m.bulks_static_.value(), static0 + 1);
+        EXPECT_EQ(disconnect(ctx), 0);
+        EXPECT_EQ(m.bulks_static_.value(), static0 + 1);
+    }
+}
+
+TEST(test_async, test_server_split_command)
+{
+    using namespace std;
+    using otus_hw10::tcp;
+    namespace ba = boost::asio;
+
+    // команда, разрезанная между двумя чтениями сокета, доходит до сессии целой
+    otus_hw10::line_assembler lines;
+    vector<string> fed;
+    auto feed = [&fed](string_view s){ fed.emplace_back(s); return 0; };
+    EXPECT_EQ(lines.push("sp", 2, feed), 0);
+    EXPECT_TRUE(fed.empty());
+    EXPECT_EQ(lines.push("lit1\nsplit2\nspl", 15, feed), 0);
+    EXPECT_EQ(fed, (vector<string>{"split1\nsplit2\n"}));
+    EXPECT_EQ(lines.finish(feed), 0);
+    EXPECT_EQ(fed.back(), "spl");
+
+    otus_hw10::Options options;
+    options.port = 0;
+    options.cmd_chunk_sz = 2;
+    auto& m = otus_hw7::metrics();
+    ostringstream out;
+    streambuf* prev_cout = cout.rdbuf(out.rdbuf());
+    {
+        otus_hw10::io_context_pool pool(1, otus_hw9::CpuSet_t{});
+        otus_hw10::async_server server(pool, options);
+        thread io([&pool](){ pool.run(); });
+        ba::io_context client_ctx;
+        tcp::socket client(client_ctx);
+        client.connect(tcp::endpoint(ba::ip::address_v4::loopback(), server.port()));
+        const int64_t bytes0 = m.bytes_received_.value();
+        ba::write(client, ba::buffer("sc"sv));
+        for(int i = 0; i < 500 && m.bytes_received_.value() < bytes0 + 2; ++i)
+            this_thread::sleep_for(chrono::milliseconds(2));
+        ba::write(client, ba::buffer("md1\nscmd2\n"sv));
+        client.close();
+        for(int i = 0; i < 500 && (m.bytes_received_.value() < bytes0 + 13 || otus_hw10::s_live_sessions); ++i)
+            this_thread::sleep_for(chrono::milliseconds(2));
+        pool.stop();
+        io.join();
+        EXPECT_TRUE(server.drain(chrono::milliseconds(5000)));
+    }
+    cout.rdbuf(prev_cout);
+    EXPECT_EQ(out.str(), "bulk: scmd1, scmd2\n");
+}
+
+TEST(test_async, test_server_drain)
+{
+    using namespace std;
+    using otus_hw10::tcp;
+    namespace ba = boost::asio;
+
+    otus_hw10::Options options;
+    options.port = 0;
+    options.cmd_chunk_sz = 3;
+    auto& m = otus_hw7::metrics();
+    ba::io_context client_ctx;
+    auto open_client = [&client_ctx](uint16_t port, string_view data)
+    {
+        tcp::socket client(client_ctx);
+        client.connect(tcp::endpoint(ba::ip::address_v4::loopback(), port));
+        ba::write(client, ba::buffer(data));
+        return client;
+    };
+    auto wait_received = [&m](int64_t bytes)
+    {
+        for(int i = 0; i < 500 && m.bytes_received_.value() < bytes; ++i)
+            this_thread::sleep_for(chrono::milliseconds(2));
+    };
+
+    ostringstream out;
+    streambuf* prev_cout = cout.rdbuf(out.rdbuf());
+    {
+        // shutdown() закрывает соединения, сессии выводят неполные блоки, drain() дожидается исполнителей
+        otus_hw10::io_context_pool pool(1, otus_hw9::CpuSet_t{});
+        otus_hw10::async_server server(pool, options);
+        thread io([&pool](){ pool.run(); });
+        const int64_t bytes0 = m.bytes_received_.value();
+        tcp::socket c1 = open_client(server.port(), "sd1\nsd2\n");
+        tcp::socket c2 = open_client(server.port(), "sd3\n");
+        wait_received(bytes0 + 12);
+        server.shutdown();
+        for(int i = 0; i < 500 && server.closed_sessions() < 2; ++i)
+            this_thread::sleep_for(chrono::milliseconds(2));
+        for(int i = 0; i < 500 && otus_hw10::s_live_sessions; ++i)
+            this_thread::sleep_for(chrono::milliseconds(2));
+        pool.stop();
+        io.join();
+        EXPECT_EQ(server.closed_sessions(), 2u);
+        EXPECT_EQ(server.unfinished_sessions(), 0u);
+        EXPECT_TRUE(server.drain(chrono::milliseconds(5000)));
+    }
+    EXPECT_NE(out.str().find("bulk: sd1, sd2\n"), string::npos);
+    EXPECT_NE(out.str().find("bulk: sd3\n"), string::npos);
+    {
+        // потоки ввода-вывода остановлены раньше, чем закрылась сессия: ее блок не выведен - drain() сообщает об этом
+        otus_hw10::io_context_pool pool(1, otus_hw9::CpuSet_t{});
+        otus_hw10::async_server server(pool, options);
+        thread io([&pool](){ pool.run(); });
+        const int64_t bytes0 = m.bytes_received_.value();
+        tcp::socket c1 = open_client(server.port(), "sd4\n");
+        wait_received(bytes0 + 4);
+        pool.stop();
+        io.join();
+        EXPECT_EQ(server.unfinished_sessions(), 1u);
+        EXPECT_FALSE(server.drain(chrono::milliseconds(5000)));
+        EXPECT_EQ(out.str().find("bulk: sd4\n"), string::npos);
+    }
+    cout.rdbuf(prev_cout);
+}
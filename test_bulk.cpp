@@ -2,10 +2,19 @@
 #include <sstream>
 #include <list>
 #include <tuple>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #ifndef __PRETTY_FUNCTION__
 #include "pretty.h"
 #endif
 #include "bulk_internal.h"
+#include "latency_histogram.h"
+#include "bulk_trace.h"
+#include "bulk_utils.h"
+#include "bulkloadgen_internal.h"
 
 using namespace otus_hw7;
 
@@ -36,3 +45,386 @@ TEST(test_bulk, test_create_q)
     ICommandQueuePtr_t cmd_q = create_command_queue(ICommandQueue::Type::qInput);
     EXPECT_TRUE( cmd_q );
 }
+
+
+TEST(test_bulk, test_latency_histogram)
+{
+    LatencyHistogram hist;
+    EXPECT_EQ(hist.count(), 0);
+    EXPECT_EQ(hist.percentile(50.0), 0);
+    for(uint64_t v = 1; v <= 100000; ++v)
+        hist.record(v);
+    EXPECT_EQ(hist.count(), 100000);
+    EXPECT_EQ(hist.max(), 100000);
+    // погрешность корзины не больше 2^-6
+    EXPECT_NEAR(double(hist.percentile(50.0)), 50000.0, 50000.0 / 64);
+    EXPECT_NEAR(double(hist.percentile(99.0)), 99000.0, 99000.0 / 64);
+    EXPECT_NEAR(double(hist.percentile(99.9)), 99900.0, 99900.0 / 64);
+    EXPECT_EQ(hist.percentile(100.0), 100000);
+    for(uint64_t v : {0ull, 1ull, 127ull, 128ull, 1000ull, ~0ull})
+    {
+        size_t idx = LatencyHistogram::index_of(v);
+        EXPECT_LT(idx, LatencyHistogram::bucket_count);
+        EXPECT_GE(LatencyHistogram::highest_of(idx), v);
+    }
+
+    LatencyHistogram other;
+    other.record(1);
+    hist.merge(other);
+    EXPECT_EQ(hist.count(), 100001);
+    hist.reset();
+    EXPECT_EQ(hist.count(), 0);
+}
+
+TEST(test_bulk, test_loadgen_observer)
+{
+    using namespace otus_hw10;
+    size_t conn{}, seq{};
+    EXPECT_EQ(make_token(3, 17), "c3.17");
+    EXPECT_TRUE(parse_token("c3.17", conn, seq));
+    EXPECT_EQ(conn, 3u);
+    EXPECT_EQ(seq, 17u);
+    EXPECT_FALSE(parse_token("c3", conn, seq));
+    EXPECT_FALSE(parse_token("x3.17", conn, seq));
+    EXPECT_FALSE(parse_token("c3.17x", conn, seq));
+    EXPECT_FALSE(parse_token("c.17", conn, seq));
+
+    // задержка - от времени отправки по расписанию; повторная и чужая команды не учитываются
+    SentRegistry registry(2, 4);
+    LoadStats stats;
+    BulkObserver observer(registry, stats);
+    EXPECT_TRUE(registry.mark_sent(0, 0, 1000));
+    EXPECT_TRUE(registry.mark_sent(1, 2, 3000));
+    EXPECT_FALSE(registry.mark_sent(2, 0, 1000));
+    observer.on_line("bulk: c0.0, c1.2, c0.0, other", 11000);
+    observer.on_line("not a bulk", 12000);
+    EXPECT_EQ(stats.received_bulks_, 1u);
+    EXPECT_EQ(stats.received_cmds_, 2u);
+    EXPECT_EQ(stats.foreign_cmds_, 2u);
+    EXPECT_EQ(stats.latency_ns_.count(), 2u);
+    EXPECT_EQ(stats.latency_ns_.max(), 10000u);
+    EXPECT_EQ(stats.last_received_ns_, 11000);
+}
+
+TEST(test_bulk, test_trace)
+{
+    trace(TraceEventId::kParseBulk, TracePhase::kInstant, 1, 0);
+    trace_start(16);
+    EXPECT_TRUE(trace_enabled());
+    {
+        TraceScope scope(TraceEventId::kDispatchBulk, 7, 3);
+        std::thread t([](){ trace(TraceEventId::kSteal, TracePhase::kInstant, 1, 2); });
+        t.join();
+    }
+    // кольцо потока хранит последние 16 записей
+    for(int i = 0; i < 100; ++i)
+        trace(TraceEventId::kParseBulk, TracePhase::kInstant, static_cast<uint64_t>(i), 0);
+    trace_stop();
+    EXPECT_FALSE(trace_enabled());
+    trace(TraceEventId::kParseBulk, TracePhase::kInstant, 1000, 0);
+
+    const std::string path = "test_trace.bin";
+    EXPECT_EQ(trace_dump(path), 17);
+    std::ifstream ifs(path, std::ios_base::binary);
+    TraceFileHeader header{};
+    ASSERT_TRUE(ifs.read(reinterpret_cast<char*>(&header), sizeof(header)));
+    EXPECT_EQ(std::string(header.magic_, 4), "BTRC");
+    EXPECT_EQ(header.count_, 17);
+    EXPECT_GT(header.ticks_per_us_, 0.0);
+    std::vector<TraceRecord> records(header.count_);
+    ASSERT_TRUE(ifs.read(reinterpret_cast<char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(TraceRecord))));
+    EXPECT_EQ(records.front().event_, static_cast<uint16_t>(TraceEventId::kSteal));
+    EXPECT_EQ(records.back().arg0_, 99);
+    EXPECT_TRUE(std::is_sorted(records.begin(), records.end(), [](auto const& a, auto const& b){ return a.ticks_ < b.ticks_; }));
+    EXPECT_STREQ(trace_event_name(records.back().event_), "parse_bulk");
+    std::remove(path.c_str());
+}
+
+TEST(test_bulk, test_trace_concurrent)
+{
+    // писатели не останавливаются на перезапусках трассы: после trace_stop() кольца больше не меняются
+    std::atomic<bool> done{false};
+    std::vector<std::thread> writers;
+    for(int t = 0; t < 4; ++t)
+        writers.emplace_back([&done](){
+            for(uint64_t i = 0; !done; ++i)
+                trace(TraceEventId::kExecuteQueue, TracePhase::kInstant, i, 0);
+        });
+    const std::string path = "test_trace_concurrent.bin";
+    for(int round = 0; round < 20; ++round)
+    {
+        trace_start(64);
+        std::this_thread::yield();
+        trace_stop();
+        const size_t count = trace_dump(path);
+        EXPECT_EQ(trace_dump(path), count);
+    }
+    done = true;
+    for(auto& w : writers)
+        w.join();
+    std::remove(path.c_str());
+}
+
+TEST(test_bulk, test_timestamp_us)
+{
+    struct FileNamer : public CmdLogFileSetuper
+    {
+        using CmdLogFileSetuper::get_log_filenm;
+    };
+
+    std::istringstream iss("1\n2\n");
+    InputParser parser(2, iss, std::make_unique<CommandCreator>(), true);
+    ICommandQueuePtr_t cmd_q = create_command_queue(ICommandQueue::Type::qInput);
+    EXPECT_EQ(parser.read_next_bulk(*cmd_q), IInputParser::Status::kReady);
+    EXPECT_GT(cmd_q->created_at_us_, 0u);
+    EXPECT_EQ(cmd_q->created_at_, static_cast<time_t>(cmd_q->created_at_us_ / 1000000));
+    EXPECT_LE(cmd_q->created_at_, coarse_time() + 1);
+
+    ICommandContext ctx;
+    ctx.cmd_created_at_ = 1700000000;
+    ctx.cmd_created_at_us_ = 1700000000000042ull;
+    ctx.bulk_id_ = 7;
+    FileNamer namer;
+    const std::string name = namer.get_log_filenm(ctx);
+    EXPECT_EQ(name.rfind("1700000000.000042-7-", 0), 0u);
+    EXPECT_EQ(name.substr(name.size() - 4), ".log");
+    // без меток в мкс - прежний формат
+    ctx.cmd_created_at_us_ = 0;
+    EXPECT_EQ(namer.get_log_filenm(ctx).rfind("1700000000-7-", 0), 0u);
+}
+TEST(test_bulk, test_adaptive_bulk_size)
+{
+    // политика: размер под скорость потока, не больше чем вдвое за окно, в границах
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{0, 0}, 8, 2, 100), 4);
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{0, 0}, 2, 2, 100), 2);
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{200, 0}, 8, 2, 100), 10);
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{1e6, 0}, 8, 2, 100), 16);
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{1e6, 0}, 80, 2, 100), 100);
+    // файловые воркеры отстают - блок укрупняется даже при слабом потоке
+    EXPECT_EQ(AdaptiveBulkSize::target(LoadSample{0, 100}, 8, 2, 100), 16);
+
+    // глубина очереди подставлена: общая выборка зависит от метрик, накопленных другими тестами
+    constexpr QueueDepthFn_t idle_files = [](uint64_t){ return int64_t{0}; };
+    AdaptiveBulkSize sizer(2, 50, 100, idle_files);
+    EXPECT_EQ(sizer.size(0), 25);
+    EXPECT_EQ(metrics().bulk_size_effective_.load(), 25);
+
+    // процесс разбирает миллионы команд в секунду, а своя сессия - 100: блок уменьшается, а не растет
+    AdaptiveBulkSize slow(2, 100, 8, idle_files);
+    const uint64_t t0 = 1000;
+    EXPECT_EQ(slow.size(t0), 4);
+    metrics().commands_parsed_.add(1000000);
+    for(int i = 0; i < 10; ++i)
+        slow.count_command();
+    EXPECT_LE(slow.size(t0 + AdaptiveBulkSize::window_ns), 4u);
+    // быстрая сессия того же процесса - блок растет
+    AdaptiveBulkSize fast(2, 100, 8, idle_files);
+    EXPECT_EQ(fast.size(t0), 4);
+    for(int i = 0; i < 10000; ++i)
+        fast.count_command();
+    EXPECT_EQ(fast.size(t0 + AdaptiveBulkSize::window_ns), 8);
+
+    // новый размер парсер применяет со следующего блока
+    std::istringstream is("c1\nc2\nc3\nc4\nc5\n");
+    InputParser parser(2, is, std::make_unique<CommandCreator>());
+    ICommandQueuePtr_t q = create_command_queue(ICommandQueue::Type::qInput);
+    EXPECT_EQ(parser.read_next_bulk(*q), IInputParser::Status::kReady);
+    EXPECT_EQ(q->size(), 3);    // 2 команды + завершающая
+    q->reset();
+    parser.chunk_size(3);
+    EXPECT_EQ(parser.chunk_size(), 3);
+    EXPECT_EQ(parser.read_next_bulk(*q), IInputParser::Status::kReady);
+    EXPECT_EQ(q->size(), 4);
+}
+TEST(test_bulk, test_journal_replay)
+{
+    const std::string path = (std::filesystem::temp_directory_path() / "test_bulk.journal").string();
+    EXPECT_EQ(journal_open(path, false).records_, 0u);
+    EXPECT_TRUE(journal_enabled());
+    {
+        // первый блок записан в файл, "c" осталась в неполном статическом блоке
+        std::stringstream ss("a\nb\nc\n");
+        IProcessorPtr_t processor = create_processor(Options(2, &ss));
+        processor->process(true);
+        // оборванный отключением динамический блок не восстанавливается
+        std::stringstream ss_dyn("{\nx\n");
+        IProcessorPtr_t processor_dyn = create_processor(Options(2, &ss_dyn));
+        processor_dyn->process(true);
+    }
+    EXPECT_GT(metrics().journal_writes_.value(), 0);
+    // падение процесса: журнал не закрыт, хвост недописанной записи
+    journal_detail::enabled = false;
+    {
+        std::ofstream torn(path, std::ios_base::binary | std::ios_base::app);
+        torn.write("\x20\0\0\0\x01", 5);
+    }
+    JournalReplay replay = journal_open(path, false);
+    EXPECT_TRUE(replay.torn_);
+    EXPECT_EQ(replay.records_, 6u);     // 4 команды, kBulk и kDone первого блока
+    EXPECT_EQ(replay.bulks_, 1u);
+    EXPECT_EQ(replay.commands_, 1u);
+    // журнал начат заново
+    journal_close();
+    replay = journal_open(path, false);
+    EXPECT_EQ(replay.records_, 0u);
+    EXPECT_FALSE(replay.torn_);
+    journal_close();
+    EXPECT_FALSE(journal_enabled());
+    std::filesystem::remove(path);
+}
+
+TEST(test_bulk, test_journal_checkpoint)
+{
+    // завершенные блоки вытесняются контрольными точками, незавершенные переживают их
+    const std::string path = (std::filesystem::temp_directory_path() / "test_bulk_checkpoint.journal").string();
+    const int64_t checkpoints = metrics().journal_checkpoints_.value();
+    journal_open(path, false, 4096);
+    ICommandQueuePtr_t q = create_command_queue(ICommandQueue::Type::qInput);
+    // блок 1 закрыт, но не записан; поток 3 не закрыт
+    journal_command(1, "kept1", false);
+    q->bulk_id_ = 1;
+    journal_bulk(1, *q);
+    journal_command(3, "open3", false);
+    journal_commit();
+    for(ICommandQueue::id_t id = 2; id < 2000; ++id)
+    {
+        journal_command(2, "done", false);
+        q->bulk_id_ = id;
+        journal_bulk(2, *q);
+        journal_commit();
+        journal_done(id);
+    }
+    journal_commit();
+    EXPECT_GT(metrics().journal_checkpoints_.value(), checkpoints);
+    EXPECT_LT(std::filesystem::file_size(path), 2 * 4096u);
+    // падение процесса
+    journal_detail::enabled = false;
+    JournalReplay replay = journal_open(path, false);
+    EXPECT_FALSE(replay.torn_);
+    EXPECT_LT(replay.records_, 200u);
+    EXPECT_EQ(replay.bulks_, 2u);
+    EXPECT_EQ(replay.commands_, 2u);
+    journal_close();
+    std::filesystem::remove(path);
+}
+
+TEST(test_bulk, test_journal_reopen_concurrent)
+{
+    // журнал открывается и закрывается, пока файловые воркеры пишут отметки и фиксируют записи
+    const std::string path = (std::filesystem::temp_directory_path() / "test_bulk_concurrent.journal").string();
+    std::atomic<bool> done{false};
+    std::vector<std::thread> writers;
+    for(uint64_t t = 1; t <= 4; ++t)
+        writers.emplace_back([&done, t](){
+            for(ICommandQueue::id_t i = 0; !done; ++i)
+            {
+                journal_done(i);
+                journal_discard(t);
+                journal_commit();
+            }
+        });
+    for(int round = 0; round < 20; ++round)
+    {
+        JournalReplay replay = journal_open(path, false);
+        EXPECT_EQ(replay.bulks_, 0u);
+        std::this_thread::yield();
+        journal_close();
+    }
+    done = true;
+    for(auto& w : writers)
+        w.join();
+    EXPECT_FALSE(journal_enabled());
+    std::filesystem::remove(path);
+}
+
+TEST(test_bulk, test_file_bulk_queues)
+{
+    // блоки исполняют параллельно два файловых воркера: в файле блока - только его команды
+    struct BulkCapture : public QueueExecutor
+    {
+        ICommandPtrArray_t bulks_;
+        void execute_from_array(ICommandQueue&, ICommandContext&, ICommandPtrArray_t const& commands, size_t pos, size_t cnt) override
+        {
+            bulks_.insert(bulks_.end(), commands.begin() + pos, commands.begin() + pos + cnt);
+        }
+    };
+    constexpr size_t bulk_count = 2, cmd_count = 500;
+    constexpr ICommandQueue::id_t first_id = 900001;
+    constexpr time_t created_at = 1700000001;
+    auto capture = std::make_shared<BulkCapture>();
+    QueueExecutorToFileInitializer initializer(capture);
+    ICommandQueuePtr_t q_file = create_command_queue(ICommandQueue::Type::qFile);
+    for(size_t b = 0; b < bulk_count; ++b)
+    {
+        ICommandPtrArray_t commands;
+        for(size_t i = 0; i < cmd_count; ++i)
+            commands.emplace_back(std::make_shared<SimpleCommand>("b" + std::to_string(b) + ";"));
+        ICommandContext ctx;
+        initializer.execute_from_array(*q_file, ctx, commands, 0, commands.size());
+    }
+    ASSERT_EQ(capture->bulks_.size(), bulk_count);
+
+    std::atomic<size_t> ready{0};
+    std::vector<std::thread> workers;
+    for(size_t b = 0; b < bulk_count; ++b)
+        workers.emplace_back([&, b](){
+            ICommandContext ctx;
+            ctx.bulk_size_ = cmd_count;
+            ctx.cmd_created_at_ = created_at;
+            ctx.bulk_id_ = first_id + b;
+            for(++ready; ready < bulk_count; )
+                std::this_thread::yield();
+            (*capture->bulks_[b])(ctx);
+        });
+    for(auto& w : workers)
+        w.join();
+    capture->bulks_.clear();    // файлы закрываются вместе с командами
+
+    size_t files = 0;
+    for(auto const& entry : std::filesystem::directory_iterator(std::filesystem::current_path()))
+    {
+        const std::string name = entry.path().filename().string();
+        for(size_t b = 0; b < bulk_count; ++b)
+        {
+            if( name.rfind(std::to_string(created_at) + "-" + std::to_string(first_id + b) + "-", 0) != 0 )
+                continue;
+            std::ifstream ifs(entry.path());
+            const std::string content{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+            std::string expected;
+            for(size_t i = 0; i < cmd_count; ++i)
+                expected += "b" + std::to_string(b) + ";";
+            EXPECT_EQ(content, expected);
+            ifs.close();
+            std::filesystem::remove(entry.path());
+            ++files;
+        }
+    }
+    EXPECT_EQ(files, bulk_count);
+}
+
+TEST(test_bulk, test_bulk_id)
+{
+    // ИД уникальны между потоками и растут в пределах потока
+    constexpr size_t thread_count = 4, per_thread = 3 * bulk_id_lease + 5;
+    std::vector<std::vector<ICommandQueue::id_t>> ids(thread_count);
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < thread_count; ++t)
+        threads.emplace_back([&ids, t]()
+        {
+            for(size_t i = 0; i < per_thread; ++i)
+                ids[t].push_back(next_bulk_id());
+        });
+    for(auto& t : threads)
+        t.join();
+
+    std::vector<ICommandQueue::id_t> all;
+    for(auto const& v : ids)
+    {
+        EXPECT_TRUE(std::is_sorted(v.begin(), v.end()));
+        EXPECT_GE(v.back() - v.front(), per_thread - 1);
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    EXPECT_EQ(std::adjacent_find(all.begin(), all.end()), all.end());
+    EXPECT_NE(all.front(), ICommandQueue::id_t{});
+}
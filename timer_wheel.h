@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace otus_hw9{
+
+    /// @brief Узел таймера, встраивается в объект-владелец (сессию). Один узел - один взведенный срок
+    struct TimerNode
+    {
+        TimerNode*  prev_ = nullptr;
+        TimerNode*  next_ = nullptr;
+        uint64_t    deadline_tick_ = 0;
+
+        TimerNode() = default;
+        TimerNode(TimerNode const&) = delete;
+        TimerNode& operator=(TimerNode const&) = delete;
+
+        bool armed() const { return prev_ != nullptr; }
+    };
+
+    /// @brief Иерархическое колесо таймеров: 4 уровня по 64 слота, уровень l хранит сроки, отличающиеся от текущего тика 
+    ///        начиная с разряда 6*l. Взвод и снятие - O(1), узел спускается на нижний уровень не больше 3 раз, 
+    ///        так что и срабатывание O(1) в среднем; далекие сроки (тайм-ауты простоя) не перебираются на каждом обороте.
+    ///        Пустые тики проматываются сразу до ближайшего события. Не потокобезопасно - синхронизирует владелец колеса.
+    class TimerWheel
+    {
+        static constexpr unsigned level_bits = 6;
+        static constexpr unsigned levels = 4;
+        static constexpr uint64_t slot_count = uint64_t(1) << level_bits;
+        static constexpr uint64_t slot_mask = slot_count - 1;
+
+    public:
+        TimerWheel(std::chrono::nanoseconds tick, uint64_t now_ns)
+            : tick_ns_(static_cast<uint64_t>(std::max<int64_t>(tick.count(), 1))), current_tick_(now_ns / tick_ns_), size_{}
+        {
+            for(auto& level : slots_)
+                for(auto& head : level)
+                    head.prev_ = head.next_ = &head;
+        }
+
+        TimerWheel(TimerWheel const&) = delete;
+        TimerWheel& operator=(TimerWheel const&) = delete;
+
+        size_t   size() const { return size_; }
+        bool     empty() const { return !size_; }
+        uint64_t tick_ns() const { return tick_ns_; }
+
+        /// @brief Взвести (или перевзвести) таймер на срок deadline_ns; срок округляется вверх до тика
+        void schedule(TimerNode& node, uint64_t deadline_ns)
+        {
+            cancel(node);
+            uint64_t tick = (deadline_ns + tick_ns_ - 1) / tick_ns_;
+            node.deadline_tick_ = tick > current_tick_ ? tick : current_tick_ + 1;
+            insert(node);
+            ++size_;
+        }
+
+        void cancel(TimerNode& node)
+        {
+            if( !node.armed() )
+                return;
+            unlink(node);
+            --size_;
+        }
+
+        /// @brief Провернуть колесо до now_ns. Для каждого истекшего узла, уже снятого с колеса, вызывается on_expire(TimerNode&);
+        ///        обработчик может снова взвести или снять этот и другие таймеры
+        /// @return число сработавших таймеров
+        template <typename OnExpire>
+        size_t advance(uint64_t now_ns, OnExpire&& on_expire)
+        {
+            const uint64_t target = now_ns / tick_ns_;
+            size_t fired = 0;
+            while( current_tick_ < target )
+            {
+                const uint64_t next = size_ ? next_event_tick() : target + 1;
+                if( next > target )
+                {
+                    current_tick_ = target;
+                    break;
+                }
+                current_tick_ = next;
+                cascade();
+
+                // слот отцепляется целиком: обработчик может трогать узлы слота, не ломая обход
+                TimerNode due;
+                TimerNode& head = slots_[0][current_tick_ & slot_mask];
+                if( head.next_ == &head )
+                    continue;
+                due.next_ = head.next_, due.prev_ = head.prev_;
+                due.next_->prev_ = &due, due.prev_->next_ = &due;
+                head.prev_ = head.next_ = &head;
+                while( due.next_ != &due )
+                {
+                    TimerNode& node = *due.next_;
+                    unlink(node);
+                    --size_;
+                    ++fired;
+                    on_expire(node);
+                }
+            }
+            return fired;
+        }
+
+        /// @brief Срок в нс, к которому стоит провернуть колесо: ближайший занятый слот нижнего уровня или 
+        ///        граница, на которой спускаются узлы верхних уровней. Для пустого колеса - следующий тик
+        uint64_t next_expiry_ns() const { return next_event_tick() * tick_ns_; }
+
+    private:
+        /// @brief Ближайший тик после текущего, на котором колесу есть что делать. Узлы уровня l лежат только в слотах 
+        ///        после текущего разряда в пределах блока уровня l + 1, поэтому достаточно просмотреть их по уровням снизу вверх
+        uint64_t next_event_tick() const
+        {
+            for(unsigned level = 0; level < levels; ++level)
+            {
+                const unsigned shift = level_bits * level;
+                const uint64_t digit = current_tick_ >> shift;
+                // верхний уровень просматривается по кругу - там же ждут сроки за горизонтом колеса
+                const uint64_t last = level == levels - 1 ? digit + slot_count : (digit | slot_mask) + 1;
+                for(uint64_t d = digit + 1; d < last; ++d)
+                {
+                    TimerNode const& head = slots_[level][d & slot_mask];
+                    if( head.next_ != &head )
+                        return d << shift;
+                }
+            }
+            return current_tick_ + 1;
+        }
+
+        void insert(TimerNode& node)
+        {
+            const uint64_t d = node.deadline_tick_;
+            unsigned level = 0;
+            // уровень - по старшему разряду, в котором срок расходится с текущим тиком
+            while( level < levels - 1 && (d >> (level_bits * (level + 1))) != (current_tick_ >> (level_bits * (level + 1))) )
+                ++level;
+            uint64_t digit = d >> (level_bits * level);
+            // верхний уровень идет по кругу: срок дальше горизонта ждет в последнем слоте оборота и перераскладывается при спуске
+            if( level == levels - 1 )
+                digit = std::min(digit, (current_tick_ >> (level_bits * level)) + slot_mask);
+            const uint64_t slot = digit & slot_mask;
+            TimerNode& head = slots_[level][slot];
+            node.prev_ = head.prev_;
+            node.next_ = &head;
+            head.prev_->next_ = &node;
+            head.prev_ = &node;
+        }
+
+        static void unlink(TimerNode& node)
+        {
+            node.prev_->next_ = node.next_;
+            node.next_->prev_ = node.prev_;
+            node.prev_ = node.next_ = nullptr;
+        }
+
+        /// @brief На границе блока тиков спустить узлы соответствующих слотов верхних уровней, начиная со старшего
+        void cascade()
+        {
+            unsigned top = 0;
+            while( top < levels - 1 && !(current_tick_ & ((uint64_t(1) << (level_bits * (top + 1))) - 1)) )
+                ++top;
+            for(unsigned level = top; level > 0; --level)
+            {
+                TimerNode& head = slots_[level][(current_tick_ >> (level_bits * level)) & slot_mask];
+                while( head.next_ != &head )
+                {
+                    TimerNode& node = *head.next_;
+                    unlink(node);
+                    insert(node);
+                }
+            }
+        }
+
+        uint64_t        tick_ns_;
+        std::array<std::array<TimerNode, slot_count>, levels>  slots_;
+        uint64_t        current_tick_;
+        size_t          size_;
+    };
+}
\ No newline at end of file